@@ -7,6 +7,8 @@ extern "C" {
 #endif
 
 #include "stdbool.h"
+#include "stddef.h"
+#include "stdint.h"
 #include "time.h"
 
 #define MIN_VOLTAGE 3.2
@@ -18,9 +20,17 @@ enum BasicConst{
     MAX_STR_LEN             = 32,
     API_LEN                 = 32,
     FORBIDDED_NOTIF_HOUR    = 6*60,
+    DAY_MIN_NUM             = 24*60,
+    WEEK_MIN_NUM            = WEEK_DAYS_NUM*DAY_MIN_NUM,
     DESCRIPTION_SIZE        = 20,
     FORECAST_LIST_SIZE      = 5,
+    // the schema gives two digits per day
+    MAX_DAY_NOTIF_NUM       = 99,
+    MAX_NOTIF_NUM           = WEEK_DAYS_NUM*MAX_DAY_NOTIF_NUM,
     NET_BUF_LEN             = 5100,
+    // the settings server's body and OTA buffers with their alignment,
+    // the larger user; the forecast inflater state is not kept here
+    NET_ARENA_LEN           = 2*NET_BUF_LEN + 2*8,
 };
 
 enum Bits{
@@ -33,7 +43,6 @@ enum Bits{
     BIT_IS_TIME                     = (1<<2),
     BIT_STA_CONF_OK                 = (1<<3),
     BIT_FORCE_UPDATE_FORECAST_DATA  = (1<<4),
-    BIT_UPDATE_TIME                 = (1<<5),
     BIT_IS_STA_CONNECTION           = (1<<6),
     BIT_CHECK_BAT                   = (1<<7),
     BIT_SERVER_RUN                  = (1<<8),
@@ -43,6 +52,7 @@ enum Bits{
     BIT_WAIT_BUT_INPUT              = (1<<12),
     BIT_WAIT_SIGNALE                = (1<<13),
     BIT_ERR_SSID_NOT_FOUND          = (1<<14),
+    BIT_SERVER_STOP                 = (1<<15),
     
     BIT_EVENT_NEW_T_MIN             = (1<<EVENT_BIT_SHIFT),
     BIT_EVENT_BUT_LONG_PRESSED      = (1<<(EVENT_BIT_SHIFT+1)),
@@ -62,6 +72,18 @@ enum Bits{
     BITS_NEW_BUT_DATA           = (BIT_EVENT_BUT_PRESSED|BIT_EVENT_BUT_LONG_PRESSED|BIT_EVENT_ENCODER_ROTATE)
 };
 
+// settings fields, a change marks its field dirty until the next commit
+enum SettingField{
+    SETTING_SSID        = (1<<0),
+    SETTING_PWD         = (1<<1),
+    SETTING_CITY        = (1<<2),
+    SETTING_KEY         = (1<<3),
+    SETTING_FLAGS       = (1<<4),
+    SETTING_LOUD        = (1<<5),
+    SETTING_OFFSET      = (1<<6),
+    SETTING_SCHEDULE    = (1<<7),
+};
+
 typedef struct {
     char ssid[MAX_STR_LEN+1];
     char pwd[MAX_STR_LEN+1];
@@ -70,8 +92,10 @@ typedef struct {
     unsigned flags;
     unsigned loud;
     int time_offset;
+    // notifications per day, Monday first
     unsigned schema[WEEK_DAYS_NUM];
-    unsigned *notification;
+    // minutes from Monday 00:00, sorted
+    uint16_t *notification;
 } settings_data_t;
 
 
@@ -82,6 +106,19 @@ typedef struct {
     char desciption[FORECAST_LIST_SIZE][DESCRIPTION_SIZE+1];
 } service_data_t;
 
+// filled by the main task, read by the telemetry endpoints
+typedef struct {
+    float temperature;
+    float humidity;
+    unsigned wakeup_timer_num;
+    unsigned wakeup_button_num;
+    unsigned long long sleep_ms;
+    unsigned long long radio_on_ms;
+    // since the first boot, kept in the settings record
+    unsigned flash_write_num;
+    unsigned flash_erase_num;
+} device_metrics_t;
+
 // --------------------------------------- GPIO
 void device_gpio_init(void);
 int device_set_pin(int pin, unsigned state);
@@ -101,6 +138,44 @@ int get_but_state();
 #define I2C_MASTER_SDA_IO       GPIO_NUM_22        
 
 
+// --------------------------------------- Network arena
+typedef enum {
+    NET_OWNER_NONE,
+    NET_OWNER_CLIENT,
+    NET_OWNER_SERVER,
+} net_owner_t;
+
+void net_arena_init();
+void *net_arena_acquire(net_owner_t owner, unsigned timeout_ms);
+void *net_arena_alloc(net_owner_t owner, size_t size);
+// one heap block for state too large to keep in the arena for good,
+// freed when the owner releases the arena
+void *net_arena_alloc_heap(net_owner_t owner, size_t size);
+void net_arena_release(net_owner_t owner);
+
+
+// --------------------------------------- Snapshots
+// one writer at a time publishes, any number of readers copy without blocking
+typedef struct {
+    volatile unsigned seq;
+    size_t size;
+    void *copy[2];
+} snapshot_t;
+
+// copies_ is an array of two objects of the published type
+#define SNAPSHOT_INITIALIZER(copies_) \
+    { .seq = 0, .size = sizeof((copies_)[0]), .copy = { &(copies_)[0], &(copies_)[1] } }
+
+void snapshot_publish(snapshot_t *snap, const void *data);
+void snapshot_read(const snapshot_t *snap, void *data);
+
+void device_get_service_data(service_data_t *data);
+void device_publish_service_data(const service_data_t *data);
+// consistent copy for readers outside the task that changes settings,
+// without the schedule: notification is NULL, is_signale() and
+// device_next_notification() read their own copy of it
+void device_get_settings(settings_data_t *settings);
+
 
 bool is_signal_allowed(const struct tm *tm_info);
 int device_get_offset();
@@ -109,12 +184,15 @@ void device_set_ssid(const char *str);
 void device_set_city(const char *str);
 void device_set_key(const char *str);
 int device_commit_changes();
+int device_commit_due();
+unsigned device_take_changed_settings();
 unsigned device_get_state();
 unsigned device_wait_bits_untile(unsigned bits, unsigned time_ms);
-void device_set_notify_data(unsigned *schema, unsigned *notif_data);
+void device_set_notify_data(uint16_t *notif_data, unsigned notif_num);
 bool is_signale(const struct tm *tm_info);
+time_t device_next_notification(time_t after);
 unsigned *device_get_schema();
-unsigned * device_get_notif();
+uint16_t *device_get_notif();
 char *device_get_ssid();
 char *device_get_pwd();
 char *device_get_api_key();
@@ -138,12 +216,10 @@ float device_get_volt();
     device_wait_bits_untile(bits, 10000/portTICK_PERIOD_MS)
     
 #define get_notif_size(schema) \
-    (get_notif_num(schema)*sizeof(unsigned))
-
+    (get_notif_num(schema)*sizeof(uint16_t))
 
-extern service_data_t service_data;
 
-extern char network_buf[];
+extern device_metrics_t device_metrics;
 
 
 
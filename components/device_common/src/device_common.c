@@ -21,18 +21,77 @@
 #include "lcd.h"
 
 #include "esp_log.h"
-
-
-static bool changes_main_data, changes_notify_data;
+#include "esp_timer.h"
+
+
+// flag toggles and single field posts are written together once they settle
+#define COMMIT_DEBOUNCE_US      (60*1000000LL)
+#define SETTINGS_VERSION        2
+// the schedule was kept as unsigned minutes of the day under NOTIFY_DATA_NAME
+#define SETTINGS_VERSION_DAY_SCHEDULE   1
+
+// what goes to flash, fixed size and free of pointers, the schedule is a separate blob
+typedef struct {
+    uint32_t version;
+    uint32_t flags;
+    int32_t time_offset;
+    uint32_t loud;
+    uint32_t write_num;
+    uint32_t erase_num;
+    uint8_t schema[WEEK_DAYS_NUM];
+    char ssid[MAX_STR_LEN+1];
+    char pwd[MAX_STR_LEN+1];
+    char city_name[MAX_STR_LEN+1];
+    char api_key[API_LEN+1];
+} settings_record_t;
+
+static unsigned dirty_fields, changed_fields;
+static int64_t commit_deadline_us;
 static settings_data_t main_data = {0};
-service_data_t service_data = {0};
-char network_buf[NET_BUF_LEN];
+// main_data is changed by the server task only, other tasks read the published view
+typedef struct {
+    // notification is NULL, the schedule is copied into the view
+    settings_data_t data;
+    // changes with every schedule, a cursor into an older one is not reused
+    unsigned schedule_gen;
+    uint16_t schedule[MAX_NOTIF_NUM];
+} settings_view_t;
+
+static settings_view_t settings_copies[2];
+static snapshot_t settings_snapshot = SNAPSHOT_INITIALIZER(settings_copies);
+static portMUX_TYPE settings_mux = portMUX_INITIALIZER_UNLOCKED;
+static unsigned schedule_gen;
+
+static service_data_t service_copies[2] = {
+    { .update_data_time = NO_DATA },
+    { .update_data_time = NO_DATA },
+};
+static snapshot_t service_snapshot = SNAPSHOT_INITIALIZER(service_copies);
+
+// first notification not yet passed, the minute and schedule it was found for
+static unsigned notif_cursor, notif_cursor_min, notif_cursor_gen;
+device_metrics_t device_metrics = {0};
 
 static EventGroupHandle_t clock_event_group = NULL, event_group = NULL;
-static const char *MAIN_DATA_NAME = "main_data";
+static const char *SETTINGS_NAME = "settings";
+// settings_data_t as it was stored before the versioned record
+static const char *LEGACY_DATA_NAME = "main_data";
 static const char *NOTIFY_DATA_NAME = "notify_data";
+static const char *SCHEDULE_NAME = "schedule";
 
 static int read_data();
+static int read_legacy_data();
+static void read_schedule(bool day_format);
+static void set_schedule(uint16_t *notif_data, unsigned notif_num);
+static void publish_settings();
+static unsigned find_next_notif(const settings_view_t *view, unsigned week_min);
+static unsigned lower_bound_notif(const settings_view_t *view, unsigned week_min);
+static bool is_week_min_allowed(unsigned week_min);
+static unsigned get_week_min(const struct tm *tm_info);
+static int compare_notif(const void *a, const void *b);
+static void mark_dirty(unsigned fields);
+static void update_stored_flags(unsigned flags);
+static void set_str(char *dst, const char *str, unsigned field);
 
 
 
@@ -41,16 +100,18 @@ static int read_data();
 
 void device_set_offset(int time_offset)
 {
+    if(time_offset == main_data.time_offset) return;
     set_offset(time_offset - main_data.time_offset);
     main_data.time_offset = time_offset;
-    changes_main_data = true;
+    mark_dirty(SETTING_OFFSET);
 }
 
 void device_set_loud(int loud)
 {
     set_loud(loud);
+    if(loud == main_data.loud) return;
     main_data.loud = loud;
-    changes_main_data = true;
+    mark_dirty(SETTING_LOUD);
 }
 
 unsigned device_get_loud()
@@ -70,62 +131,94 @@ unsigned get_notif_num(unsigned *schema)
 
 void device_set_pwd(const char *str)
 {
-    const int len = strnlen(str, MAX_STR_LEN);
-    memcpy(main_data.pwd, str, len);
-    main_data.pwd[len] = 0;
-    changes_main_data = true;
+    set_str(main_data.pwd, str, SETTING_PWD);
 }
 
 void device_set_ssid(const char *str)
 {
-    const int len = strnlen(str, MAX_STR_LEN);
-    memcpy(main_data.ssid, str, len);
-    main_data.ssid[len] = 0;
-    changes_main_data = true;
+    set_str(main_data.ssid, str, SETTING_SSID);
 }
 
 void device_set_city(const char *str)
 {
-    const int len = strnlen(str, MAX_STR_LEN);
-    memcpy(main_data.city_name, str, len);
-    main_data.city_name[len] = 0;
-    changes_main_data = true;
+    set_str(main_data.city_name, str, SETTING_CITY);
 }
 
 void device_set_key(const char *str)
 {
     if(strnlen(str, API_LEN+1) == API_LEN){
-        memcpy(main_data.api_key, str, API_LEN);
-        changes_main_data = true;
-        main_data.api_key[API_LEN] = 0;
+        set_str(main_data.api_key, str, SETTING_KEY);
     }
 }
 
-void device_set_notify_data(unsigned *schema, unsigned *notif_data)
+// takes ownership of notif_data, minutes from Monday 00:00 in any order
+void device_set_notify_data(uint16_t *notif_data, unsigned notif_num)
 {
-    if(main_data.notification){
-        free(main_data.notification);
-        main_data.notification = NULL;
+    if(notif_num > MAX_NOTIF_NUM){
+        // the published view holds at most this many
+        ESP_LOGE("", "schedule too long: %u", notif_num);
+        free(notif_data);
+        return;
     }
-    main_data.notification = notif_data;
-    memcpy(main_data.schema, schema, sizeof(main_data.schema));
-    changes_notify_data = true;
-    changes_main_data = true;
+    qsort(notif_data, notif_num, sizeof(uint16_t), compare_notif);
+    if(notif_num == get_notif_num(main_data.schema)
+            && (notif_num == 0 
+                || memcmp(main_data.notification, notif_data, notif_num*sizeof(uint16_t)) == 0)){
+        free(notif_data);
+        return;
+    }
+    set_schedule(notif_data, notif_num);
+    mark_dirty(SETTING_SCHEDULE);
 }
 
+// writes everything dirty now, schedule and record go in one batch since the record holds its size
 int device_commit_changes()
 {
-    if(changes_main_data){
-        CHECK_AND_RET_ERR(write_flash(MAIN_DATA_NAME, (uint8_t *)&main_data, sizeof(main_data)));
-        changes_main_data = false;
+    settings_record_t record = { 0 };
+    memory_record_t batch[2];
+    unsigned batch_num = 0;
+    if(!dirty_fields) return ESP_OK;
+    if(dirty_fields&SETTING_SCHEDULE){
+        batch[batch_num++] = (memory_record_t){
+            .name = SCHEDULE_NAME,
+            .data = main_data.notification,
+            .size = get_notif_size(main_data.schema),
+        };
     }
-    if(changes_notify_data){
-        CHECK_AND_RET_ERR(write_flash(NOTIFY_DATA_NAME, (uint8_t *)main_data.notification, get_notif_size(main_data.schema)));
-        changes_notify_data = false;
+    batch[batch_num++] = MEMORY_RECORD(SETTINGS_NAME, &record);
+    device_metrics.flash_write_num += batch_num;
+    record.version = SETTINGS_VERSION;
+    record.flags = main_data.flags&STORED_FLAGS;
+    record.time_offset = main_data.time_offset;
+    record.loud = main_data.loud;
+    record.write_num = device_metrics.flash_write_num;
+    record.erase_num = device_metrics.flash_erase_num;
+    for(int i=0; i<WEEK_DAYS_NUM; ++i){
+        record.schema[i] = main_data.schema[i];
     }
+    memcpy(record.ssid, main_data.ssid, sizeof(record.ssid));
+    memcpy(record.pwd, main_data.pwd, sizeof(record.pwd));
+    memcpy(record.city_name, main_data.city_name, sizeof(record.city_name));
+    memcpy(record.api_key, main_data.api_key, sizeof(record.api_key));
+    CHECK_AND_RET_ERR(write_records(batch, batch_num));
+    dirty_fields = 0;
     return ESP_OK;
 }
 
+int device_commit_due()
+{
+    if(!dirty_fields || esp_timer_get_time() < commit_deadline_us) return ESP_OK;
+    return device_commit_changes();
+}
+
+// fields changed since the previous call, committed or not
+unsigned device_take_changed_settings()
+{
+    const unsigned fields = changed_fields;
+    changed_fields = 0;
+    return fields;
+}
+
 unsigned device_get_state()
 {
     if( ! clock_event_group || ! event_group )return 0;
@@ -140,8 +233,7 @@ unsigned  device_set_state(unsigned bits)
     EventBits_t lbits = bits&BIT_MASK;
     EventBits_t hbits = bits >> EVENT_BIT_SHIFT;
     if(bits&STORED_FLAGS){
-        main_data.flags |= bits;
-        changes_main_data = true;
+        update_stored_flags(main_data.flags | bits);
     }
     if(lbits){
         bits_return = xEventGroupSetBits(clock_event_group, (EventBits_t) lbits);
@@ -158,8 +250,7 @@ unsigned  device_clear_state(unsigned bits)
     EventBits_t lbits = bits&BIT_MASK;
     EventBits_t hbits = bits >> EVENT_BIT_SHIFT;
     if(bits&STORED_FLAGS){
-        main_data.flags &= ~bits;
-        changes_main_data = true;
+        update_stored_flags(main_data.flags & ~bits);
     }
     if(lbits){
         bits_return = xEventGroupClearBits(clock_event_group, (EventBits_t) lbits);
@@ -189,7 +280,7 @@ unsigned  *device_get_schema()
     return main_data.schema;
 }
 
-unsigned *  device_get_notif()
+uint16_t *device_get_notif()
 {
     return main_data.notification;
 }
@@ -218,20 +309,206 @@ int device_get_offset()
 
 static int read_data()
 {
-    memset(&service_data, 0, sizeof(service_data));
+    settings_record_t record = { 0 };
+    bool day_schedule = true;
     memset(&main_data, 0, sizeof(main_data));
-    service_data.update_data_time = NO_DATA;
-    CHECK_AND_RET_ERR(read_flash(MAIN_DATA_NAME, (unsigned char *)&main_data, sizeof(main_data)));
+    if(read_records(&MEMORY_RECORD(SETTINGS_NAME, &record), 1)
+            && (record.version == SETTINGS_VERSION || record.version == SETTINGS_VERSION_DAY_SCHEDULE)){
+        main_data.flags = record.flags&STORED_FLAGS;
+        main_data.time_offset = record.time_offset;
+        main_data.loud = record.loud;
+        for(int i=0; i<WEEK_DAYS_NUM; ++i){
+            main_data.schema[i] = record.schema[i];
+        }
+        memcpy(main_data.ssid, record.ssid, sizeof(main_data.ssid));
+        memcpy(main_data.pwd, record.pwd, sizeof(main_data.pwd));
+        memcpy(main_data.city_name, record.city_name, sizeof(main_data.city_name));
+        memcpy(main_data.api_key, record.api_key, sizeof(main_data.api_key));
+        device_metrics.flash_write_num = record.write_num;
+        device_metrics.flash_erase_num = record.erase_num;
+        day_schedule = record.version == SETTINGS_VERSION_DAY_SCHEDULE;
+    } else {
+        CHECK_AND_RET_ERR(read_legacy_data());
+    }
     device_set_state(main_data.flags&STORED_FLAGS);
     set_loud(main_data.loud);
-    const unsigned notif_data_byte_num = get_notif_size(main_data.schema);
-    if(notif_data_byte_num){
-        main_data.notification = (unsigned*)malloc(notif_data_byte_num);
-        CHECK_AND_RET_ERR(read_flash(NOTIFY_DATA_NAME, (unsigned char *)main_data.notification, notif_data_byte_num));
+    read_schedule(day_schedule);
+    publish_settings();
+    // what was read at boot is not a change
+    changed_fields = 0;
+    CHECK_AND_RET_ERR(device_commit_changes());
+    if(day_schedule){
+        // the old keys go only once the new ones are stored
+        if(erase_flash(LEGACY_DATA_NAME) == ESP_OK) device_metrics.flash_erase_num += 1;
+        if(erase_flash(NOTIFY_DATA_NAME) == ESP_OK) device_metrics.flash_erase_num += 1;
     }
     return ESP_OK;
 }
 
+// the old blob held a heap pointer that is meaningless after reboot
+static int read_legacy_data()
+{
+    if(!read_records(&MEMORY_RECORD(LEGACY_DATA_NAME, &main_data), 1)) return ESP_FAIL;
+    main_data.notification = NULL;
+    main_data.flags &= STORED_FLAGS;
+    mark_dirty(SETTING_SSID|SETTING_PWD|SETTING_CITY|SETTING_KEY
+                |SETTING_FLAGS|SETTING_LOUD|SETTING_OFFSET);
+    return ESP_OK;
+}
+
+// day_format: unsigned minutes of the day grouped by schema, as stored before SETTINGS_VERSION 2
+static void read_schedule(bool day_format)
+{
+    const unsigned notif_num = get_notif_num(main_data.schema);
+    uint16_t *notif_data = NULL;
+    bool is_valid = true;
+    if(day_format){
+        // the record is rewritten in the new version even without a schedule
+        mark_dirty(SETTING_SCHEDULE);
+    }
+    if(notif_num > MAX_NOTIF_NUM){
+        is_valid = false;
+    } else if(notif_num){
+        notif_data = (uint16_t *)malloc(notif_num*sizeof(uint16_t));
+        if(notif_data == NULL){
+            is_valid = false;
+        } else if(day_format){
+            unsigned *day_data = (unsigned *)malloc(notif_num*sizeof(unsigned));
+            is_valid = day_data && read_flash(NOTIFY_DATA_NAME, day_data, notif_num*sizeof(unsigned)) == ESP_OK;
+            for(unsigned day=0, i=0; is_valid && day<WEEK_DAYS_NUM; ++day){
+                for(unsigned n=0; n<main_data.schema[day]; ++n, ++i){
+                    notif_data[i] = day*DAY_MIN_NUM + day_data[i]%DAY_MIN_NUM;
+                }
+            }
+            free(day_data);
+        } else {
+            is_valid = read_flash(SCHEDULE_NAME, notif_data, notif_num*sizeof(uint16_t)) == ESP_OK;
+        }
+        for(unsigned i=0; is_valid && i<notif_num; ++i){
+            is_valid = notif_data[i] < WEEK_MIN_NUM;
+        }
+    }
+    if(!is_valid){
+        // a schedule that does not match its size is dropped rather than misread
+        ESP_LOGE("", "schedule dropped");
+        free(notif_data);
+        set_schedule(NULL, 0);
+        mark_dirty(SETTING_SCHEDULE);
+        return;
+    }
+    qsort(notif_data, notif_num, sizeof(uint16_t), compare_notif);
+    set_schedule(notif_data, notif_num);
+}
+
+// readers never see the pointer, the old schedule can go right away
+static void set_schedule(uint16_t *notif_data, unsigned notif_num)
+{
+    free(main_data.notification);
+    main_data.notification = notif_data;
+    memset(main_data.schema, 0, sizeof(main_data.schema));
+    for(unsigned i=0; i<notif_num; ++i){
+        main_data.schema[notif_data[i]/DAY_MIN_NUM] += 1;
+    }
+    schedule_gen += 1;
+}
+
+// staged in a static view, it is too large for the httpd task's stack
+static void publish_settings()
+{
+    static settings_view_t view;
+    const unsigned notif_num = get_notif_num(main_data.schema);
+    portENTER_CRITICAL_SAFE(&settings_mux);
+    view.data = main_data;
+    view.data.notification = NULL;
+    view.schedule_gen = schedule_gen;
+    if(notif_num){
+        memcpy(view.schedule, main_data.notification, notif_num*sizeof(uint16_t));
+    }
+    snapshot_publish(&settings_snapshot, &view);
+    portEXIT_CRITICAL_SAFE(&settings_mux);
+}
+
+// index of the first notification at or after week_min, it only moves forward 
+// while the clock does, so the per-minute check does not scan the schedule
+static unsigned find_next_notif(const settings_view_t *view, unsigned week_min)
+{
+    const unsigned notif_num = get_notif_num((unsigned *)view->data.schema);
+    if(week_min < notif_cursor_min || view->schedule_gen != notif_cursor_gen){
+        // a new week, the clock was set back or the schedule replaced
+        notif_cursor = 0;
+        notif_cursor_gen = view->schedule_gen;
+    }
+    while(notif_cursor < notif_num && view->schedule[notif_cursor] < week_min){
+        ++notif_cursor;
+    }
+    notif_cursor_min = week_min;
+    return notif_cursor;
+}
+
+// binary search, it does not move the cursor is_signale() keeps
+static unsigned lower_bound_notif(const settings_view_t *view, unsigned week_min)
+{
+    unsigned low = 0, high = get_notif_num((unsigned *)view->data.schema);
+    while(low < high){
+        const unsigned mid = (low + high) / 2;
+        if(view->schedule[mid] < week_min){
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// quiet hours and Sundays, the same rule is_signal_allowed() applies to the clock
+static bool is_week_min_allowed(unsigned week_min)
+{
+    const struct tm tm_info = {
+        .tm_wday = (week_min/DAY_MIN_NUM + 1) % WEEK_DAYS_NUM,
+        .tm_hour = week_min%DAY_MIN_NUM / 60,
+        .tm_min = week_min%60,
+    };
+    return is_signal_allowed(&tm_info);
+}
+
+// the schedule week starts on Monday
+static unsigned get_week_min(const struct tm *tm_info)
+{
+    const unsigned day = (tm_info->tm_wday + WEEK_DAYS_NUM - 1) % WEEK_DAYS_NUM;
+    return day*DAY_MIN_NUM + tm_info->tm_hour*60 + tm_info->tm_min;
+}
+
+static int compare_notif(const void *a, const void *b)
+{
+    return (int)*(const uint16_t *)a - (int)*(const uint16_t *)b;
+}
+
+static void mark_dirty(unsigned fields)
+{
+    dirty_fields |= fields;
+    changed_fields |= fields;
+    commit_deadline_us = esp_timer_get_time() + COMMIT_DEBOUNCE_US;
+    publish_settings();
+}
+
+static void update_stored_flags(unsigned flags)
+{
+    flags = (main_data.flags&~STORED_FLAGS) | (flags&STORED_FLAGS);
+    if(flags != main_data.flags){
+        main_data.flags = flags;
+        mark_dirty(SETTING_FLAGS);
+    }
+}
+
+static void set_str(char *dst, const char *str, unsigned field)
+{
+    const int len = strnlen(str, MAX_STR_LEN);
+    if(strncmp(dst, str, len) == 0 && dst[len] == 0) return;
+    memcpy(dst, str, len);
+    dst[len] = 0;
+    mark_dirty(field);
+}
+
 bool is_signal_allowed(const struct tm *tm_info)
 {
     return tm_info->tm_wday != 0 && tm_info->tm_hour >= 6 && tm_info->tm_hour < 23;
@@ -239,25 +516,58 @@ bool is_signal_allowed(const struct tm *tm_info)
 
 bool is_signale(const struct tm *tm_info)
 {
-    if(is_signal_allowed(tm_info)){
-        int cur_min = tm_info->tm_hour*60 + tm_info->tm_min;
-        int cur_day = tm_info->tm_wday - 1;
-        if(cur_day > WEEK_DAYS_NUM)return false;
-        const unsigned notif_num = main_data.schema[cur_day];
-        unsigned *notif_data = main_data.notification;
-        if(notif_num && notif_data){
-            for(int i=0; i<cur_day-1; ++i){
-                // data offset
-                notif_data += main_data.schema[i];
-            }
-            for(int i=0; i<notif_num; ++i){
-                if(notif_data[i] == cur_min){
-                    return true;
-                }
-            }
+    settings_view_t view;
+    if(!is_signal_allowed(tm_info)) return false;
+    snapshot_read(&settings_snapshot, &view);
+    const unsigned week_min = get_week_min(tm_info);
+    const unsigned i = find_next_notif(&view, week_min);
+    return i < get_notif_num(view.data.schema) && view.schedule[i] == week_min;
+}
+
+// start of the first notification minute at or after `after` that is allowed to sound, 
+// NO_DATA when the schedule has none
+time_t device_next_notification(time_t after)
+{
+    struct tm tm_info;
+    settings_view_t view;
+    snapshot_read(&settings_snapshot, &view);
+    const unsigned notif_num = get_notif_num(view.data.schema);
+    if(notif_num == 0) return NO_DATA;
+    localtime_r(&after, &tm_info);
+    const time_t minute_start = after - tm_info.tm_sec;
+    const unsigned week_min = get_week_min(&tm_info);
+    // a minute already begun is not ahead any more
+    unsigned i = lower_bound_notif(&view, week_min + (tm_info.tm_sec ? 1 : 0));
+    unsigned week_base = 0;
+    for(unsigned n=0; n<notif_num; ++n, ++i){
+        if(i == notif_num){
+            i = 0;
+            week_base = WEEK_MIN_NUM;
+        }
+        const unsigned notif_min = view.schedule[i];
+        if(is_week_min_allowed(notif_min)){
+            return minute_start + (time_t)(week_base + notif_min - week_min)*60;
         }
     }
-    return false;
+    return NO_DATA;
+}
+
+void device_get_settings(settings_data_t *settings)
+{
+    settings_view_t view;
+    snapshot_read(&settings_snapshot, &view);
+    *settings = view.data;
+}
+
+void device_get_service_data(service_data_t *data)
+{
+    snapshot_read(&service_snapshot, data);
+}
+
+// the forecast task is the only writer
+void device_publish_service_data(const service_data_t *data)
+{
+    snapshot_publish(&service_snapshot, data);
 }
 
 
@@ -267,6 +577,7 @@ void device_init()
     assert(clock_event_group);
     event_group = xEventGroupCreate();
     assert(event_group);
+    net_arena_init();
     device_gpio_init();
     read_data();
     I2C_init();
@@ -280,8 +591,7 @@ void device_set_state_isr(unsigned bits)
     EventBits_t lbits = bits&BIT_MASK;
     EventBits_t hbits = bits >> EVENT_BIT_SHIFT;
     if(bits&STORED_FLAGS){
-        main_data.flags |= bits;
-        changes_main_data = true;
+        update_stored_flags(main_data.flags | bits);
     }
     if(lbits){
         xEventGroupSetBitsFromISR(clock_event_group, (EventBits_t) lbits, &pxHigherPriorityTaskWoken);
@@ -298,8 +608,7 @@ void  device_clear_state_isr(unsigned bits)
     EventBits_t lbits = bits&BIT_MASK;
     EventBits_t hbits = bits >> EVENT_BIT_SHIFT;
     if(bits&STORED_FLAGS){
-        main_data.flags &= ~bits;
-        changes_main_data = true;
+        update_stored_flags(main_data.flags & ~bits);
     }
     if(lbits){
         xEventGroupClearBitsFromISR(clock_event_group, lbits);
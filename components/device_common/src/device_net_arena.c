@@ -0,0 +1,78 @@
+#include "device_common.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "assert.h"
+#include "stdlib.h"
+#include "esp_log.h"
+
+#define ARENA_ALIGN 8
+
+
+static const char *TAG = "net_arena";
+
+// one buffer for all network users, only the owner may carve it up
+static char arena_buf[NET_ARENA_LEN] __attribute__((aligned(ARENA_ALIGN)));
+static size_t arena_used;
+static void *arena_heap;
+static volatile net_owner_t arena_owner = NET_OWNER_NONE;
+static SemaphoreHandle_t arena_mutex;
+
+
+void net_arena_init()
+{
+    arena_mutex = xSemaphoreCreateMutex();
+    assert(arena_mutex);
+}
+
+void *net_arena_acquire(net_owner_t owner, unsigned timeout_ms)
+{
+    if(arena_mutex == NULL || owner == NET_OWNER_NONE) return NULL;
+    if(xSemaphoreTake(arena_mutex, timeout_ms/portTICK_PERIOD_MS) != pdTRUE){
+        ESP_LOGE(TAG, "busy, owner %d", arena_owner);
+        return NULL;
+    }
+    arena_owner = owner;
+    arena_used = 0;
+    return arena_buf;
+}
+
+void *net_arena_alloc(net_owner_t owner, size_t size)
+{
+    if(owner != arena_owner){
+        ESP_LOGE(TAG, "%d is not the owner", owner);
+        return NULL;
+    }
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if(size > NET_ARENA_LEN - arena_used){
+        ESP_LOGE(TAG, "out of space");
+        return NULL;
+    }
+    void *ptr = arena_buf + arena_used;
+    arena_used += size;
+    return ptr;
+}
+
+void *net_arena_alloc_heap(net_owner_t owner, size_t size)
+{
+    if(owner != arena_owner){
+        ESP_LOGE(TAG, "%d is not the owner", owner);
+        return NULL;
+    }
+    if(arena_heap != NULL){
+        ESP_LOGE(TAG, "heap block in use");
+        return NULL;
+    }
+    arena_heap = malloc(size);
+    return arena_heap;
+}
+
+void net_arena_release(net_owner_t owner)
+{
+    if(owner != arena_owner) return;
+    free(arena_heap);
+    arena_heap = NULL;
+    arena_owner = NET_OWNER_NONE;
+    arena_used = 0;
+    xSemaphoreGive(arena_mutex);
+}
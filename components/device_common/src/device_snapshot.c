@@ -0,0 +1,30 @@
+#include "device_common.h"
+
+#include "string.h"
+
+
+// two copies and a sequence number (a latch): the writer always fills the copy
+// readers are not pointed at, so a reader never waits for a preempted writer,
+// it only retries when a whole publish step passed during its copy
+
+void snapshot_publish(snapshot_t *snap, const void *data)
+{
+    for(unsigned i=0; i<2; ++i){
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        // odd sends readers to copy[1] while copy[0] is written, even back to copy[0]
+        snap->seq += 1;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        memcpy(snap->copy[i], data, snap->size);
+    }
+}
+
+void snapshot_read(const snapshot_t *snap, void *data)
+{
+    unsigned seq;
+    do{
+        seq = snap->seq;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        memcpy(data, snap->copy[seq&1], snap->size);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }while(seq != snap->seq);
+}
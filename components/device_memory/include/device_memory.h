@@ -6,14 +6,33 @@
 extern "C" {
 #endif
 
+#include "stddef.h"
 
 
-int read_flash(const char* data_name, unsigned char *buf, unsigned data_size);
-int write_flash(const char* data_name, unsigned char *buf, unsigned data_size);
+// one NVS key and the object it is loaded into or stored from
+typedef struct {
+    const char *name;
+    void *data;
+    unsigned size;
+} memory_record_t;
+
+// the size follows the pointed type, no casts at the call site
+#define MEMORY_RECORD(name_, ptr_) \
+    ((memory_record_t){ .name = (name_), .data = (ptr_), .size = sizeof(*(ptr_)) })
+
+
+int read_flash(const char* data_name, void *buf, unsigned data_size);
+int write_flash(const char* data_name, const void *buf, unsigned data_size);
+int erase_flash(const char* data_name);
+// the handle is opened once and kept, a batch is read in one pass,
+// the result has bit i set for every records[i] that was read
+unsigned read_records(const memory_record_t *records, unsigned num);
+// all records of a batch land with a single commit
+int write_records(const memory_record_t *records, unsigned num);
 
 
 #ifdef __cplusplus
 }
 #endif
 
-#endif
\ No newline at end of file
+#endif
@@ -7,6 +7,13 @@
 static const char *SPACE_NAME = "nvs";
 
 static bool is_init;
+static nvs_handle_t nvs_handle;
+static bool is_open;
+
+
+static int open_handle();
+
+
 
 int init_nvs()
 {
@@ -22,32 +29,67 @@ int init_nvs()
     return ESP_OK;
 }
 
-int read_flash(const char* data_name, unsigned char *buf, unsigned data_size)
+int read_flash(const char* data_name, void *buf, unsigned data_size)
 {
-    nvs_handle_t nvs_handle;
+    const memory_record_t record = { .name = data_name, .data = buf, .size = data_size };
     if(data_size == 0)return ESP_OK;
     if(buf == NULL)return ESP_ERR_NO_MEM;
-    if(!is_init && init_nvs() != ESP_OK){
-        return ESP_FAIL;
-    }
-    CHECK_AND_RET_ERR(nvs_open(SPACE_NAME, NVS_READONLY, &nvs_handle));
-    CHECK_AND_RET_ERR(nvs_get_blob(nvs_handle, data_name, buf, &data_size));
-    nvs_close(nvs_handle);
-    return ESP_OK;
+    return read_records(&record, 1) ? ESP_OK : ESP_FAIL;
 }
 
-int write_flash(const char* data_name, unsigned char *buf, unsigned data_size)
+int write_flash(const char* data_name, const void *buf, unsigned data_size)
 {
-    nvs_handle_t nvs_handle;
+    const memory_record_t record = { .name = data_name, .data = (void *)buf, .size = data_size };
     if(data_size == 0)return ESP_OK;
     if(buf == NULL)return ESP_ERR_NO_MEM;
+    return write_records(&record, 1);
+}
+
+int erase_flash(const char* data_name)
+{
+    CHECK_AND_RET_ERR(open_handle());
+    const esp_err_t err = nvs_erase_key(nvs_handle, data_name);
+    if(err == ESP_OK){
+        nvs_commit(nvs_handle);
+    }
+    return err;
+}
+
+unsigned read_records(const memory_record_t *records, unsigned num)
+{
+    unsigned res = 0;
+    if(open_handle() != ESP_OK) return 0;
+    for(unsigned i=0; i<num; ++i){
+        size_t size = records[i].size;
+        if(size == 0 || records[i].data == NULL) continue;
+        // a stored blob of another size is a different layout, it is not read
+        if(nvs_get_blob(nvs_handle, records[i].name, records[i].data, &size) == ESP_OK
+                && size == records[i].size){
+            res |= 1U<<i;
+        }
+    }
+    return res;
+}
+
+int write_records(const memory_record_t *records, unsigned num)
+{
+    CHECK_AND_RET_ERR(open_handle());
+    for(unsigned i=0; i<num; ++i){
+        if(records[i].size == 0) continue;
+        if(records[i].data == NULL) return ESP_ERR_NO_MEM;
+        CHECK_AND_RET_ERR(nvs_set_blob(nvs_handle, records[i].name, records[i].data, records[i].size));
+    }
+    return nvs_commit(nvs_handle);
+}
+
+
+static int open_handle()
+{
+    if(is_open) return ESP_OK;
     if(!is_init && init_nvs() != ESP_OK){
         return ESP_FAIL;
     }
     CHECK_AND_RET_ERR(nvs_open(SPACE_NAME, NVS_READWRITE, &nvs_handle));
-    CHECK_AND_RET_ERR(nvs_set_blob(nvs_handle, data_name, buf, data_size));
-    CHECK_AND_RET_ERR(nvs_commit(nvs_handle));
-    nvs_close(nvs_handle);
+    is_open = true;
     return ESP_OK;
 }
-
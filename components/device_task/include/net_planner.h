@@ -0,0 +1,34 @@
+#ifndef NET_PLANNER_H
+#define NET_PLANNER_H
+
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "stdint.h"
+
+
+enum NetJob{
+    NET_JOB_TIME,
+    NET_JOB_FORECAST,
+    NET_JOB_NUM,
+};
+
+#define NET_JOB_BIT(job) (1u<<(job))
+
+
+void net_planner_schedule(int job, uint64_t delay_ms);
+unsigned net_planner_take_due();
+void net_planner_arm();
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
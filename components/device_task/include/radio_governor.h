@@ -0,0 +1,39 @@
+#ifndef RADIO_GOVERNOR_H
+#define RADIO_GOVERNOR_H
+
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "stdint.h"
+
+
+typedef struct {
+    unsigned day_radio_ms;
+    unsigned long long radio_ms;
+    float energy_mwh;
+    float volt;
+    // smoothed battery drain, volts per day, positive while discharging
+    float drain_per_day;
+    unsigned scale;
+} radio_governor_stats_t;
+
+
+void radio_governor_begin();
+void radio_governor_end();
+void radio_governor_update_voltage(float volt);
+uint64_t radio_governor_scale(uint64_t interval_ms);
+unsigned radio_governor_retry_num(unsigned retry_num);
+const radio_governor_stats_t *radio_governor_get_stats();
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
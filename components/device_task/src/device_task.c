@@ -5,6 +5,7 @@
 #include "esp_err.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/task.h"
 #include "portmacro.h"
 #include "esp_sleep.h"
 #include "esp_log.h"
@@ -13,6 +14,7 @@
 #include "periodic_task.h"
 #include "device_common.h"
 #include "forecast_http_client.h"
+#include "time_sync.h"
 #include "sound_generator.h"
 #include "dht20.h"
 #include "adc_reader.h"
@@ -21,6 +23,8 @@
 #include "lcd.h"
 #include "clock_module.h"
 #include "setting_server.h"
+#include "radio_governor.h"
+#include "net_planner.h"
 
 enum FuncId{
     SCREEN_MAIN,
@@ -43,20 +47,27 @@ enum TimeoutMS{
     DELAY_TRY_GET_DATA      = 2*TIMEOUT_MINUTE,
     DELAY_UPDATE_FORECAST   = 32*TIMEOUT_MINUTE,
     INTERVAL_CHECK_BAT      = TIMEOUT_MINUTE * 10,
-    INTERVAL_UPDATE_TIME    = 8*TIMEOUT_HOUR,
-    LOW_BAT_SIG_DELAY       = TIMEOUT_MINUTE * 10
+    LOW_BAT_SIG_DELAY       = TIMEOUT_MINUTE * 10,
+    SERVER_IDLE_TIMEOUT     = 2*TIMEOUT_MINUTE,
+    // the wake lands inside the notification minute, not at its very edge
+    ALARM_WAKE_MARGIN       = 500,
 };
 
 enum TaskDelay{
-    DELAY_SERV      = 100,
     DELAY_MAIN_TASK = 100,
 };
 
+enum{
+    STA_RETRY_NUM = 5,
+    TIME_SYNC_STACK = 3072,
+};
+
 static void timer_func(int cmd);
 static void setting_func(int cmd);
 static void main_func(int cmd);
 static void device_info_func(int cmd);
 static void weather_info_func(int cmd);
+static void stop_server_session();
 
 
 typedef void(*handler_func_t)(int);
@@ -90,12 +101,13 @@ static int timer_counter = 0;
 static bool timer_run;
 static float volt_val;
 static long long start_task_time;
+static volatile int time_sync_res;
 
-static void update_forecast_handler();
 static void timer_counter_handler();
 static void check_bat_status_handler();
-static void update_time_handler();
+static void run_net_session(unsigned jobs);
 static void low_bat_signal_handler();
+static long long get_ms_to_alarm();
 
 
 
@@ -108,13 +120,11 @@ static void main_task(void *pv)
     int timeout = TIMEOUT_BUT_INP;
     unsigned time_work = 0;
     set_offset(device_get_offset());
-    const struct tm * tinfo = get_cur_time_tm();
     next_screen = SCREEN_MAIN;
     device_set_pin(PIN_LCD_BACKLIGHT_EN, 0);
     lcd_init();
     device_set_state(BIT_UPDATE_FORECAST_DATA);
     create_periodic_task(check_bat_status_handler, TIMEOUT_MINUTE * 2, FOREVER);
-    create_periodic_task(update_time_handler, INTERVAL_UPDATE_TIME, FOREVER);
     bool backlight_en = false, task_run, but_pressed = true;
     float cur_volt_val;
     start_single_signale(120, 1500);
@@ -126,7 +136,8 @@ static void main_task(void *pv)
         start_task_time = esp_timer_get_time();
         device_set_pin(PIN_DHT20_EN, 1);
         if(dht20_wait() == ESP_OK){
-            dht20_read_data(&temp, NULL);
+            dht20_read_data(&temp, &device_metrics.humidity);
+            device_metrics.temperature = temp;
         }
         device_set_pin(PIN_DHT20_EN, 0);
         do{
@@ -164,11 +175,16 @@ static void main_task(void *pv)
                 device_clear_state(BIT_EVENT_NEW_DATA);
                 cmd = CMD_UPDATE_DATA; 
             } else if(bits&BIT_EVENT_NEW_MIN) {
+                if(bits&BIT_IS_TIME){
+                    time_sync_discipline();
+                }
                 if(screen == SCREEN_MAIN){
+                    // localtime() fills one buffer per task, it is read right after the call
+                    const struct tm *now_tm = get_cur_time_tm();
                     start_task_time = esp_timer_get_time();
                     if(bits&BIT_IS_TIME 
                         && bits&BIT_NOTIF_ENABLE
-                            && is_signale(tinfo)){
+                            && is_signale(now_tm)){
                         start_signale_series(100, 5, 2000);
                     }
                 }
@@ -181,11 +197,13 @@ static void main_task(void *pv)
                 device_clear_state(BIT_EVENT_NEW_T_MIN);
             } else if(bits&BIT_CHECK_BAT) {
                 cur_volt_val = device_get_voltage();
+                radio_governor_update_voltage(cur_volt_val);
                 if( ! ((cur_volt_val - volt_val) > 0.2) && cur_volt_val < ALARM_VOLTAGE){
                     if(cur_volt_val < MIN_VOLTAGE
-                        || (bits&BIT_IS_TIME && ! is_signal_allowed(tinfo))){
+                        || (bits&BIT_IS_TIME && ! is_signal_allowed(get_cur_time_tm()))){
                         device_set_pin(PIN_LCD_BACKLIGHT_EN, 0);
                         device_set_pin(PIN_DHT20_EN, 0);
+                        device_commit_changes();
                         vTaskDelay(1000/portTICK_PERIOD_MS);
                         esp_deep_sleep(UINT64_MAX);
                     }
@@ -225,16 +243,24 @@ static void main_task(void *pv)
             device_set_pin(PIN_LCD_BACKLIGHT_EN, 0);
             backlight_en = false;
         }
-        if(tinfo->tm_hour < 5){
+        if(get_cur_time_tm()->tm_hour < 5){
             sleep_time_ms = TIMEOUT_FOUR_MINUTE - time_work%TIMEOUT_MINUTE;
         } else {
             sleep_time_ms = TIMEOUT_MINUTE - time_work%TIMEOUT_MINUTE;
         }
+        const long long alarm_ms = get_ms_to_alarm();
+        if(alarm_ms != NO_DATA && alarm_ms < sleep_time_ms){
+            sleep_time_ms = alarm_ms;
+        }
+        device_commit_due();
         esp_sleep_enable_timer_wakeup(sleep_time_ms * 1000);
         esp_sleep_enable_ext0_wakeup((gpio_num_t)PIN_WAKEUP, 0);
         device_stop_timer();
+        const int64_t sleep_start = esp_timer_get_time();
         esp_light_sleep_start(); 
+        device_metrics.sleep_ms += (esp_timer_get_time() - sleep_start) / 1000;
         if(esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER){
+            device_metrics.wakeup_timer_num += 1;
             timeout = 1;
             device_set_state(BIT_EVENT_NEW_MIN);
             if(!timer_run){
@@ -242,6 +268,7 @@ static void main_task(void *pv)
             }
             but_pressed = false;
         } else {
+            device_metrics.wakeup_button_num += 1;
             but_pressed = true;
             timeout = TIMEOUT_BUT_INP;
         }
@@ -254,87 +281,116 @@ static void main_task(void *pv)
 static void service_task(void *pv)
 {
     uint32_t bits;
-    bool open_sesion;
-    int delay_update_forecast = DELAY_TRY_GET_DATA;
     vTaskDelay(100/portTICK_PERIOD_MS);
-    int wait_client_timeout;
     for(;;){
         bits = device_wait_bits_untile(BIT_UPDATE_FORECAST_DATA|BIT_START_SERVER|BIT_FORCE_UPDATE_FORECAST_DATA, 
                             portMAX_DELAY);
         device_set_state(BITS_DENIED_SLEEP);
         if(bits & BIT_START_SERVER){
+            radio_governor_begin();
             if(start_ap() == ESP_OK){
-                vTaskDelay(1500/portTICK_PERIOD_MS);
-                if(init_server(network_buf) == ESP_OK){
-                    wait_client_timeout = 0;
-                    device_set_state(BIT_SERVER_RUN);
-                    open_sesion = false;
-                    device_set_state(BIT_EVENT_NEW_DATA);
-                    while((bits = device_get_state()) & BIT_SERVER_RUN){
-                        if(open_sesion){
-                            if(!(bits&BIT_IS_AP_CLIENT) ){
-                                device_clear_state(BIT_SERVER_RUN);
-                            }
-                        } else if(bits&BIT_IS_AP_CLIENT){
-                            wait_client_timeout = 0;
-                            open_sesion = true;
-                        } else if(wait_client_timeout>TIMEOUT_MINUTE){
-                            device_clear_state(BIT_SERVER_RUN);
-                        } else {
-                            wait_client_timeout += DELAY_SERV;
-                        }
-                        vTaskDelay(DELAY_SERV/portTICK_PERIOD_MS);
-
+                if(init_server() == ESP_OK){
+                    device_clear_state(BIT_SERVER_STOP);
+                    device_set_state(BIT_SERVER_RUN|BIT_EVENT_NEW_DATA);
+                    // sleeps until stopped or idle, every request moves the idle deadline
+                    unsigned idle_ms;
+                    while((idle_ms = server_get_idle_ms()) < SERVER_IDLE_TIMEOUT){
+                        bits = device_wait_bits_untile(BIT_SERVER_STOP, 
+                                    (SERVER_IDLE_TIMEOUT - idle_ms)/portTICK_PERIOD_MS + 1);
+                        if(bits&BIT_SERVER_STOP) break;
                     }
+                    device_clear_state(BIT_SERVER_RUN|BIT_SERVER_STOP);
+                    device_set_state(BIT_EVENT_NEW_DATA);
                     deinit_server();
-                    bool changed_settings = device_commit_changes();
-                    if(changed_settings && ! (bits&BIT_FORECAST_OK) ){
-                        bits = device_set_state(BIT_UPDATE_FORECAST_DATA);
+                    device_commit_changes();
+                    const unsigned changed = device_take_changed_settings();
+                    if(changed&(SETTING_CITY|SETTING_KEY)
+                            || (changed&(SETTING_SSID|SETTING_PWD) && ! (device_get_state()&BIT_FORECAST_OK))){
+                        // new city or key, fetched in this same iteration
+                        bits |= BIT_FORCE_UPDATE_FORECAST_DATA;
                     }
                 }
                 wifi_stop();
             }
+            radio_governor_end();
             device_clear_state(BIT_START_SERVER);
         }
 
         if(bits&BIT_UPDATE_FORECAST_DATA || bits&BIT_FORCE_UPDATE_FORECAST_DATA){
-            if(connect_sta(device_get_ssid(), device_get_pwd()) == ESP_OK){
-                device_set_state(BIT_STA_CONF_OK);
-                if(bits&BIT_UPDATE_TIME || !(bits&BIT_IS_TIME)){
-                    vTaskDelay(500/portTICK_PERIOD_MS);
-                    if(device_update_time()){
-                        bits = device_set_state(BIT_IS_TIME);
-                    } else {
-                        init_sntp();
-                        bits = device_wait_bits(BIT_IS_TIME);
-                    }
-                    if(bits&BIT_IS_TIME){
-                        device_clear_state(BIT_UPDATE_TIME);  
-                    }
-                }
-                vTaskDelay(500/portTICK_PERIOD_MS);
-                if(update_forecast_data(device_get_city_name(),device_get_api_key())){
-                    service_data.update_data_time = get_cur_time_tm()->tm_hour;
-                    if(! (bits&BIT_FORECAST_OK)){
-                        delay_update_forecast = DELAY_UPDATE_FORECAST;
-                        device_set_state(BIT_FORECAST_OK);
-                        create_periodic_task(update_forecast_handler, DELAY_UPDATE_FORECAST, FOREVER);
-                    }
-                } else {
-                    device_clear_state(BIT_FORECAST_OK);
-                    if(bits&BIT_UPDATE_FORECAST_DATA){
-                        create_periodic_task(update_forecast_handler, delay_update_forecast, FOREVER);
-                        if(delay_update_forecast < DELAY_UPDATE_FORECAST){
-                            delay_update_forecast *= 2;
-                        }
-                    }
-                }
+            unsigned jobs = net_planner_take_due();
+            if(bits&BIT_FORCE_UPDATE_FORECAST_DATA){
+                jobs |= NET_JOB_BIT(NET_JOB_FORECAST);
+            }
+            if(!(bits&BIT_IS_TIME)){
+                jobs |= NET_JOB_BIT(NET_JOB_TIME);
+            }
+            if(jobs){
+                run_net_session(jobs);
             }
         }
-        wifi_stop();
         device_set_state(BIT_EVENT_NEW_DATA);
-        vTaskDelay(500/portTICK_PERIOD_MS);
         device_clear_state(BIT_UPDATE_FORECAST_DATA|BIT_FORCE_UPDATE_FORECAST_DATA|BITS_DENIED_SLEEP);
+        net_planner_arm();
+    }
+}
+
+static void time_sync_task(void *pv)
+{
+    time_sync_res = time_sync_update();
+    xTaskNotifyGive((TaskHandle_t)pv);
+    vTaskDelete(NULL);
+}
+
+// every pending job shares one radio window, the time sync runs on its own socket
+// next to the forecast download
+static void run_net_session(unsigned jobs)
+{
+    static int retry_delay = DELAY_TRY_GET_DATA;
+    const bool has_time = jobs & NET_JOB_BIT(NET_JOB_TIME);
+    const bool has_forecast = jobs & NET_JOB_BIT(NET_JOB_FORECAST);
+    bool forecast_ok = false, time_started = false;
+    settings_data_t settings;
+    device_get_settings(&settings);
+    time_sync_res = ESP_FAIL;
+    radio_governor_begin();
+    wifi_set_retry_num(radio_governor_retry_num(STA_RETRY_NUM));
+    if(connect_sta(settings.ssid, settings.pwd) == ESP_OK){
+        device_set_state(BIT_STA_CONF_OK);
+        if(has_time){
+            time_started = xTaskCreate(time_sync_task, "time_sync", TIME_SYNC_STACK, 
+                                xTaskGetCurrentTaskHandle(), uxTaskPriorityGet(NULL), NULL) == pdPASS;
+            if(!time_started){
+                time_sync_res = time_sync_update();
+            }
+        }
+        if(has_forecast){
+            forecast_ok = update_forecast_data(settings.city_name, settings.api_key);
+        }
+        if(time_started){
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        }
+    }
+    wifi_stop();
+    radio_governor_end();
+
+    // rescheduled every time, the governor may have stretched the intervals
+    if(has_time){
+        net_planner_schedule(NET_JOB_TIME, radio_governor_scale(time_sync_res == ESP_OK 
+                                    ? time_sync_get_interval_ms() : retry_delay));
+    }
+    if(has_forecast){
+        if(forecast_ok){
+            device_set_state(BIT_FORECAST_OK);
+        } else {
+            device_clear_state(BIT_FORECAST_OK);
+        }
+        net_planner_schedule(NET_JOB_FORECAST, radio_governor_scale(forecast_ok 
+                                    ? DELAY_UPDATE_FORECAST : retry_delay));
+    }
+    if((forecast_ok || !has_forecast) && (time_sync_res == ESP_OK || !has_time)){
+        retry_delay = DELAY_TRY_GET_DATA;
+    } else if(retry_delay < DELAY_UPDATE_FORECAST){
+        retry_delay *= 2;
     }
 }
 
@@ -345,7 +401,7 @@ void task_init()
     xTaskCreate(
             service_task, 
             "service",
-            20000, 
+            8192, 
             NULL, 
             3,
             NULL);
@@ -440,11 +496,21 @@ static void timer_func(int cmd)
 }
 
 
+// a running server is stopped by its supervisor in service_task, a pending start is dropped
+static void stop_server_session()
+{
+    if(device_get_state()&BIT_SERVER_RUN){
+        device_set_state(BIT_SERVER_STOP);
+    } else {
+        device_clear_state(BIT_START_SERVER);
+    }
+}
+
 static void setting_func(int cmd)
 {
     if(cmd == CMD_INC || cmd == CMD_DEC){
         next_screen +=  cmd == CMD_INC ? 1 : -1;
-        device_clear_state(BIT_SERVER_RUN|BIT_START_SERVER);
+        stop_server_session();
         return;
     }
 
@@ -458,9 +524,17 @@ static void setting_func(int cmd)
     lcd_draw_line(1, 63, 127, COLORED, HORISONTAL, 1);
 
 
-    if(bits&BIT_SERVER_RUN){
+    const int ota_progress = server_get_ota_progress();
+    if(bits&BIT_SERVER_RUN && ota_progress != NO_DATA){
+        lcd_print_centered_str(12, FONT_SIZE_9, COLORED, "Firmware update");
+        lcd_printf_centered(26, FONT_SIZE_18, COLORED, "%d%%", ota_progress);
+        lcd_draw_rectangle(14, 48, 100, 8, COLORED);
+        for(int y=50; y<55; ++y){
+            lcd_draw_line(15, y, ota_progress*99/100, COLORED, HORISONTAL, 0);
+        }
+    } else if(bits&BIT_SERVER_RUN){
         if(cmd == CMD_PRESS){
-            device_clear_state(BIT_SERVER_RUN|BIT_START_SERVER);
+            stop_server_session();
         }
         lcd_print_centered_str(2, FONT_SIZE_9, COLORED, "Server run!");
         lcd_print_centered_str(12, FONT_SIZE_9, COLORED, "http://");
@@ -482,6 +556,7 @@ static void setting_func(int cmd)
 static void main_func(int cmd)
 {
     int ver_desc, data_indx;
+    service_data_t service_data;
 
     if(cmd == CMD_INC || cmd == CMD_DEC){
         next_screen +=  cmd == CMD_INC ? 1 : -1;
@@ -502,6 +577,7 @@ static void main_func(int cmd)
     
     print_temp_indoor();
 
+    device_get_service_data(&service_data);
     data_indx = get_actual_forecast_data_index(get_cur_time_tm()->tm_hour, service_data.update_data_time);
 
     if(data_indx != NO_DATA){
@@ -565,6 +641,7 @@ static void device_info_func(int cmd)
 static void weather_info_func(int cmd)
 {
     int data_indx, dt;
+    service_data_t service_data;
 
     if(cmd == CMD_INC || cmd == CMD_DEC){
         next_screen += cmd == CMD_INC ? 1 : -1;
@@ -577,6 +654,7 @@ static void weather_info_func(int cmd)
         device_set_state(BIT_FORCE_UPDATE_FORECAST_DATA);
     }
 
+    device_get_service_data(&service_data);
     dt = service_data.update_data_time;
 
     if(dt == NO_DATA){
@@ -616,11 +694,6 @@ static void weather_info_func(int cmd)
     }
 }
 
-static void update_forecast_handler()
-{
-    device_set_state_isr(BIT_UPDATE_FORECAST_DATA);
-}
-
 
 static void timer_counter_handler()
 {
@@ -638,9 +711,17 @@ static void check_bat_status_handler()
     create_periodic_task(check_bat_status_handler, INTERVAL_CHECK_BAT, 1);
 }
 
-static void update_time_handler()
+// time to sleep so the wake falls into the next notification minute
+static long long get_ms_to_alarm()
 {
-    device_set_state_isr(BIT_UPDATE_TIME);
+    struct timeval now;
+    const unsigned bits = device_get_state();
+    if(!(bits&BIT_IS_TIME) || !(bits&BIT_NOTIF_ENABLE)) return NO_DATA;
+    gettimeofday(&now, NULL);
+    // the current minute has been checked on this wake already
+    const time_t next = device_next_notification(now.tv_sec + 1);
+    if(next == NO_DATA) return NO_DATA;
+    return (next - now.tv_sec)*1000LL - now.tv_usec/1000 + ALARM_WAKE_MARGIN;
 }
 
 static void low_bat_signal_handler()
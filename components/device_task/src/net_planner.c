@@ -0,0 +1,72 @@
+#include "net_planner.h"
+
+#include "esp_timer.h"
+#include "device_common.h"
+#include "periodic_task.h"
+
+
+// a job due within this part of its interval joins the current window
+#define ALIGN_SLACK_DIV 4
+
+typedef struct {
+    int64_t due_us;
+    int64_t slack_us;
+    bool is_scheduled;
+} net_job_t;
+
+// never scheduled jobs are due right away
+static net_job_t jobs[NET_JOB_NUM];
+
+
+static void net_window_handler();
+
+
+
+void net_planner_schedule(int job, uint64_t delay_ms)
+{
+    jobs[job].due_us = esp_timer_get_time() + delay_ms*1000;
+    jobs[job].slack_us = delay_ms*1000/ALIGN_SLACK_DIV;
+    jobs[job].is_scheduled = true;
+    net_planner_arm();
+}
+
+// the jobs for the radio window starting now, they stay unscheduled until 
+// the caller reschedules them with the outcome
+unsigned net_planner_take_due()
+{
+    const int64_t now_us = esp_timer_get_time();
+    unsigned due = 0;
+    for(int i=0; i<NET_JOB_NUM; ++i){
+        if(!jobs[i].is_scheduled || jobs[i].due_us - jobs[i].slack_us <= now_us){
+            due |= NET_JOB_BIT(i);
+            jobs[i].is_scheduled = true;
+            jobs[i].due_us = INT64_MAX;
+        }
+    }
+    net_planner_arm();
+    return due;
+}
+
+
+// one timer for all jobs, it fires at the earliest due time, a window that fired
+// while the service task was busy is armed again right away
+void net_planner_arm()
+{
+    int64_t first_us = INT64_MAX;
+    for(int i=0; i<NET_JOB_NUM; ++i){
+        if(jobs[i].is_scheduled && jobs[i].due_us < first_us){
+            first_us = jobs[i].due_us;
+        }
+    }
+    if(first_us == INT64_MAX){
+        remove_task(net_window_handler);
+        return;
+    }
+    const int64_t delay_us = first_us - esp_timer_get_time();
+    create_periodic_task(net_window_handler, delay_us > 1000 ? delay_us/1000 : 1, 1);
+}
+
+static void net_window_handler()
+{
+    device_set_state_isr(BIT_UPDATE_FORECAST_DATA);
+}
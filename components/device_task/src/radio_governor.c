@@ -0,0 +1,123 @@
+#include "radio_governor.h"
+
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "device_common.h"
+
+
+#define DAY_US                  (24*60*60*1000000LL)
+#define HOUR_MS                 (60*60*1000.0F)
+// battery level from which the intervals start to stretch
+#define FULL_SCALE_VOLTAGE      3.7F
+// average draw of the module with the radio up
+#define RADIO_POWER_MW          450.0F
+#define DRAIN_SMOOTHING         0.5F
+#define TREND_WINDOW_US         (6*60*60*1000000LL)
+#define CHARGE_STEP_VOLTAGE     0.2F
+// the clock should last at least this long on what is left down to ALARM_VOLTAGE
+#define TARGET_DAYS_LEFT        21.0F
+
+enum GovernorLimit{
+    MAX_SCALE                   = 8,
+    RADIO_BUDGET_MS_PER_DAY     = 5*60*1000,
+    // periodic tasks keep the delay in an int
+    MAX_INTERVAL_MS             = 7*24*60*60*1000,
+};
+
+static const char *TAG = "radio_gov";
+
+static radio_governor_stats_t stats = {
+    .scale = 1,
+};
+static int64_t radio_start_us;
+static int64_t day_start_us;
+static int64_t ref_time_us;
+static float ref_volt;
+
+
+static void update_scale();
+
+
+
+void radio_governor_begin()
+{
+    radio_start_us = esp_timer_get_time();
+}
+
+void radio_governor_end()
+{
+    if(radio_start_us == 0) return;
+    const int64_t now_us = esp_timer_get_time();
+    const unsigned radio_ms = (now_us - radio_start_us) / 1000;
+    radio_start_us = 0;
+    if(now_us - day_start_us >= DAY_US){
+        day_start_us = now_us;
+        stats.day_radio_ms = 0;
+    }
+    stats.day_radio_ms += radio_ms;
+    stats.radio_ms += radio_ms;
+    stats.energy_mwh += RADIO_POWER_MW * radio_ms / HOUR_MS;
+    device_metrics.radio_on_ms = stats.radio_ms;
+    update_scale();
+    ESP_LOGI(TAG, "radio %u ms, %u ms today, %.1f mWh total, scale %u", 
+                radio_ms, stats.day_radio_ms, stats.energy_mwh, stats.scale);
+}
+
+// called with every battery check, the drain is measured over hours, ADC noise
+// would swamp the few millivolts between two checks
+void radio_governor_update_voltage(float volt)
+{
+    const int64_t now_us = esp_timer_get_time();
+    if(ref_time_us == 0 || volt > ref_volt + CHARGE_STEP_VOLTAGE){
+        // first reading or charged, the old trend says nothing anymore
+        stats.drain_per_day = 0;
+        ref_volt = volt;
+        ref_time_us = now_us;
+    } else if(now_us - ref_time_us >= TREND_WINDOW_US){
+        const float drain_per_day = (ref_volt - volt) / ((now_us - ref_time_us) / (float)DAY_US);
+        stats.drain_per_day += (drain_per_day - stats.drain_per_day) * DRAIN_SMOOTHING;
+        ref_volt = volt;
+        ref_time_us = now_us;
+    }
+    stats.volt = volt;
+    update_scale();
+}
+
+uint64_t radio_governor_scale(uint64_t interval_ms)
+{
+    interval_ms *= stats.scale;
+    return interval_ms > MAX_INTERVAL_MS ? MAX_INTERVAL_MS : interval_ms;
+}
+
+// quick retries are what a low battery can afford least
+unsigned radio_governor_retry_num(unsigned retry_num)
+{
+    const unsigned scaled = retry_num / stats.scale;
+    return scaled ? scaled : 1;
+}
+
+const radio_governor_stats_t *radio_governor_get_stats()
+{
+    return &stats;
+}
+
+
+static void update_scale()
+{
+    float scale = 1.0F;
+    if(stats.volt > 0 && stats.volt < FULL_SCALE_VOLTAGE){
+        // linear from 1 at FULL_SCALE_VOLTAGE up to MAX_SCALE at ALARM_VOLTAGE
+        const float level = (FULL_SCALE_VOLTAGE - stats.volt) / (FULL_SCALE_VOLTAGE - ALARM_VOLTAGE);
+        scale = 1.0F + (MAX_SCALE - 1) * (level > 1.0F ? 1.0F : level);
+    }
+    if(stats.drain_per_day > 0 && stats.volt > ALARM_VOLTAGE){
+        const float days_left = (stats.volt - ALARM_VOLTAGE) / stats.drain_per_day;
+        if(days_left < TARGET_DAYS_LEFT && TARGET_DAYS_LEFT / days_left > scale){
+            scale = TARGET_DAYS_LEFT / days_left;
+        }
+    }
+    if(stats.day_radio_ms > RADIO_BUDGET_MS_PER_DAY){
+        scale *= 2;
+    }
+    stats.scale = scale > MAX_SCALE ? MAX_SCALE : (unsigned)scale;
+}
@@ -5,9 +5,26 @@
 #include "stdbool.h"
 
 
+// cost of the forecast updates, the "last_" fields describe the latest update;
+// received bytes are read from the socket, headers and body as sent
+typedef struct {
+    unsigned fetch_num;
+    unsigned fail_num;
+    unsigned not_modified_num;
+    unsigned received_total;
+    // connection attempts of the latest update and what its last one received
+    unsigned last_attempt_num;
+    unsigned last_received;
+    unsigned last_body_len;
+    unsigned last_fetch_ms;
+    unsigned last_parse_us;
+    unsigned max_parse_us;
+    unsigned min_free_stack;
+} forecast_stats_t;
+
 
 bool update_forecast_data(const char *city, const char *api_key);
-bool device_update_time();
+const forecast_stats_t *get_forecast_stats();
 
 
 
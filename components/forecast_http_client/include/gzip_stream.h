@@ -0,0 +1,42 @@
+#ifndef GZIP_STREAM_H_
+#define GZIP_STREAM_H_
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "stddef.h"
+#include "stdbool.h"
+#include "esp32/rom/miniz.h"
+
+
+// streaming gzip (RFC 1952) inflater writing into a flat output buffer,
+// the body can be fed in arbitrary pieces as it arrives from the socket
+typedef struct {
+    tinfl_decompressor inflator;
+    int state;
+    unsigned char flags;
+    unsigned field_pos;
+    unsigned field_len;
+    unsigned char trailer[8];
+    char *out;
+    size_t out_size;
+    size_t out_len;
+    // running CRC32 of the output, checked against the trailer
+    mz_ulong crc;
+} gzip_stream_t;
+
+
+void gzip_stream_init(gzip_stream_t *gz, char *out, size_t out_size);
+int gzip_stream_feed(gzip_stream_t *gz, const unsigned char *data, size_t len);
+bool gzip_stream_done(const gzip_stream_t *gz);
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
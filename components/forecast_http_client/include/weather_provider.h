@@ -0,0 +1,54 @@
+#ifndef WEATHER_PROVIDER_H_
+#define WEATHER_PROVIDER_H_
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "stddef.h"
+#include "stdint.h"
+#include <sys/uio.h>
+#include "stdbool.h"
+#include "device_common.h"
+
+
+// a forecast source: knows its host, how to ask for FORECAST_LIST_SIZE
+// three-hour slots and how to map the answer into service_data_t
+typedef struct {
+    const char *name;
+    const char *host;
+    // exact api key length, 0 when the service needs no key
+    size_t key_len;
+    // fills the path and query as fragments pointing into constants and
+    // the passed strings, returns the fragment number or 0
+    int (*build_request)(struct iovec *iov, int iov_max, const char *city, const char *api_key);
+    bool (*parse)(char *body, size_t body_len, service_data_t *data);
+    // checks the City setting before it is stored, NULL takes any name
+    bool (*check_city)(const char *city);
+} weather_provider_t;
+
+
+extern const weather_provider_t openweather_provider;
+extern const weather_provider_t openmeteo_provider;
+
+const weather_provider_t *get_weather_provider();
+bool weather_provider_check_city(const char *city);
+
+// helpers for the providers' parsers
+size_t get_value_ptrs(char **value_list, size_t list_size, char *data_buf, const size_t buf_len, const char *key);
+void split(char *data_buf, const char *split_chars_str, uint32_t data_size);
+
+
+#define IOV_LITERAL(str_) \
+    ((struct iovec){ .iov_base = (void *)(str_), .iov_len = sizeof(str_)-1 })
+
+#define IOV_STRING(str_, len_) \
+    ((struct iovec){ .iov_base = (void *)(str_), .iov_len = (len_) })
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
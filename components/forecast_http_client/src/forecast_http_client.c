@@ -1,4 +1,6 @@
 #include "forecast_http_client.h"
+#include "gzip_stream.h"
+#include "weather_provider.h"
 
 #include "clock_module.h"
 #include "device_common.h"
@@ -6,221 +8,376 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
+// lwip's netdb.h reuses the name for a resolver error code
+#undef NO_DATA
 #include <unistd.h>
+#include <strings.h>
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
-#define TIME_SERVER_HOST "worldtimeapi.org"
-#define OPENWEATHER_SERVER_HOST "api.openweathermap.org"
 #define SERVER_PORT "80" 
-#define SIZE_URL_BUF 256
-#define FORECAST_LIST_SIZE 5
 #define MAX_RETRIES 5  
 #define RETRY_DELAY_MS 500  
+#define RECV_TIMEOUT_SEC 5
+#define ARENA_WAIT_MS 1000
+#define HTTP_CHUNK_LEN 512
+#define HTTP_LINE_LEN 96
+#define VALIDATOR_LEN 64
+#define MAX_PATH_IOV 8
+#define MAX_REQUEST_IOV (MAX_PATH_IOV + 12)
+
+enum HttpStatus{
+    HTTP_OK             = 200,
+    HTTP_NOT_MODIFIED   = 304,
+};
+
+typedef struct {
+    int status;
+    bool gzip;
+    bool in_body;
+    size_t line_len;
+    char line[HTTP_LINE_LEN];
+    char etag[VALIDATOR_LEN];
+    char last_modified[VALIDATOR_LEN];
+    char *body;
+    size_t body_size;
+    size_t body_len;
+    gzip_stream_t *gz;
+    char *chunk;
+} http_response_t;
+
+// request fragments, sent with one sendmsg() without being joined
+typedef struct {
+    struct iovec iov[MAX_REQUEST_IOV];
+    int num;
+    size_t len;
+} http_request_t;
+
+_Static_assert(NET_BUF_LEN + HTTP_CHUNK_LEN + 2*8 <= NET_ARENA_LEN, 
+                "network arena is too small for the forecast client");
 
-#define MAX_KEY_NUM 10
 static const char *TAG = "fetch_data";
-extern char network_buf[];
 
-int fetch_data(const char *SERVER_HOST, const char *REQUEST, char *response_buf);
-static size_t get_value_ptrs(char ***value_list, char *data_buf, const size_t buf_len, const char *key);
-static void split(char *data_buf, const char *split_chars_str, uint32_t data_size);
+static forecast_stats_t stats;
+
+// validators of the last forecast response, sent back as If-None-Match/If-Modified-Since
+static char forecast_etag[VALIDATOR_LEN], forecast_last_modified[VALIDATOR_LEN];
+// where the held forecast and its validators came from
+static char forecast_city[MAX_STR_LEN+1];
+static const weather_provider_t *forecast_provider;
+
+static bool is_forecast_from(const weather_provider_t *provider, const char *city);
+static int fetch_data(const char *host, http_request_t *request, http_response_t *resp);
+static void request_add(http_request_t *request, const char *str, size_t len);
+static void response_init(http_response_t *resp);
+static int parse_response(http_response_t *resp, const char *data, size_t len);
+static void parse_header_line(http_response_t *resp);
+static int write_body(http_response_t *resp, const char *data, size_t len);
+static void copy_header_value(char *dst, size_t dst_size, const char *value);
+
+#define request_add_str(request_, str_) \
+    request_add((request_), (str_), strlen(str_))
+
+#define request_add_literal(request_, str_) \
+    request_add((request_), (str_), sizeof(str_)-1)
+
 
+static bool is_forecast_from(const weather_provider_t *provider, const char *city)
+{
+    return forecast_provider == provider && strncmp(forecast_city, city, MAX_STR_LEN) == 0;
+}
 
-int fetch_weather_data(const char *city, const char *api_key) 
+static int fetch_weather_data(const weather_provider_t *provider, const char *city, const char *api_key, 
+                                bool revalidate, http_response_t *resp) 
 {
-    char request[SIZE_URL_BUF];
-    snprintf(request, sizeof(request),
-        "/data/2.5/forecast?q=%s&units=metric&cnt=%d&appid=%s",
-        city, FORECAST_LIST_SIZE, api_key);
-    return fetch_data(OPENWEATHER_SERVER_HOST, request, network_buf);
+    http_request_t request = { 0 };
+    struct iovec path[MAX_PATH_IOV];
+    const int path_num = provider->build_request(path, MAX_PATH_IOV, city, api_key);
+    if(path_num <= 0){
+        ESP_LOGE(TAG, "Wrong %s request", provider->name);
+        return ESP_FAIL;
+    }
+    request_add_literal(&request, "GET ");
+    for(int i=0; i<path_num; ++i){
+        request_add(&request, path[i].iov_base, path[i].iov_len);
+    }
+    // HTTP/1.0 keeps the body free of chunked framing so it can go straight to the inflater
+    request_add_literal(&request, " HTTP/1.0\r\nHost: ");
+    request_add_str(&request, provider->host);
+    request_add_literal(&request, "\r\nAccept-Encoding: gzip\r\n");
+    if(revalidate){
+        if(forecast_etag[0]){
+            request_add_literal(&request, "If-None-Match: ");
+            request_add_str(&request, forecast_etag);
+            request_add_literal(&request, "\r\n");
+        }
+        if(forecast_last_modified[0]){
+            request_add_literal(&request, "If-Modified-Since: ");
+            request_add_str(&request, forecast_last_modified);
+            request_add_literal(&request, "\r\n");
+        }
+    }
+    request_add_literal(&request, "Connection: close\r\n\r\n");
+    return fetch_data(provider->host, &request, resp);
 }
 
-int fetch_time_data() 
+static void request_add(http_request_t *request, const char *str, size_t len)
 {
-    return fetch_data(TIME_SERVER_HOST, "/api/timezone/Etc/UTC", network_buf);
+    if(request->num < MAX_REQUEST_IOV){
+        request->iov[request->num].iov_base = (void *)str;
+        request->iov[request->num].iov_len = len;
+        request->num += 1;
+        request->len += len;
+    } else {
+        // a short request must never go out
+        request->len = 0;
+    }
 }
 
-int fetch_data(const char *SERVER_HOST, const char *REQUEST, char *response_buf) 
+static int fetch_data(const char *host, http_request_t *request, http_response_t *resp) 
 {
-    char request[SIZE_URL_BUF + 128];
-    snprintf(request, sizeof(request),
-        "GET %s HTTP/1.1\r\n"
-        "Host: %s \r\n"
-        "Connection: close\r\n\r\n", REQUEST, SERVER_HOST);
-    int resp_size = 0;
-    struct addrinfo hints = {0}, *res = NULL;
+    int res = ESP_FAIL, len;
+    struct addrinfo hints = {0}, *addr = NULL;
+    const struct timeval recv_timeout = { .tv_sec = RECV_TIMEOUT_SEC };
+    const struct msghdr msg = {
+        .msg_iov = request->iov,
+        .msg_iovlen = request->num,
+    };
     int sock = -1;
     int retries = 0;
     hints.ai_family = AF_INET;
     hints.ai_socktype = SOCK_STREAM;
 
+    if(request->len == 0 || request->num == MAX_REQUEST_IOV){
+        ESP_LOGE(TAG, "Request too long");
+        return ESP_FAIL;
+    }
     while (retries < MAX_RETRIES) {
         retries++;
-        if (res == NULL){
-            if(getaddrinfo(SERVER_HOST, SERVER_PORT, &hints, &res) != 0) {
+        // a failed attempt must leave nothing behind, a status line
+        // parsed before a reset would otherwise pass for the answer
+        response_init(resp);
+        stats.last_attempt_num = retries;
+        stats.last_received = 0;
+        if(sock >= 0){
+            close(sock);
+            sock = -1;
+            vTaskDelay(pdMS_TO_TICKS(RETRY_DELAY_MS));
+        }
+        if (addr == NULL){
+            if(getaddrinfo(host, SERVER_PORT, &hints, &addr) != 0) {
                 ESP_LOGE(TAG, "DNS resolution failed");
+                addr = NULL;
                 continue;
             }
         }
-        if(sock < 0){
-            sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-            if (sock < 0) {
-                ESP_LOGE(TAG, "Socket creation failed");
-                vTaskDelay(pdMS_TO_TICKS(RETRY_DELAY_MS));
-                continue;
-            }
+        sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if (sock < 0) {
+            ESP_LOGE(TAG, "Socket creation failed");
+            vTaskDelay(pdMS_TO_TICKS(RETRY_DELAY_MS));
+            continue;
         }
-        if (connect(sock, res->ai_addr, res->ai_addrlen) != 0) {
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout, sizeof(recv_timeout));
+        if (connect(sock, addr->ai_addr, addr->ai_addrlen) != 0) {
             ESP_LOGE(TAG, "Connection failed");
-            vTaskDelay(pdMS_TO_TICKS(RETRY_DELAY_MS));
             continue;
         }
-        if (send(sock, request, strlen(request), 0) < 0) {
-            vTaskDelay(pdMS_TO_TICKS(RETRY_DELAY_MS));
+        if (sendmsg(sock, &msg, 0) != request->len) {
             continue;
         }
-        resp_size = recv(sock, response_buf, NET_BUF_LEN - 1, 0);
-        if (resp_size > 0) {
-            response_buf[resp_size] = '\0'; 
-            break;
-        } 
-        vTaskDelay(pdMS_TO_TICKS(RETRY_DELAY_MS));
-    }
-    if(res) freeaddrinfo(res); 
+        while((len = recv(sock, resp->chunk, HTTP_CHUNK_LEN, 0)) > 0){
+            stats.last_received += len;
+            stats.received_total += len;
+            res = parse_response(resp, resp->chunk, len);
+            if(res != ESP_OK) break;
+        }
+        // only a complete header block counts, the connection may close inside it
+        if(res == ESP_OK && len == 0 && resp->in_body && resp->status){
+            if(resp->gzip && !gzip_stream_done(resp->gz)){
+                ESP_LOGE(TAG, "Truncated gzip body");
+                res = ESP_FAIL;
+            } else {
+                break;
+            }
+        }
+        res = ESP_FAIL;
+    }
+    if(addr) freeaddrinfo(addr); 
     if(sock != -1)close(sock);
-    return resp_size;
+    if(res == ESP_OK){
+        resp->body[resp->body_len] = '\0';
+    }
+    return res;
 }
 
 
-bool device_update_time()
+static void response_init(http_response_t *resp)
 {
-    char ** dateTime = NULL;
-    uint32_t data_size = fetch_time_data();
-    if(data_size){
-        get_value_ptrs(&dateTime, network_buf, data_size, "\"dateTime\":");
-        if(dateTime){
-            struct tm tinfo;
-            sscanf(dateTime[0],"%d-%d-%dT%d:%d:%d", 
-                    &tinfo.tm_yday, 
-                    &tinfo.tm_mon, 
-                    &tinfo.tm_mday, 
-                    &tinfo.tm_hour, 
-                    &tinfo.tm_min, 
-                    &tinfo.tm_sec);
-
-            time_t epoch_time = mktime(&tinfo);
-
-            struct timeval now = { .tv_sec = epoch_time };
-            settimeofday(&now, NULL);
-            free(dateTime);
-            dateTime = NULL;
-            return true;
+    resp->status = 0;
+    resp->gzip = resp->in_body = false;
+    resp->line_len = resp->body_len = 0;
+    resp->etag[0] = resp->last_modified[0] = 0;
+}
+
+static int parse_response(http_response_t *resp, const char *data, size_t len)
+{
+    const char *end = data + len;
+    char c;
+    while(data < end && !resp->in_body){
+        c = *(data++);
+        if(c == '\n'){
+            if(resp->line_len && resp->line[resp->line_len-1] == '\r'){
+                resp->line_len -= 1;
+            }
+            resp->line[resp->line_len] = 0;
+            if(resp->line_len == 0){
+                resp->in_body = true;
+                if(resp->gzip){
+                    // about 11 KB of inflater state, only taken for a compressed body
+                    if(resp->gz == NULL){
+                        resp->gz = (gzip_stream_t *)net_arena_alloc_heap(NET_OWNER_CLIENT, sizeof(gzip_stream_t));
+                        if(resp->gz == NULL) return ESP_ERR_NO_MEM;
+                    }
+                    // keep one byte for the terminating zero
+                    gzip_stream_init(resp->gz, resp->body, resp->body_size - 1);
+                }
+            } else {
+                parse_header_line(resp);
+            }
+            resp->line_len = 0;
+        } else if(resp->line_len < sizeof(resp->line)-1){
+            resp->line[resp->line_len++] = c;
         }
     }
-    return false;
+    if(data < end){
+        return write_body(resp, data, end - data);
+    }
+    return ESP_OK;
 }
 
+static void parse_header_line(http_response_t *resp)
+{
+    const char *line = resp->line;
+    if(resp->status == 0){
+        sscanf(line, "HTTP/%*d.%*d %d", &resp->status);
+    } else if(strncasecmp(line, "Content-Encoding:", 17) == 0){
+        resp->gzip = strstr(line+17, "gzip") != NULL;
+    } else if(strncasecmp(line, "ETag:", 5) == 0){
+        copy_header_value(resp->etag, sizeof(resp->etag), line+5);
+    } else if(strncasecmp(line, "Last-Modified:", 14) == 0){
+        copy_header_value(resp->last_modified, sizeof(resp->last_modified), line+14);
+    }
+}
 
+static void copy_header_value(char *dst, size_t dst_size, const char *value)
+{
+    while(*value == ' ') ++value;
+    const size_t len = strlen(value);
+    // a clipped validator would never match, better not to send it at all
+    if(len < dst_size){
+        memcpy(dst, value, len+1);
+    } else {
+        dst[0] = 0;
+    }
+}
 
+static int write_body(http_response_t *resp, const char *data, size_t len)
+{
+    if(resp->gzip){
+        const int res = gzip_stream_feed(resp->gz, (const unsigned char *)data, len);
+        resp->body_len = resp->gz->out_len;
+        return res;
+    }
+    if(resp->body_len + len >= resp->body_size){
+        ESP_LOGE(TAG, "Response too long");
+        return ESP_ERR_NO_MEM;
+    }
+    memcpy(resp->body + resp->body_len, data, len);
+    resp->body_len += len;
+    return ESP_OK;
+}
 
 
 bool update_forecast_data(const char *city, const char *api_key)
 {
-    char **feels_like_list = NULL, **description_list = NULL, **pop_list = NULL, **dt_list = NULL; 
+    const weather_provider_t *provider = get_weather_provider();
+    http_response_t resp = { 0 };
+    service_data_t data;
+    bool res = false;
+    int64_t start_time;
     
-    if(strnlen(city, MAX_STR_LEN) == 0 || strnlen(api_key, MAX_STR_LEN) != API_LEN)
+    if(strnlen(city, MAX_STR_LEN) == 0 
+            || (provider->key_len && strnlen(api_key, MAX_STR_LEN) != provider->key_len))
     return false;
-    uint32_t data_size = fetch_weather_data(city, api_key);
-    if(data_size){
-        const size_t pop_num = get_value_ptrs(&pop_list, network_buf, data_size, "\"pop\":");
-        const size_t feels_like_num = get_value_ptrs(&feels_like_list, network_buf, data_size, "\"feels_like\":");
-        const size_t description_num = get_value_ptrs(&description_list, network_buf, data_size, "\"description\":\"");
-        get_value_ptrs(&dt_list, network_buf, data_size,"\"dt\":");
-        split(network_buf, "},\"", data_size);
-        if(description_list){
-            memset(service_data.desciption, 0, sizeof(service_data.desciption));
-            for(int i=0; i<description_num && i<FORECAST_LIST_SIZE; ++i){
-                strncpy(service_data.desciption[i], description_list[i], sizeof(service_data.desciption[0]));
-            }
-            free(description_list);
-            description_list = NULL;
-        }
-
-        if(dt_list){
-            time_t time_now  = atol(dt_list[0]);
-            struct tm * tinfo = localtime(&time_now);
-            service_data.update_data_time = tinfo->tm_hour;
-            free(dt_list);
-            dt_list = NULL;
-        }
-
-        if(feels_like_list){
-            for(int i=0; i<feels_like_num && i<FORECAST_LIST_SIZE; ++i){
-                service_data.temp_list[i] = atof(feels_like_list[i]);
+    device_get_service_data(&data);
+    // another city's forecast is not shown while this one is fetched
+    if(data.update_data_time != NO_DATA && !is_forecast_from(provider, city)){
+        data.update_data_time = NO_DATA;
+        device_publish_service_data(&data);
+    }
+    // revalidate only while the previous forecast of this city is still held
+    const bool revalidate = data.update_data_time != NO_DATA;
+    if(net_arena_acquire(NET_OWNER_CLIENT, ARENA_WAIT_MS) == NULL)
+    return false;
+    stats.fetch_num += 1;
+    stats.last_attempt_num = stats.last_received = 0;
+    stats.last_body_len = stats.last_parse_us = 0;
+    resp.body_size = NET_BUF_LEN;
+    resp.body = (char *)net_arena_alloc(NET_OWNER_CLIENT, NET_BUF_LEN);
+    resp.chunk = (char *)net_arena_alloc(NET_OWNER_CLIENT, HTTP_CHUNK_LEN);
+    if(resp.body && resp.chunk){
+        start_time = esp_timer_get_time();
+        const int fetch_res = fetch_weather_data(provider, city, api_key, revalidate, &resp);
+        stats.last_fetch_ms = (esp_timer_get_time() - start_time) / 1000;
+        if(fetch_res != ESP_OK){
+            // whatever the last attempt parsed is not an answer
+            resp.status = 0;
+        } else if(resp.status == HTTP_NOT_MODIFIED && revalidate){
+            stats.not_modified_num += 1;
+            res = true;
+        } else if(resp.status == HTTP_OK && resp.body_len){
+            stats.last_body_len = resp.body_len;
+            start_time = esp_timer_get_time();
+            // parsed aside and published whole, the display never sees a half-filled forecast
+            device_get_service_data(&data);
+            res = provider->parse(resp.body, resp.body_len, &data);
+            stats.last_parse_us = esp_timer_get_time() - start_time;
+            if(stats.last_parse_us > stats.max_parse_us){
+                stats.max_parse_us = stats.last_parse_us;
             }
-            free(feels_like_list);
-            feels_like_list = NULL;
         }
-
-        if(pop_list){
-            for(int i=0; i<pop_num && i<FORECAST_LIST_SIZE; ++i){
-                service_data.pop_list[i] = atof(pop_list[i])*100;
-            }
-            free(pop_list);
-            pop_list = NULL;
+        if(res && resp.status == HTTP_OK){
+            memcpy(forecast_etag, resp.etag, sizeof(forecast_etag));
+            memcpy(forecast_last_modified, resp.last_modified, sizeof(forecast_last_modified));
+            strncpy(forecast_city, city, sizeof(forecast_city)-1);
+            forecast_provider = provider;
+            data.update_data_time = get_cur_time_tm()->tm_hour;
+            device_publish_service_data(&data);
         }
-        return true;
     }
-    return false;
+    net_arena_release(NET_OWNER_CLIENT);
+    if(!res){
+        stats.fail_num += 1;
+    }
+    const unsigned free_stack = uxTaskGetStackHighWaterMark(NULL);
+    if(stats.min_free_stack == 0 || free_stack < stats.min_free_stack){
+        stats.min_free_stack = free_stack;
+    }
+    ESP_LOGI(TAG, "%s: status %d, attempt %u received %u bytes, body %u, fetch %u ms, parse %u us", 
+                provider->name, resp.status, 
+                stats.last_attempt_num, stats.last_received, stats.last_body_len, 
+                stats.last_fetch_ms, stats.last_parse_us);
+    return res;
 }
 
-
-
-static size_t get_value_ptrs(char ***value_list, char *data_buf, const size_t buf_len, const char *key)
+const forecast_stats_t *get_forecast_stats()
 {
-    char *buf_oper[MAX_KEY_NUM] = { 0 };
-    if(data_buf == NULL) 
-        return 0;
-    const size_t key_size = strlen(key);
-    char *data_ptr = data_buf;
-    char **buf_ptr = buf_oper;
-    const char *data_end = data_buf+buf_len;
-    size_t value_list_size = 0;
-    while(data_ptr = strstr(data_ptr, key), 
-            data_ptr 
-            && data_end > data_ptr 
-            && MAX_KEY_NUM > value_list_size ){
-        data_ptr += key_size;
-        buf_ptr[value_list_size++] = data_ptr;
-    }
-    const size_t data_size = value_list_size * sizeof(char *);
-    *value_list = (char **)malloc(data_size);
-    if(value_list == NULL)
-        return 0;
-    memcpy(*value_list, buf_oper, data_size);
-    return value_list_size;
+    return &stats;
 }
-
-
-static void split(char *data_buf, const char *split_chars_str, uint32_t data_size)
-{
-    char *ptr = data_buf;
-    const char *end_data_buf = data_buf + data_size;
-    const size_t symb_list_size = strlen(split_chars_str);
-    char c;
-    while(ptr != end_data_buf){
-        c = *(ptr);
-        for(int i=0; i<symb_list_size; ++i){
-            if(split_chars_str[i] == c){
-                *(ptr) = 0;
-                break;
-            }
-        }
-        ++ptr;
-    }
-}
\ No newline at end of file
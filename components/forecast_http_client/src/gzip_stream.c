@@ -0,0 +1,167 @@
+#include "gzip_stream.h"
+
+#include "string.h"
+#include "esp_err.h"
+
+
+#define GZIP_HEADER_SIZE    10
+#define GZIP_TRAILER_SIZE   8
+
+enum GzipFlags{
+    GZ_FLAG_HCRC    = (1<<1),
+    GZ_FLAG_EXTRA   = (1<<2),
+    GZ_FLAG_NAME    = (1<<3),
+    GZ_FLAG_COMMENT = (1<<4),
+};
+
+enum GzipState{
+    GZ_STATE_HEADER,
+    GZ_STATE_EXTRA_LEN,
+    GZ_STATE_EXTRA,
+    GZ_STATE_NAME,
+    GZ_STATE_COMMENT,
+    GZ_STATE_HCRC,
+    GZ_STATE_DEFLATE,
+    GZ_STATE_TRAILER,
+    GZ_STATE_DONE,
+    GZ_STATE_ERROR,
+};
+
+
+static int next_header_state(gzip_stream_t *gz, int from_state);
+
+
+
+void gzip_stream_init(gzip_stream_t *gz, char *out, size_t out_size)
+{
+    tinfl_init(&gz->inflator);
+    gz->state = GZ_STATE_HEADER;
+    gz->flags = 0;
+    gz->field_pos = gz->field_len = 0;
+    gz->out = out;
+    gz->out_size = out_size;
+    gz->out_len = 0;
+    gz->crc = MZ_CRC32_INIT;
+}
+
+bool gzip_stream_done(const gzip_stream_t *gz)
+{
+    return gz->state == GZ_STATE_DONE;
+}
+
+int gzip_stream_feed(gzip_stream_t *gz, const unsigned char *data, size_t len)
+{
+    const unsigned char *end = data + len;
+    unsigned char c;
+    while(data < end){
+        switch(gz->state){
+        case GZ_STATE_HEADER:
+            c = *(data++);
+            if((gz->field_pos == 0 && c != 0x1f)
+                    || (gz->field_pos == 1 && c != 0x8b)
+                    || (gz->field_pos == 2 && c != 8 /* deflate */)){
+                gz->state = GZ_STATE_ERROR;
+                return ESP_FAIL;
+            }
+            if(gz->field_pos == 3){
+                gz->flags = c;
+            }
+            if(++gz->field_pos == GZIP_HEADER_SIZE){
+                gz->state = next_header_state(gz, GZ_STATE_HEADER);
+            }
+            break;
+        case GZ_STATE_EXTRA_LEN:
+            gz->field_len |= (unsigned)*(data++) << (8*gz->field_pos);
+            if(++gz->field_pos == 2){
+                gz->field_pos = 0;
+                gz->state = gz->field_len ? GZ_STATE_EXTRA : next_header_state(gz, GZ_STATE_EXTRA);
+            }
+            break;
+        case GZ_STATE_EXTRA:
+            ++data;
+            if(++gz->field_pos == gz->field_len){
+                gz->state = next_header_state(gz, GZ_STATE_EXTRA);
+            }
+            break;
+        case GZ_STATE_NAME:
+        case GZ_STATE_COMMENT:
+            if(*(data++) == 0){
+                gz->state = next_header_state(gz, gz->state);
+            }
+            break;
+        case GZ_STATE_HCRC:
+            ++data;
+            if(++gz->field_pos == 2){
+                gz->state = next_header_state(gz, GZ_STATE_HCRC);
+            }
+            break;
+        case GZ_STATE_DEFLATE:
+        {
+            size_t in_size = end - data;
+            size_t out_size = gz->out_size - gz->out_len;
+            const tinfl_status status = tinfl_decompress(&gz->inflator,
+                                            data, &in_size,
+                                            (mz_uint8 *)gz->out,
+                                            (mz_uint8 *)gz->out + gz->out_len,
+                                            &out_size,
+                                            TINFL_FLAG_HAS_MORE_INPUT
+                                            |TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+            data += in_size;
+            gz->crc = mz_crc32(gz->crc, (const mz_uint8 *)gz->out + gz->out_len, out_size);
+            gz->out_len += out_size;
+            if(status == TINFL_STATUS_DONE){
+                gz->field_pos = 0;
+                gz->state = GZ_STATE_TRAILER;
+            } else if(status == TINFL_STATUS_HAS_MORE_OUTPUT){
+                gz->state = GZ_STATE_ERROR;
+                return ESP_ERR_NO_MEM;
+            } else if(status < 0){
+                gz->state = GZ_STATE_ERROR;
+                return ESP_FAIL;
+            }
+            break;
+        }
+        case GZ_STATE_TRAILER:
+            gz->trailer[gz->field_pos++] = *(data++);
+            if(gz->field_pos == GZIP_TRAILER_SIZE){
+                // CRC32 of the uncompressed data, then ISIZE, its length modulo 2^32
+                const mz_ulong crc = gz->trailer[0]
+                                    | gz->trailer[1]<<8
+                                    | gz->trailer[2]<<16
+                                    | (mz_ulong)gz->trailer[3]<<24;
+                const size_t isize = gz->trailer[4]
+                                    | gz->trailer[5]<<8
+                                    | gz->trailer[6]<<16
+                                    | (size_t)gz->trailer[7]<<24;
+                if(crc != (gz->crc & 0xffffffff) || isize != gz->out_len){
+                    gz->state = GZ_STATE_ERROR;
+                    return ESP_FAIL;
+                }
+                gz->state = GZ_STATE_DONE;
+            }
+            break;
+        case GZ_STATE_DONE:
+            // ignore anything after the member
+            return ESP_OK;
+        default:
+            return ESP_FAIL;
+        }
+    }
+    return ESP_OK;
+}
+
+
+static int next_header_state(gzip_stream_t *gz, int from_state)
+{
+    gz->field_pos = 0;
+    gz->field_len = 0;
+    if(from_state < GZ_STATE_EXTRA_LEN && gz->flags&GZ_FLAG_EXTRA)
+        return GZ_STATE_EXTRA_LEN;
+    if(from_state < GZ_STATE_NAME && gz->flags&GZ_FLAG_NAME)
+        return GZ_STATE_NAME;
+    if(from_state < GZ_STATE_COMMENT && gz->flags&GZ_FLAG_COMMENT)
+        return GZ_STATE_COMMENT;
+    if(from_state < GZ_STATE_HCRC && gz->flags&GZ_FLAG_HCRC)
+        return GZ_STATE_HCRC;
+    return GZ_STATE_DEFLATE;
+}
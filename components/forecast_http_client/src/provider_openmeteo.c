@@ -0,0 +1,154 @@
+#include "weather_provider.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+// hourly series are asked for FORECAST_LIST_SIZE three-hour slots
+#define SLOT_HOURS 3
+#define FORECAST_HOURS ((FORECAST_LIST_SIZE-1)*SLOT_HOURS+1)
+
+
+typedef struct {
+    unsigned char code;
+    const char *description;
+} wmo_description_t;
+
+// WMO weather interpretation codes, worded like Openweather descriptions
+static const wmo_description_t wmo_list[] = {
+    {0,  "clear sky"},
+    {1,  "mainly clear"},
+    {2,  "partly cloudy"},
+    {3,  "overcast clouds"},
+    {45, "fog"},
+    {48, "rime fog"},
+    {51, "light drizzle"},
+    {53, "drizzle"},
+    {55, "heavy drizzle"},
+    {56, "freezing drizzle"},
+    {57, "freezing drizzle"},
+    {61, "light rain"},
+    {63, "moderate rain"},
+    {65, "heavy rain"},
+    {66, "freezing rain"},
+    {67, "freezing rain"},
+    {71, "light snow"},
+    {73, "snow"},
+    {75, "heavy snow"},
+    {77, "snow grains"},
+    {80, "rain showers"},
+    {81, "rain showers"},
+    {82, "violent showers"},
+    {85, "snow showers"},
+    {86, "heavy snow showers"},
+    {95, "thunderstorm"},
+    {96, "thunderstorm, hail"},
+    {99, "thunderstorm, hail"},
+};
+
+static const char *get_wmo_description(int code);
+static bool check_coordinate(const char *str, char **end, float limit);
+static size_t get_num_list(const char *body, const char *key, float *list, size_t list_size);
+
+
+_Static_assert(FORECAST_HOURS == 13, "forecast_hours in the request must match FORECAST_HOURS");
+
+// the City setting carries "latitude,longitude" for this service,
+// both halves are sent in place
+static int build_request(struct iovec *iov, int iov_max, const char *city, const char *api_key)
+{
+    const char *lon = strchr(city, ',');
+    if(lon == NULL || iov_max < 5) return 0;
+    iov[0] = IOV_LITERAL("/v1/forecast?latitude=");
+    iov[1] = IOV_STRING(city, lon - city);
+    iov[2] = IOV_LITERAL("&longitude=");
+    iov[3] = IOV_STRING(lon+1, strlen(lon+1));
+    iov[4] = IOV_LITERAL("&hourly=apparent_temperature,precipitation_probability,weather_code"
+                        "&forecast_hours=13&timeformat=unixtime&timezone=GMT");
+    return 5;
+}
+
+// "latitude,longitude" in degrees, nothing else goes into the query
+static bool check_city(const char *city)
+{
+    char *end;
+    if(strspn(city, "0123456789+-.,") != strlen(city)) return false;
+    return check_coordinate(city, &end, 90)
+            && *end == ','
+            && check_coordinate(end+1, &end, 180)
+            && *end == 0;
+}
+
+static bool parse(char *body, size_t body_len, service_data_t *data)
+{
+    float list[FORECAST_HOURS];
+    size_t num;
+
+    num = get_num_list(body, "\"apparent_temperature\":[", list, FORECAST_HOURS);
+    if(num == 0) return false;
+    for(int i=0; i<FORECAST_LIST_SIZE && i*SLOT_HOURS<num; ++i){
+        data->temp_list[i] = list[i*SLOT_HOURS];
+    }
+
+    num = get_num_list(body, "\"precipitation_probability\":[", list, FORECAST_HOURS);
+    for(int i=0; i<FORECAST_LIST_SIZE && i*SLOT_HOURS<num; ++i){
+        data->pop_list[i] = list[i*SLOT_HOURS];
+    }
+
+    memset(data->desciption, 0, sizeof(data->desciption));
+    num = get_num_list(body, "\"weather_code\":[", list, FORECAST_HOURS);
+    for(int i=0; i<FORECAST_LIST_SIZE && i*SLOT_HOURS<num; ++i){
+        strncpy(data->desciption[i], get_wmo_description(list[i*SLOT_HOURS]), sizeof(data->desciption[0])-1);
+    }
+    return true;
+}
+
+
+static const char *get_wmo_description(int code)
+{
+    for(int i=0; i<sizeof(wmo_list)/sizeof(wmo_list[0]); ++i){
+        if(wmo_list[i].code == code){
+            return wmo_list[i].description;
+        }
+    }
+    return "";
+}
+
+static bool check_coordinate(const char *str, char **end, float limit)
+{
+    const float val = strtof(str, end);
+    return *end != str && val >= -limit && val <= limit;
+}
+
+// reads a JSON number array, nulls are taken as zero
+static size_t get_num_list(const char *body, const char *key, float *list, size_t list_size)
+{
+    char *end;
+    size_t num = 0;
+    const char *ptr = strstr(body, key);
+    if(ptr == NULL) return 0;
+    ptr += strlen(key);
+    while(num < list_size && *ptr && *ptr != ']'){
+        if(strncmp(ptr, "null", 4) == 0){
+            list[num++] = 0;
+            ptr += 4;
+        } else {
+            list[num] = strtof(ptr, &end);
+            if(end == ptr) break;
+            ++num;
+            ptr = end;
+        }
+        if(*ptr == ',') ++ptr;
+    }
+    return num;
+}
+
+
+const weather_provider_t openmeteo_provider = {
+    .name           = "Open-Meteo",
+    .host           = "api.open-meteo.com",
+    .key_len        = 0,
+    .build_request  = build_request,
+    .parse          = parse,
+    .check_city     = check_city,
+};
@@ -0,0 +1,48 @@
+#include "weather_provider.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+_Static_assert(FORECAST_LIST_SIZE == 5, "cnt in the request must match FORECAST_LIST_SIZE");
+
+static int build_request(struct iovec *iov, int iov_max, const char *city, const char *api_key)
+{
+    if(iov_max < 4) return 0;
+    iov[0] = IOV_LITERAL("/data/2.5/forecast?q=");
+    iov[1] = IOV_STRING(city, strlen(city));
+    iov[2] = IOV_LITERAL("&units=metric&cnt=5&appid=");
+    iov[3] = IOV_STRING(api_key, strlen(api_key));
+    return 4;
+}
+
+static bool parse(char *body, size_t body_len, service_data_t *data)
+{
+    char *feels_like_list[FORECAST_LIST_SIZE], *description_list[FORECAST_LIST_SIZE], *pop_list[FORECAST_LIST_SIZE]; 
+    const size_t pop_num = get_value_ptrs(pop_list, FORECAST_LIST_SIZE, body, body_len, "\"pop\":");
+    const size_t feels_like_num = get_value_ptrs(feels_like_list, FORECAST_LIST_SIZE, body, body_len, "\"feels_like\":");
+    const size_t description_num = get_value_ptrs(description_list, FORECAST_LIST_SIZE, body, body_len, "\"description\":\"");
+    split(body, "},\"", body_len);
+
+    memset(data->desciption, 0, sizeof(data->desciption));
+    for(int i=0; i<description_num; ++i){
+        strncpy(data->desciption[i], description_list[i], sizeof(data->desciption[0])-1);
+    }
+    for(int i=0; i<feels_like_num; ++i){
+        data->temp_list[i] = atof(feels_like_list[i]);
+    }
+    for(int i=0; i<pop_num; ++i){
+        data->pop_list[i] = atof(pop_list[i])*100;
+    }
+    return feels_like_num != 0;
+}
+
+
+const weather_provider_t openweather_provider = {
+    .name           = "Openweather",
+    .host           = "api.openweathermap.org",
+    .key_len        = API_LEN,
+    .build_request  = build_request,
+    .parse          = parse,
+    .check_city     = NULL,
+};
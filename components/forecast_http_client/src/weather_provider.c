@@ -0,0 +1,59 @@
+#include "weather_provider.h"
+
+#include <string.h>
+#include "sdkconfig.h"
+
+
+const weather_provider_t *get_weather_provider()
+{
+#if CONFIG_WEATHER_PROVIDER_OPENMETEO
+    return &openmeteo_provider;
+#else
+    return &openweather_provider;
+#endif
+}
+
+// an empty City is stored as is, it turns the forecast off
+bool weather_provider_check_city(const char *city)
+{
+    const weather_provider_t *provider = get_weather_provider();
+    return city[0] == 0 || provider->check_city == NULL || provider->check_city(city);
+}
+
+
+size_t get_value_ptrs(char **value_list, size_t list_size, char *data_buf, const size_t buf_len, const char *key)
+{
+    if(data_buf == NULL) 
+        return 0;
+    const size_t key_size = strlen(key);
+    char *data_ptr = data_buf;
+    const char *data_end = data_buf+buf_len;
+    size_t value_list_size = 0;
+    while(data_ptr = strstr(data_ptr, key), 
+            data_ptr 
+            && data_end > data_ptr 
+            && list_size > value_list_size ){
+        data_ptr += key_size;
+        value_list[value_list_size++] = data_ptr;
+    }
+    return value_list_size;
+}
+
+
+void split(char *data_buf, const char *split_chars_str, uint32_t data_size)
+{
+    char *ptr = data_buf;
+    const char *end_data_buf = data_buf + data_size;
+    const size_t symb_list_size = strlen(split_chars_str);
+    char c;
+    while(ptr != end_data_buf){
+        c = *(ptr);
+        for(int i=0; i<symb_list_size; ++i){
+            if(split_chars_str[i] == c){
+                *(ptr) = 0;
+                break;
+            }
+        }
+        ++ptr;
+    }
+}
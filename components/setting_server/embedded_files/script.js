@@ -13,10 +13,13 @@ const FORMS_LIST = [
 ];
 
 const modal = window.document.getElementById('modal');
+// forms filled by getSetting() or changed by hand, saveAll() leaves the others alone
+const touchedForms = new Set();
 
 
 function addAction(day, td, str_val)
 {
+touchedForms.add(td.closest('form').name);
 let rmBut = null;
 if(td.children.length == 1){
 rmBut = document.createElement('input');
@@ -39,6 +42,7 @@ td.insertBefore(inpTime, rmBut);
 
 function removeAction(td)
 {
+touchedForms.add(td.closest('form').name);
 td.removeChild(td.children[td.children.length-3]);
 if(td.children.length == 2)
 td.removeChild(td.children[td.children.length-2]);
@@ -87,7 +91,7 @@ document.getElementById('settings_forms').appendChild(fieldset);
 
 function setNotificationData(schema,notif_data="")
 {
-if(schema?.length==14 && notif_data?.length%4===0 && notif_data.length>0){
+if(schema?.length==14 && notif_data?.length%3===0 && notif_data.length>0){
 let vi=0, si=0;
 for(let d=0; d<7; d++){
 let td = document.getElementById(DAY_PREF+d);
@@ -96,8 +100,8 @@ while(td.children.length>2){
 removeAction(td);
 }
 const notif_num = +schema[si++]*10 + +schema[si++];
-for(let n=0;n<notif_num;++n,vi+=4){
-const time_min = +notif_data.slice(vi,vi+4);
+for(let n=0;n<notif_num;++n,vi+=3){
+const time_min = parseInt(notif_data.slice(vi,vi+3),16);
 const str_val = Math.trunc(time_min/60).toString().padStart(2,'0') + ":" + (time_min%60).toString().padStart(2,'0');
 addAction(d, td, str_val);
 }
@@ -119,8 +123,10 @@ fetch('/data?', {
 for(const key in r){
     const value = r[key];
     if(key === 'schema'){
+        touchedForms.add('Notification');
         setNotificationData(value, r['notif']);
     } else if(key === 'Status'){
+        touchedForms.add('Status');
         const flags = Number(value);
     [...document.querySelectorAll('[type=checkbox]')].forEach((checkbox, i) =>{
     checkbox.checked = flags&(1<<i);
@@ -212,6 +218,11 @@ modal.classList.remove('show');
 
 
 
+document.body.addEventListener('input', (e) => {
+if(e.target.form)
+touchedForms.add(e.target.form.name);
+});
+
 document.body.addEventListener('submit', (e) => {
 e.preventDefault();
 e.stopPropagation();
@@ -220,7 +231,7 @@ sendData(e.target.name);
 
 const get_schema_str = (sch)=>sch.map(el=>Math.trunc(el/10)+''+ el%10).join('')
 
-const get_min_str = (time="")=>(+time.slice(0,2)*60 + +time.slice(2,4)).toString().padStart(4,'0')
+const get_min_str = (time="")=>(+time.slice(0,2)*60 + +time.slice(2,4)).toString(16).padStart(3,'0')
 
 
 function sendData(formName)
@@ -259,6 +270,10 @@ for(const child of childsList){
     }
 }
 }
+if(formName == 'OTA'){
+    uploadFirmware(data);
+    return;
+}
 if(formName == 'Notification'){
     data=JSON.stringify({
         schema:get_schema_str(schema),
@@ -271,6 +286,42 @@ sendDataForm(formName, data);
 }
 }
 
+// every form except OTA in one /config request
+function saveAll()
+{
+const js = {};
+const arr = [];
+const schema = [0,0,0,0,0,0,0];
+let flags = 0, i = 0;
+for(const form of document.forms){
+if(form.name === 'OTA') continue;
+for(const child of form){
+    const value = child.value;
+    if(child.type === 'checkbox'){
+        if(child.checked)
+            flags |= 1<<i;
+        i++;
+    } else if(!value){
+        continue;
+    } else if(child.type === 'number'){
+        js[child.name] = Number(value);
+    } else if(child.type === 'text'){
+        js[child.name] = value;
+    } else if(child.type === 'time'){
+        ++schema[Number(child.name.split('t')[0])];
+        arr.push(get_min_str(value.split(':').join('')));
+    }
+}
+}
+// Status and schedule the page never loaded would clear the device's
+if(touchedForms.has('Status'))
+js.Status = flags;
+if(touchedForms.has('Notification')){
+js.schema = get_schema_str(schema);
+js.notif = arr.join('');
+}
+sendDataForm('config', JSON.stringify(js));
+}
 
 async function sendDataForm(path, data=""){
 let res = true;
@@ -286,6 +337,97 @@ return r.text()
 .catch((e) => showModal(e, false));
 }
 
+const OTA_RETRY_NUM = 10;
+
+// plain SHA-256, crypto.subtle is not available on the http settings page
+function sha256(data)
+{
+const K = [];
+const H = [];
+const frac = (x)=>((x - Math.floor(x)) * 0x100000000) | 0;
+for(let n=2, found=0; found<64; ++n){
+    let prime = true;
+    for(let d=2; d*d<=n; ++d) if(n%d === 0){ prime = false; break; }
+    if(!prime) continue;
+    if(found < 8) H.push(frac(Math.pow(n, 1/2)));
+    K.push(frac(Math.pow(n, 1/3)));
+    ++found;
+}
+const len = data.length;
+const total = Math.ceil((len + 9) / 64) * 64;
+const msg = new Uint8Array(total);
+msg.set(data);
+msg[len] = 0x80;
+const view = new DataView(msg.buffer);
+view.setUint32(total - 8, Math.floor(len / 0x20000000));
+view.setUint32(total - 4, len << 3);
+const w = new Int32Array(64);
+const rotr = (x, n)=>(x >>> n) | (x << (32 - n));
+for(let off=0; off<total; off+=64){
+    for(let i=0; i<16; ++i) w[i] = view.getInt32(off + i*4);
+    for(let i=16; i<64; ++i){
+        const s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >>> 3);
+        const s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >>> 10);
+        w[i] = (w[i-16] + s0 + w[i-7] + s1) | 0;
+    }
+    let [a, b, c, d, e, f, g, h] = H;
+    for(let i=0; i<64; ++i){
+        const t1 = (h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i]) | 0;
+        const t2 = ((rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c))) | 0;
+        h = g; g = f; f = e; e = (d + t1) | 0;
+        d = c; c = b; b = a; a = (t1 + t2) | 0;
+    }
+    [a, b, c, d, e, f, g, h].forEach((v, i)=>{ H[i] = (H[i] + v) | 0; });
+}
+return H.map((v)=>(v >>> 0).toString(16).padStart(8, '0')).join('');
+}
+
+// the image goes in one request, after a dropped connection
+// the device tells the offset (X-OTA-Offset) to continue from
+async function uploadFirmware(file)
+{
+if(!file) return;
+const image = new Uint8Array(await file.arrayBuffer());
+const digest = sha256(image);
+let offset = 0;
+for(let attempt=0; attempt<OTA_RETRY_NUM; ++attempt){
+    try{
+        const r = await fetch('/OTA', {
+            method:'POST',
+            headers:{
+                'X-OTA-Offset':offset,
+                'X-OTA-Size':image.length,
+                'X-OTA-SHA256':digest,
+            },
+            body:image.slice(offset),
+        });
+        const text = await r.text();
+        if(r.status !== 202 && r.status !== 409 && r.status !== 408){
+            showModal(text, r.ok);
+            return;
+        }
+        offset = +r.headers.get('X-OTA-Offset');
+    } catch(e) {
+        await new Promise((resolve)=>setTimeout(resolve, 2000));
+        offset = await getOtaOffset();
+    }
+    if(offset){
+        showModal('Resume from ' + Math.trunc(offset*100/image.length) + '%', true);
+    }
+}
+showModal('Update failed', false);
+}
+
+async function getOtaOffset()
+{
+try{
+    const r = await fetch('/OTA', {method:'POST', body:''});
+    return +r.headers.get('X-OTA-Offset');
+} catch(e) {
+    return 0;
+}
+}
+
 function setTime() 
 {
 const data = "" + Math.trunc(new Date().getTime());
@@ -0,0 +1,19 @@
+#!/usr/bin/env python
+# Compresses a web asset for setting_server, the output is byte-stable
+# between builds (no timestamp, no file name) so the ETag only changes
+# when the asset itself does.
+import gzip
+import sys
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('usage: gzip_asset.py <input> <output>')
+    with open(sys.argv[1], 'rb') as src:
+        data = src.read()
+    with open(sys.argv[2], 'wb') as dst:
+        dst.write(gzip.compress(data, compresslevel=9, mtime=0))
+
+
+if __name__ == '__main__':
+    main()
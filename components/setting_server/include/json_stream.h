@@ -0,0 +1,86 @@
+#ifndef JSON_STREAM_H_
+#define JSON_STREAM_H_
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "stddef.h"
+#include "stdbool.h"
+
+
+enum JsonStreamConst{
+    JSON_KEY_LEN        = 16,
+    JSON_VALUE_LEN      = 64,
+    JSON_WRITE_BUF_LEN  = 128,
+};
+
+typedef enum {
+    JSON_TYPE_STRING,
+    JSON_TYPE_NUMBER,
+    JSON_TYPE_BOOL,
+    JSON_TYPE_NULL,
+} json_type_t;
+
+// called for every field of the object, a string longer than JSON_VALUE_LEN
+// comes in several pieces and only the last one has is_last set,
+// any result other than ESP_OK stops the parsing and is returned by json_stream_feed()
+typedef int (*json_field_cb_t)(void *ctx, const char *key, json_type_t type,
+                                const char *value, size_t len, bool is_last);
+
+// incremental (SAX) parser of one flat JSON object, 
+// the text can be fed in arbitrary pieces as it arrives from the socket;
+// a field whose key is longer than JSON_KEY_LEN is skipped like an unknown one
+typedef struct {
+    int state;
+    bool is_escape;
+    bool is_skip;
+    unsigned unicode;
+    unsigned unicode_num;
+    json_type_t type;
+    size_t key_len;
+    size_t value_len;
+    char key[JSON_KEY_LEN+1];
+    char value[JSON_VALUE_LEN+1];
+    json_field_cb_t cb;
+    void *ctx;
+} json_stream_t;
+
+// takes the output of the writer, any result other than ESP_OK is kept as the writer error
+typedef int (*json_write_cb_t)(void *ctx, const char *data, size_t len);
+
+// compact JSON object writer, the text goes out in JSON_WRITE_BUF_LEN pieces,
+// after an error the following calls do nothing and json_write_end() returns it
+typedef struct {
+    char buf[JSON_WRITE_BUF_LEN];
+    size_t len;
+    bool is_first;
+    int err;
+    json_write_cb_t cb;
+    void *ctx;
+} json_writer_t;
+
+
+void json_stream_init(json_stream_t *js, json_field_cb_t cb, void *ctx);
+int json_stream_feed(json_stream_t *js, const char *data, size_t len);
+bool json_stream_done(const json_stream_t *js);
+
+void json_write_begin(json_writer_t *jw, json_write_cb_t cb, void *ctx);
+void json_write_str(json_writer_t *jw, const char *key, const char *value);
+void json_write_num(json_writer_t *jw, const char *key, long value);
+void json_write_float(json_writer_t *jw, const char *key, double value);
+// a string value written in parts, the parts are not escaped
+void json_write_str_begin(json_writer_t *jw, const char *key);
+void json_write_raw(json_writer_t *jw, const char *data, size_t len);
+void json_write_str_end(json_writer_t *jw);
+int json_write_end(json_writer_t *jw);
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef OTA_SESSION_H_
+#define OTA_SESSION_H_
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "stddef.h"
+#include "stdbool.h"
+
+
+#define OTA_DIGEST_LEN 32
+
+// reads up to len bytes of the image, returns the number read or <= 0 when the source is gone
+typedef int (*ota_read_cb_t)(void *ctx, char *buf, size_t len);
+
+
+int ota_session_init(char *buf_a, char *buf_b, size_t buf_len);
+void ota_session_deinit();
+int ota_session_begin(size_t total, const unsigned char *digest);
+int ota_session_write(ota_read_cb_t read_cb, void *ctx, size_t len);
+int ota_session_finish();
+void ota_session_abort();
+bool ota_session_is_active();
+size_t ota_session_get_written();
+size_t ota_session_get_total();
+int ota_session_get_progress();
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef SERVER_METRICS_H_
+#define SERVER_METRICS_H_
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "stddef.h"
+#include "json_stream.h"
+
+
+enum MetricId{
+    METRIC_UPTIME,
+    METRIC_BATTERY,
+    METRIC_TEMPERATURE,
+    METRIC_HUMIDITY,
+    METRIC_HEAP_FREE,
+    METRIC_HEAP_MIN_FREE,
+    METRIC_HEAP_LARGEST_BLOCK,
+    METRIC_TASK_NUM,
+    METRIC_WAKEUP_TIMER,
+    METRIC_WAKEUP_BUTTON,
+    METRIC_SLEEP,
+    METRIC_RADIO_ON,
+    METRIC_DNS_QUERY,
+    METRIC_DNS_DROP,
+    METRIC_FLASH_WRITE,
+    METRIC_FLASH_ERASE,
+    METRIC_CLOCK_DRIFT,
+    METRIC_FORECAST_FETCH,
+    METRIC_FORECAST_FAIL,
+    METRIC_FORECAST_NOT_MODIFIED,
+    METRIC_FORECAST_RECEIVED,
+    METRIC_FORECAST_BODY,
+    METRIC_FORECAST_FETCH_TIME,
+    METRIC_FORECAST_PARSE_MAX,
+    METRIC_WIFI_CONNECT,
+    METRIC_WIFI_FAIL,
+    METRIC_WIFI_CONNECT_TIME,
+    METRIC_WIFI_CONNECT_MAX,
+    METRIC_STATE,
+    METRIC_NUM
+};
+
+// tasks whose stack high-water mark is reported
+enum{ METRIC_STACK_TASK_NUM = 5 };
+
+// one snapshot, taken at once so both formats show the same moment
+typedef struct {
+    double value[METRIC_NUM];
+    long stack_free[METRIC_STACK_TASK_NUM];
+} server_metrics_t;
+
+
+void server_metrics_collect(server_metrics_t *metrics);
+// Prometheus text exposition format, lines are gathered in buf and passed to cb when it fills
+int server_metrics_write_text(const server_metrics_t *metrics, char *buf, size_t buf_size,
+                                json_write_cb_t cb, void *ctx);
+void server_metrics_write_json(const server_metrics_t *metrics, json_writer_t *jw);
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,11 +1,45 @@
 #ifndef SETTING_SERVER_H
 #define SETTING_SERVER_H
 
+#include "stddef.h"
+
+
+// captive portal DNS, counted since boot
+typedef struct {
+    unsigned query_num;
+    unsigned answer_num;
+    unsigned empty_num;
+    unsigned drop_num;
+} dns_server_stats_t;
+
+enum{ SERVER_LATENCY_BUCKET_NUM = 8 };
+
+// per route, counted since boot
+typedef struct {
+    const char *path;
+    unsigned request_num;
+    unsigned error_num;
+    unsigned max_us;
+    unsigned long long total_us;
+} server_route_stats_t;
+
+typedef struct {
+    unsigned unmatched_num;
+    unsigned rejected_num;
+    // upper bounds of the latency buckets, the last one takes the rest
+    unsigned latency_le_us[SERVER_LATENCY_BUCKET_NUM-1];
+    unsigned latency_bucket[SERVER_LATENCY_BUCKET_NUM];
+} server_stats_t;
 
 
 void init_dns_server_task();
-int init_server(char *server_buf);
+int init_server();
 int deinit_server();
 void deinit_dns_server();
+const dns_server_stats_t *dns_server_get_stats();
+int server_get_ota_progress();
+unsigned server_get_idle_ms();
+const server_stats_t *server_get_stats();
+const server_route_stats_t *server_get_route_stats(size_t *route_num);
 
 #endif
\ No newline at end of file
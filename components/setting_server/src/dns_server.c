@@ -0,0 +1,183 @@
+#include "setting_server.h"
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_netif.h"
+#include "esp_log.h"
+#include "esp_err.h"
+
+
+#define DNS_TASK_STACK      3072
+#define DNS_TASK_PRIORITY   5
+#define DNS_AP_IFKEY        "WIFI_AP_DEF"
+#define DNS_DEFAULT_IP      "192.168.4.1"
+
+enum DnsConst{
+    DNS_PORT            = 53,
+    DNS_HEADER_SIZE     = 12,
+    DNS_MAX_PACKET      = 512,
+    DNS_ANSWER_SIZE     = 16,
+    DNS_TYPE_A          = 1,
+    DNS_TYPE_ANY        = 255,
+    DNS_CLASS_IN        = 1,
+    DNS_TTL_SEC         = 60,
+    DNS_RECV_TIMEOUT_MS = 500,
+};
+
+enum DnsFlags{
+    DNS_FLAG_QR         = 0x80,
+    DNS_FLAG_OPCODE     = 0x78,
+    DNS_FLAG_AA         = 0x04,
+    DNS_FLAG_RD         = 0x01,
+    DNS_FLAG_RA         = 0x80,
+    DNS_LABEL_POINTER   = 0xC0,
+};
+
+static const char *TAG = "dns";
+
+static volatile bool dns_run;
+static SemaphoreHandle_t dns_done;
+static dns_server_stats_t dns_stats;
+
+
+static void dns_task(void *pv);
+static int build_answer(unsigned char *packet, int len, uint32_t ip);
+static uint32_t get_ap_ip();
+
+
+
+void init_dns_server_task()
+{
+    if(dns_run) return;
+    if(dns_done == NULL){
+        dns_done = xSemaphoreCreateBinary();
+        if(dns_done == NULL) return;
+    }
+    dns_run = true;
+    if(xTaskCreate(dns_task, "dns", DNS_TASK_STACK, NULL, DNS_TASK_PRIORITY, NULL) != pdPASS){
+        ESP_LOGE(TAG, "task not created");
+        dns_run = false;
+    }
+}
+
+// the task notices the flag within one receive timeout and confirms its exit
+void deinit_dns_server()
+{
+    if(!dns_run) return;
+    dns_run = false;
+    xSemaphoreTake(dns_done, portMAX_DELAY);
+}
+
+const dns_server_stats_t *dns_server_get_stats()
+{
+    return &dns_stats;
+}
+
+
+static void dns_task(void *pv)
+{
+    // answers are written over the query, no allocation per packet
+    static unsigned char packet[DNS_MAX_PACKET];
+    struct sockaddr_in client_addr;
+    socklen_t addr_len;
+    const struct timeval recv_timeout = { .tv_usec = DNS_RECV_TIMEOUT_MS * 1000 };
+    const struct sockaddr_in server_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(DNS_PORT),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    const uint32_t ip = get_ap_ip();
+
+    const int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock < 0 || bind(sock, (const struct sockaddr *)&server_addr, sizeof(server_addr)) != 0){
+        ESP_LOGE(TAG, "socket not bound");
+        goto end;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout, sizeof(recv_timeout));
+    while(dns_run){
+        addr_len = sizeof(client_addr);
+        const int len = recvfrom(sock, packet, sizeof(packet), 0, 
+                                (struct sockaddr *)&client_addr, &addr_len);
+        if(len <= 0) continue;
+        dns_stats.query_num += 1;
+        const int answer_len = build_answer(packet, len, ip);
+        if(answer_len <= 0){
+            dns_stats.drop_num += 1;
+            continue;
+        }
+        sendto(sock, packet, answer_len, 0, (struct sockaddr *)&client_addr, addr_len);
+    }
+
+end:
+    if(sock >= 0) close(sock);
+    xSemaphoreGive(dns_done);
+    vTaskDelete(NULL);
+}
+
+// every A query gets the AP address, other types an empty answer
+static int build_answer(unsigned char *packet, int len, uint32_t ip)
+{
+    int pos = DNS_HEADER_SIZE;
+    if(len < DNS_HEADER_SIZE 
+            || packet[2] & (DNS_FLAG_QR|DNS_FLAG_OPCODE)
+            || packet[4] != 0 || packet[5] != 1){
+        return ESP_FAIL;
+    }
+    while(pos < len && packet[pos]){
+        if(packet[pos] & DNS_LABEL_POINTER) return ESP_FAIL;
+        pos += packet[pos] + 1;
+    }
+    // zero label, type and class
+    if(pos + 5 > len) return ESP_FAIL;
+    pos += 1;
+    const unsigned type = packet[pos]<<8 | packet[pos+1];
+    const unsigned class = packet[pos+2]<<8 | packet[pos+3];
+    pos += 4;
+
+    packet[2] = DNS_FLAG_QR | DNS_FLAG_AA | (packet[2] & DNS_FLAG_RD);
+    packet[3] = DNS_FLAG_RA;
+    // answer count and no authority or additional records (EDNS is dropped)
+    memset(&packet[6], 0, 6);
+    if(class != DNS_CLASS_IN || (type != DNS_TYPE_A && type != DNS_TYPE_ANY)){
+        dns_stats.empty_num += 1;
+        return pos;
+    }
+    if(pos + DNS_ANSWER_SIZE > DNS_MAX_PACKET) return ESP_FAIL;
+    packet[7] = 1;
+    unsigned char *answer = &packet[pos];
+    // name as a pointer to the question
+    answer[0] = DNS_LABEL_POINTER;
+    answer[1] = DNS_HEADER_SIZE;
+    answer[2] = 0;
+    answer[3] = DNS_TYPE_A;
+    answer[4] = 0;
+    answer[5] = DNS_CLASS_IN;
+    answer[6] = 0;
+    answer[7] = 0;
+    answer[8] = 0;
+    answer[9] = DNS_TTL_SEC;
+    answer[10] = 0;
+    answer[11] = 4;
+    // ip is in network order already
+    memcpy(&answer[12], &ip, 4);
+    dns_stats.answer_num += 1;
+    return pos + DNS_ANSWER_SIZE;
+}
+
+static uint32_t get_ap_ip()
+{
+    esp_netif_ip_info_t ip_info;
+    esp_netif_t *netif = esp_netif_get_handle_from_ifkey(DNS_AP_IFKEY);
+    if(netif && esp_netif_get_ip_info(netif, &ip_info) == ESP_OK && ip_info.ip.addr){
+        return ip_info.ip.addr;
+    }
+    return inet_addr(DNS_DEFAULT_IP);
+}
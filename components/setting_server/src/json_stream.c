@@ -0,0 +1,383 @@
+#include "json_stream.h"
+
+#include "string.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "esp_err.h"
+#include "device_macro.h"
+
+
+enum JsonState{
+    JSON_STATE_START,
+    JSON_STATE_FIRST_KEY,
+    JSON_STATE_KEY_START,
+    JSON_STATE_KEY,
+    JSON_STATE_COLON,
+    JSON_STATE_VALUE,
+    JSON_STATE_STRING,
+    JSON_STATE_LITERAL,
+    JSON_STATE_NEXT,
+    JSON_STATE_DONE,
+    JSON_STATE_ERROR,
+};
+
+
+static int put_string_char(json_stream_t *js, char c);
+static int put_bytes(json_stream_t *js, const char *data, size_t len);
+static int end_string(json_stream_t *js);
+static int end_literal(json_stream_t *js);
+static bool is_space(char c);
+static bool is_literal_char(char c);
+static int get_hex(char c);
+static void write_key(json_writer_t *jw, const char *key);
+static void write_escaped(json_writer_t *jw, const char *str);
+static void flush(json_writer_t *jw);
+
+
+
+void json_stream_init(json_stream_t *js, json_field_cb_t cb, void *ctx)
+{
+    memset(js, 0, sizeof(json_stream_t));
+    js->state = JSON_STATE_START;
+    js->cb = cb;
+    js->ctx = ctx;
+}
+
+bool json_stream_done(const json_stream_t *js)
+{
+    return js->state == JSON_STATE_DONE;
+}
+
+int json_stream_feed(json_stream_t *js, const char *data, size_t len)
+{
+    const char *end = data + len;
+    int err = ESP_OK;
+    for(; data < end && err == ESP_OK; ++data){
+        const char c = *data;
+        switch(js->state){
+        case JSON_STATE_START:
+            if(is_space(c)) break;
+            if(c != '{'){
+                err = ESP_FAIL;
+                break;
+            }
+            js->state = JSON_STATE_FIRST_KEY;
+            break;
+        case JSON_STATE_FIRST_KEY:
+        case JSON_STATE_KEY_START:
+            if(is_space(c)) break;
+            if(c == '}' && js->state == JSON_STATE_FIRST_KEY){
+                js->state = JSON_STATE_DONE;
+            } else if(c == '"'){
+                js->key_len = 0;
+                js->is_skip = false;
+                js->state = JSON_STATE_KEY;
+            } else {
+                err = ESP_FAIL;
+            }
+            break;
+        case JSON_STATE_KEY:
+        case JSON_STATE_STRING:
+            err = put_string_char(js, c);
+            break;
+        case JSON_STATE_COLON:
+            if(is_space(c)) break;
+            if(c != ':'){
+                err = ESP_FAIL;
+                break;
+            }
+            js->state = JSON_STATE_VALUE;
+            break;
+        case JSON_STATE_VALUE:
+            if(is_space(c)) break;
+            js->value_len = 0;
+            if(c == '"'){
+                js->type = JSON_TYPE_STRING;
+                js->state = JSON_STATE_STRING;
+                break;
+            } 
+            if(c == '-' || (c >= '0' && c <= '9')){
+                js->type = JSON_TYPE_NUMBER;
+            } else if(c == 't' || c == 'f'){
+                js->type = JSON_TYPE_BOOL;
+            } else if(c == 'n'){
+                js->type = JSON_TYPE_NULL;
+            } else {
+                err = ESP_FAIL;
+                break;
+            }
+            js->value[js->value_len++] = c;
+            js->state = JSON_STATE_LITERAL;
+            break;
+        case JSON_STATE_LITERAL:
+            if(is_literal_char(c)){
+                if(js->value_len == JSON_VALUE_LEN){
+                    err = ESP_FAIL;
+                } else {
+                    js->value[js->value_len++] = c;
+                }
+                break;
+            }
+            err = end_literal(js);
+            if(err != ESP_OK) break;
+            js->state = JSON_STATE_NEXT;
+            // the character that closed the literal is the separator
+            __attribute__((fallthrough));
+        case JSON_STATE_NEXT:
+            if(is_space(c)) break;
+            if(c == ','){
+                js->state = JSON_STATE_KEY_START;
+            } else if(c == '}'){
+                js->state = JSON_STATE_DONE;
+            } else {
+                err = ESP_FAIL;
+            }
+            break;
+        case JSON_STATE_DONE:
+            if(!is_space(c)){
+                err = ESP_FAIL;
+            }
+            break;
+        default:
+            err = ESP_FAIL;
+            break;
+        }
+    }
+    if(err != ESP_OK){
+        js->state = JSON_STATE_ERROR;
+    }
+    return err;
+}
+
+void json_write_begin(json_writer_t *jw, json_write_cb_t cb, void *ctx)
+{
+    jw->len = 0;
+    jw->is_first = true;
+    jw->err = ESP_OK;
+    jw->cb = cb;
+    jw->ctx = ctx;
+    json_write_raw(jw, "{", 1);
+}
+
+void json_write_str(json_writer_t *jw, const char *key, const char *value)
+{
+    json_write_str_begin(jw, key);
+    write_escaped(jw, value);
+    json_write_str_end(jw);
+}
+
+void json_write_num(json_writer_t *jw, const char *key, long value)
+{
+    char num_buf[12];
+    write_key(jw, key);
+    json_write_raw(jw, num_buf, snprintf(num_buf, sizeof(num_buf), "%ld", value));
+}
+
+void json_write_float(json_writer_t *jw, const char *key, double value)
+{
+    char num_buf[24];
+    write_key(jw, key);
+    json_write_raw(jw, num_buf, snprintf(num_buf, sizeof(num_buf), "%.10g", value));
+}
+
+void json_write_str_begin(json_writer_t *jw, const char *key)
+{
+    write_key(jw, key);
+    json_write_raw(jw, "\"", 1);
+}
+
+void json_write_str_end(json_writer_t *jw)
+{
+    json_write_raw(jw, "\"", 1);
+}
+
+void json_write_raw(json_writer_t *jw, const char *data, size_t len)
+{
+    while(len && jw->err == ESP_OK){
+        if(jw->len == JSON_WRITE_BUF_LEN){
+            flush(jw);
+        }
+        const size_t part = MIN(len, JSON_WRITE_BUF_LEN - jw->len);
+        memcpy(jw->buf + jw->len, data, part);
+        jw->len += part;
+        data += part;
+        len -= part;
+    }
+}
+
+int json_write_end(json_writer_t *jw)
+{
+    json_write_raw(jw, "}", 1);
+    flush(jw);
+    return jw->err;
+}
+
+
+static void write_key(json_writer_t *jw, const char *key)
+{
+    if(!jw->is_first){
+        json_write_raw(jw, ",", 1);
+    }
+    jw->is_first = false;
+    json_write_raw(jw, "\"", 1);
+    write_escaped(jw, key);
+    json_write_raw(jw, "\":", 2);
+}
+
+static void write_escaped(json_writer_t *jw, const char *str)
+{
+    char esc[7];
+    const char *start = str;
+    for(; *str; ++str){
+        const unsigned char c = *str;
+        if(c >= 0x20 && c != '"' && c != '\\') continue;
+        json_write_raw(jw, start, str - start);
+        if(c == '"' || c == '\\'){
+            esc[0] = '\\';
+            esc[1] = c;
+            json_write_raw(jw, esc, 2);
+        } else {
+            json_write_raw(jw, esc, snprintf(esc, sizeof(esc), "\\u%04x", c));
+        }
+        start = str + 1;
+    }
+    json_write_raw(jw, start, str - start);
+}
+
+static void flush(json_writer_t *jw)
+{
+    if(jw->len && jw->err == ESP_OK){
+        jw->err = jw->cb(jw->ctx, jw->buf, jw->len);
+    }
+    jw->len = 0;
+}
+
+
+static int put_string_char(json_stream_t *js, char c)
+{
+    if(js->unicode_num){
+        const int hex = get_hex(c);
+        if(hex < 0) return ESP_FAIL;
+        js->unicode = js->unicode<<4 | hex;
+        if(--js->unicode_num) return ESP_OK;
+        const unsigned u = js->unicode;
+        char utf8[3];
+        // no surrogate pairs, only plain BMP characters are expected
+        if(u == 0 || (u >= 0xD800 && u <= 0xDFFF)) return ESP_FAIL;
+        if(u < 0x80){
+            utf8[0] = u;
+            return put_bytes(js, utf8, 1);
+        } else if(u < 0x800){
+            utf8[0] = 0xC0 | u>>6;
+            utf8[1] = 0x80 | (u&0x3F);
+            return put_bytes(js, utf8, 2);
+        }
+        utf8[0] = 0xE0 | u>>12;
+        utf8[1] = 0x80 | ((u>>6)&0x3F);
+        utf8[2] = 0x80 | (u&0x3F);
+        return put_bytes(js, utf8, 3);
+    }
+    if(js->is_escape){
+        js->is_escape = false;
+        switch(c){
+            case '"':
+            case '\\':
+            case '/': break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            case 'u': 
+                js->unicode = 0;
+                js->unicode_num = 4;
+                return ESP_OK;
+            default: return ESP_FAIL;
+        }
+        return put_bytes(js, &c, 1);
+    }
+    if(c == '\\'){
+        js->is_escape = true;
+        return ESP_OK;
+    }
+    if(c == '"'){
+        return end_string(js);
+    }
+    if((unsigned char)c < 0x20){
+        return ESP_FAIL;
+    }
+    return put_bytes(js, &c, 1);
+}
+
+static int put_bytes(json_stream_t *js, const char *data, size_t len)
+{
+    if(js->state == JSON_STATE_KEY){
+        // no field of ours has a key this long, its value is read and dropped
+        if(js->is_skip || js->key_len + len > JSON_KEY_LEN){
+            js->is_skip = true;
+            return ESP_OK;
+        }
+        memcpy(js->key + js->key_len, data, len);
+        js->key_len += len;
+        return ESP_OK;
+    }
+    if(js->value_len + len > JSON_VALUE_LEN){
+        js->value[js->value_len] = 0;
+        if(!js->is_skip){
+            const int err = js->cb(js->ctx, js->key, js->type, js->value, js->value_len, false);
+            if(err != ESP_OK) return err;
+        }
+        js->value_len = 0;
+    }
+    memcpy(js->value + js->value_len, data, len);
+    js->value_len += len;
+    return ESP_OK;
+}
+
+static int end_string(json_stream_t *js)
+{
+    if(js->state == JSON_STATE_KEY){
+        js->key[js->key_len] = 0;
+        js->state = JSON_STATE_COLON;
+        return ESP_OK;
+    }
+    js->value[js->value_len] = 0;
+    js->state = JSON_STATE_NEXT;
+    if(js->is_skip) return ESP_OK;
+    return js->cb(js->ctx, js->key, js->type, js->value, js->value_len, true);
+}
+
+static int end_literal(json_stream_t *js)
+{
+    char *num_end = NULL;
+    js->value[js->value_len] = 0;
+    if(js->type == JSON_TYPE_NUMBER){
+        strtod(js->value, &num_end);
+        if(num_end != js->value + js->value_len) return ESP_FAIL;
+    } else if(js->type == JSON_TYPE_BOOL){
+        if(strcmp(js->value, "true") != 0 && strcmp(js->value, "false") != 0) return ESP_FAIL;
+    } else if(strcmp(js->value, "null") != 0){
+        return ESP_FAIL;
+    }
+    if(js->is_skip) return ESP_OK;
+    return js->cb(js->ctx, js->key, js->type, js->value, js->value_len, true);
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool is_literal_char(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') 
+            || c == '-' || c == '+' || c == '.' || c == 'E';
+}
+
+static int get_hex(char c)
+{
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
@@ -0,0 +1,231 @@
+#include "ota_session.h"
+
+#include "string.h"
+#include "device_common.h"
+#include "device_macro.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "esp_ota_ops.h"
+#include "esp_partition.h"
+#include "mbedtls/sha256.h"
+#include "esp_log.h"
+
+
+#define OTA_WRITER_STACK    3072
+#define OTA_BUF_NUM         2
+#define OTA_PROGRESS_STEP   5
+
+typedef struct {
+    char *data;
+    size_t len;
+} ota_chunk_t;
+
+static const char *TAG = "OTA";
+
+// upload state, it outlives a request so a dropped upload can be resumed
+static struct {
+    const esp_partition_t *partition;
+    esp_ota_handle_t handle;
+    mbedtls_sha256_context sha;
+    unsigned char digest[OTA_DIGEST_LEN];
+    bool has_digest;
+    bool is_active;
+    size_t written;
+    size_t total;
+    int progress;
+    int write_err;
+    char *buf[OTA_BUF_NUM];
+    size_t buf_len;
+    QueueHandle_t full_queue;
+    QueueHandle_t free_queue;
+    SemaphoreHandle_t writer_done;
+} ota = {
+    .progress = NO_DATA,
+};
+
+
+static void ota_writer_task(void *pv);
+static void update_progress();
+
+
+
+int ota_session_init(char *buf_a, char *buf_b, size_t buf_len)
+{
+    ota.buf[0] = buf_a;
+    ota.buf[1] = buf_b;
+    ota.buf_len = buf_len;
+    ota.full_queue = xQueueCreate(OTA_BUF_NUM+1, sizeof(ota_chunk_t));
+    ota.free_queue = xQueueCreate(OTA_BUF_NUM, sizeof(ota_chunk_t));
+    ota.writer_done = xSemaphoreCreateBinary();
+    if(!ota.full_queue || !ota.free_queue || !ota.writer_done){
+        ota_session_deinit();
+        return ESP_ERR_NO_MEM;
+    }
+    return ESP_OK;
+}
+
+void ota_session_deinit()
+{
+    ota_session_abort();
+    if(ota.full_queue) vQueueDelete(ota.full_queue);
+    if(ota.free_queue) vQueueDelete(ota.free_queue);
+    if(ota.writer_done) vSemaphoreDelete(ota.writer_done);
+    ota.full_queue = ota.free_queue = NULL;
+    ota.writer_done = NULL;
+}
+
+int ota_session_begin(size_t total, const unsigned char *digest)
+{
+    ota_session_abort();
+    ota.partition = esp_ota_get_next_update_partition(NULL);
+    if(ota.partition == NULL){
+        return ESP_ERR_NOT_FOUND;
+    }
+    if(total == 0 || total > ota.partition->size){
+        return ESP_ERR_INVALID_SIZE;
+    }
+    // sectors are erased as the image arrives instead of the whole partition up front
+    CHECK_AND_RET_ERR(esp_ota_begin(ota.partition, OTA_WITH_SEQUENTIAL_WRITES, &ota.handle));
+    mbedtls_sha256_init(&ota.sha);
+    mbedtls_sha256_starts(&ota.sha, 0);
+    ota.has_digest = digest != NULL;
+    if(digest){
+        memcpy(ota.digest, digest, OTA_DIGEST_LEN);
+    }
+    ota.total = total;
+    ota.written = 0;
+    ota.is_active = true;
+    update_progress();
+    return ESP_OK;
+}
+
+// one buffer is filled from the source while the writer task flashes the other one
+int ota_session_write(ota_read_cb_t read_cb, void *ctx, size_t len)
+{
+    ota_chunk_t chunk;
+    int err = ESP_OK;
+    if(!ota.is_active) return ESP_ERR_INVALID_STATE;
+    if(ota.written + len > ota.total) return ESP_ERR_INVALID_SIZE;
+    ota.write_err = ESP_OK;
+    if(xTaskCreate(ota_writer_task, "ota_writer", OTA_WRITER_STACK, 
+                    NULL, uxTaskPriorityGet(NULL), NULL) != pdPASS){
+        return ESP_ERR_NO_MEM;
+    }
+    for(int i=0; i<OTA_BUF_NUM; ++i){
+        chunk.data = ota.buf[i];
+        chunk.len = 0;
+        xQueueSend(ota.free_queue, &chunk, 0);
+    }
+    while(len > 0 && err == ESP_OK && ota.write_err == ESP_OK){
+        xQueueReceive(ota.free_queue, &chunk, portMAX_DELAY);
+        chunk.len = 0;
+        while(chunk.len < ota.buf_len && len > 0){
+            const int received = read_cb(ctx, chunk.data + chunk.len, MIN(len, ota.buf_len - chunk.len));
+            if(received <= 0){
+                err = ESP_ERR_TIMEOUT;
+                break;
+            }
+            chunk.len += received;
+            len -= received;
+        }
+        if(chunk.len){
+            // whatever is hashed gets flashed, so the digest always covers ota.written bytes
+            mbedtls_sha256_update(&ota.sha, (const unsigned char *)chunk.data, chunk.len);
+            xQueueSend(ota.full_queue, &chunk, portMAX_DELAY);
+        }
+    }
+    chunk.len = 0;
+    xQueueSend(ota.full_queue, &chunk, portMAX_DELAY);
+    xSemaphoreTake(ota.writer_done, portMAX_DELAY);
+    xQueueReset(ota.free_queue);
+    if(ota.write_err != ESP_OK){
+        ESP_LOGE(TAG, "write failed at %u", ota.written);
+        err = ota.write_err;
+        ota_session_abort();
+    }
+    return err;
+}
+
+int ota_session_finish()
+{
+    unsigned char digest[OTA_DIGEST_LEN];
+    int err = ESP_ERR_INVALID_STATE;
+    if(!ota.is_active || ota.written != ota.total) return err;
+    mbedtls_sha256_finish(&ota.sha, digest);
+    mbedtls_sha256_free(&ota.sha);
+    ota.is_active = false;
+    if(ota.has_digest && memcmp(digest, ota.digest, OTA_DIGEST_LEN) != 0){
+        ESP_LOGE(TAG, "SHA-256 mismatch");
+        esp_ota_abort(ota.handle);
+        err = ESP_ERR_INVALID_CRC;
+    } else {
+        err = esp_ota_end(ota.handle);
+        if(err == ESP_OK){
+            err = esp_ota_set_boot_partition(ota.partition);
+        }
+    }
+    ota.progress = NO_DATA;
+    return err;
+}
+
+void ota_session_abort()
+{
+    if(!ota.is_active) return;
+    esp_ota_abort(ota.handle);
+    mbedtls_sha256_free(&ota.sha);
+    ota.is_active = false;
+    ota.progress = NO_DATA;
+    device_set_state(BIT_EVENT_NEW_DATA);
+}
+
+bool ota_session_is_active()
+{
+    return ota.is_active;
+}
+
+size_t ota_session_get_written()
+{
+    return ota.is_active ? ota.written : 0;
+}
+
+size_t ota_session_get_total()
+{
+    return ota.total;
+}
+
+int ota_session_get_progress()
+{
+    return ota.progress;
+}
+
+
+static void ota_writer_task(void *pv)
+{
+    ota_chunk_t chunk;
+    for(;;){
+        xQueueReceive(ota.full_queue, &chunk, portMAX_DELAY);
+        if(chunk.len == 0) break;
+        if(ota.write_err == ESP_OK){
+            ota.write_err = esp_ota_write(ota.handle, chunk.data, chunk.len);
+            if(ota.write_err == ESP_OK){
+                ota.written += chunk.len;
+                update_progress();
+            }
+        }
+        xQueueSend(ota.free_queue, &chunk, portMAX_DELAY);
+    }
+    xSemaphoreGive(ota.writer_done);
+    vTaskDelete(NULL);
+}
+
+// the screen is redrawn every OTA_PROGRESS_STEP percent
+static void update_progress()
+{
+    const int progress = (unsigned long long)ota.written * 100 / ota.total;
+    if(ota.progress == NO_DATA || progress - ota.progress >= OTA_PROGRESS_STEP || progress == 100){
+        ota.progress = progress;
+        device_set_state(BIT_EVENT_NEW_DATA);
+    }
+}
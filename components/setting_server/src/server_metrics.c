@@ -0,0 +1,237 @@
+#include "server_metrics.h"
+
+#include "stdio.h"
+#include "stdarg.h"
+#include "math.h"
+#include "string.h"
+#include "setting_server.h"
+#include "device_common.h"
+#include "adc_reader.h"
+#include "time_sync.h"
+#include "forecast_http_client.h"
+#include "wifi_service.h"
+#include "esp_err.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+
+typedef struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} metric_desc_t;
+
+static const metric_desc_t metric_desc[METRIC_NUM] = {
+    [METRIC_UPTIME]             = { "uptime_seconds",           "counter",  "Time since boot" },
+    [METRIC_BATTERY]            = { "battery_volts",            "gauge",    "Battery voltage" },
+    [METRIC_TEMPERATURE]        = { "temperature_celsius",      "gauge",    "DHT20 temperature" },
+    [METRIC_HUMIDITY]           = { "humidity_percent",         "gauge",    "DHT20 relative humidity" },
+    [METRIC_HEAP_FREE]          = { "heap_free_bytes",          "gauge",    "Free heap" },
+    [METRIC_HEAP_MIN_FREE]      = { "heap_min_free_bytes",      "gauge",    "Lowest free heap since boot" },
+    [METRIC_HEAP_LARGEST_BLOCK] = { "heap_largest_block_bytes", "gauge",    "Largest free heap block" },
+    [METRIC_TASK_NUM]           = { "tasks",                    "gauge",    "Tasks known to the scheduler" },
+    [METRIC_WAKEUP_TIMER]       = { "wakeup_timer_total",       "counter",  "Light sleep wakeups by timer" },
+    [METRIC_WAKEUP_BUTTON]      = { "wakeup_button_total",      "counter",  "Light sleep wakeups by button" },
+    [METRIC_SLEEP]              = { "sleep_seconds_total",      "counter",  "Time spent in light sleep" },
+    [METRIC_RADIO_ON]           = { "radio_on_seconds_total",   "counter",  "Time with WiFi up" },
+    [METRIC_DNS_QUERY]          = { "dns_queries_total",        "counter",  "Captive portal DNS queries" },
+    [METRIC_DNS_DROP]           = { "dns_dropped_total",        "counter",  "Captive portal DNS queries dropped" },
+    [METRIC_FLASH_WRITE]        = { "flash_writes_total",       "counter",  "Settings blobs written to NVS" },
+    [METRIC_FLASH_ERASE]        = { "flash_erases_total",       "counter",  "Settings keys erased from NVS" },
+    [METRIC_CLOCK_DRIFT]        = { "clock_drift_ppm",          "gauge",    "Estimated clock drift, positive runs fast" },
+    [METRIC_FORECAST_FETCH]     = { "forecast_fetches_total",   "counter",  "Forecast updates started" },
+    [METRIC_FORECAST_FAIL]      = { "forecast_failures_total",  "counter",  "Forecast updates failed" },
+    [METRIC_FORECAST_NOT_MODIFIED] = { "forecast_not_modified_total", "counter", "Forecast updates answered with 304" },
+    [METRIC_FORECAST_RECEIVED]  = { "forecast_received_bytes_total", "counter", "Forecast bytes read from the socket, retries included" },
+    [METRIC_FORECAST_BODY]      = { "forecast_body_bytes",      "gauge",    "Decoded body of the last forecast" },
+    [METRIC_FORECAST_FETCH_TIME] = { "forecast_fetch_seconds",  "gauge",    "Duration of the last forecast fetch" },
+    [METRIC_FORECAST_PARSE_MAX] = { "forecast_parse_max_seconds", "gauge",  "Slowest forecast parse since boot" },
+    [METRIC_WIFI_CONNECT]       = { "wifi_connects_total",      "counter",  "Station connections that got an address" },
+    [METRIC_WIFI_FAIL]          = { "wifi_failures_total",      "counter",  "Station connections given up" },
+    [METRIC_WIFI_CONNECT_TIME]  = { "wifi_connect_seconds",     "gauge",    "Start to address of the last connection" },
+    [METRIC_WIFI_CONNECT_MAX]   = { "wifi_connect_max_seconds", "gauge",    "Slowest connection since boot" },
+    [METRIC_STATE]              = { "state_bits",               "gauge",    "Device state bits" },
+};
+
+static const char *stack_task_names[METRIC_STACK_TASK_NUM] = {
+    "main", "service", "httpd", "dns", "ota_writer"
+};
+
+#define METRIC_PREFIX "device_"
+
+typedef struct {
+    char *buf;
+    size_t size;
+    size_t len;
+    json_write_cb_t cb;
+    void *ctx;
+    int err;
+} text_writer_t;
+
+
+static void put_line(text_writer_t *tw, const char *format, ...);
+static void put_header(text_writer_t *tw, const char *name, const char *type, const char *help);
+static void flush_text(text_writer_t *tw);
+static double round_to(float value, int scale);
+
+
+
+void server_metrics_collect(server_metrics_t *metrics)
+{
+    const dns_server_stats_t *dns_stats = dns_server_get_stats();
+    const forecast_stats_t *forecast_stats = get_forecast_stats();
+    wifi_sm_stats_t wifi_stats;
+    wifi_get_stats(&wifi_stats);
+    double *value = metrics->value;
+    value[METRIC_UPTIME]             = esp_timer_get_time() / 1000000.0;
+    value[METRIC_BATTERY]            = round_to(device_get_voltage(), 1000);
+    value[METRIC_TEMPERATURE]        = round_to(device_metrics.temperature, 100);
+    value[METRIC_HUMIDITY]           = round_to(device_metrics.humidity, 100);
+    value[METRIC_HEAP_FREE]          = esp_get_free_heap_size();
+    value[METRIC_HEAP_MIN_FREE]      = esp_get_minimum_free_heap_size();
+    value[METRIC_HEAP_LARGEST_BLOCK] = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    value[METRIC_TASK_NUM]           = uxTaskGetNumberOfTasks();
+    value[METRIC_WAKEUP_TIMER]       = device_metrics.wakeup_timer_num;
+    value[METRIC_WAKEUP_BUTTON]      = device_metrics.wakeup_button_num;
+    value[METRIC_SLEEP]              = device_metrics.sleep_ms / 1000.0;
+    value[METRIC_RADIO_ON]           = device_metrics.radio_on_ms / 1000.0;
+    value[METRIC_DNS_QUERY]          = dns_stats->query_num;
+    value[METRIC_DNS_DROP]           = dns_stats->drop_num;
+    value[METRIC_FLASH_WRITE]        = device_metrics.flash_write_num;
+    value[METRIC_FLASH_ERASE]        = device_metrics.flash_erase_num;
+    value[METRIC_CLOCK_DRIFT]        = round_to(time_sync_get_drift_ppm(), 100);
+    value[METRIC_FORECAST_FETCH]     = forecast_stats->fetch_num;
+    value[METRIC_FORECAST_FAIL]      = forecast_stats->fail_num;
+    value[METRIC_FORECAST_NOT_MODIFIED] = forecast_stats->not_modified_num;
+    value[METRIC_FORECAST_RECEIVED]  = forecast_stats->received_total;
+    value[METRIC_FORECAST_BODY]      = forecast_stats->last_body_len;
+    value[METRIC_FORECAST_FETCH_TIME] = forecast_stats->last_fetch_ms / 1000.0;
+    value[METRIC_FORECAST_PARSE_MAX] = forecast_stats->max_parse_us / 1000000.0;
+    value[METRIC_WIFI_CONNECT]       = wifi_stats.connect_num;
+    value[METRIC_WIFI_FAIL]          = wifi_stats.fail_num;
+    value[METRIC_WIFI_CONNECT_TIME]  = wifi_stats.last_connect_ms / 1000.0;
+    value[METRIC_WIFI_CONNECT_MAX]   = wifi_stats.max_connect_ms / 1000.0;
+    value[METRIC_STATE]              = device_get_state() & BIT_MASK;
+    for(int i=0; i<METRIC_STACK_TASK_NUM; ++i){
+        TaskHandle_t task = xTaskGetHandle(stack_task_names[i]);
+        // stack depth is counted in bytes on this port, -1 when the task is not running
+        metrics->stack_free[i] = task ? (long)uxTaskGetStackHighWaterMark(task) : -1;
+    }
+}
+
+int server_metrics_write_text(const server_metrics_t *metrics, char *buf, size_t buf_size,
+                                json_write_cb_t cb, void *ctx)
+{
+    text_writer_t tw = { .buf = buf, .size = buf_size, .cb = cb, .ctx = ctx, .err = ESP_OK };
+    size_t route_num;
+    const server_route_stats_t *route_stats = server_get_route_stats(&route_num);
+    const server_stats_t *server_stats = server_get_stats();
+    unsigned long long total_us = 0;
+    unsigned request_num = 0;
+
+    for(int i=0; i<METRIC_NUM; ++i){
+        put_header(&tw, metric_desc[i].name, metric_desc[i].type, metric_desc[i].help);
+        put_line(&tw, METRIC_PREFIX "%s %.10g\n", metric_desc[i].name, metrics->value[i]);
+    }
+    put_header(&tw, "stack_free_bytes", "gauge", "Task stack high-water mark");
+    for(int i=0; i<METRIC_STACK_TASK_NUM; ++i){
+        if(metrics->stack_free[i] < 0) continue;
+        put_line(&tw, METRIC_PREFIX "stack_free_bytes{task=\"%s\"} %ld\n",
+                    stack_task_names[i], metrics->stack_free[i]);
+    }
+
+    put_header(&tw, "http_requests_total", "counter", "Requests handled by route");
+    for(int i=0; i<route_num; ++i){
+        if(route_stats[i].request_num == 0) continue;
+        put_line(&tw, METRIC_PREFIX "http_requests_total{path=\"%s\"} %u\n",
+                    route_stats[i].path, route_stats[i].request_num);
+        total_us += route_stats[i].total_us;
+    }
+    put_header(&tw, "http_errors_total", "counter", "Requests failed by route");
+    for(int i=0; i<route_num; ++i){
+        if(route_stats[i].request_num == 0) continue;
+        put_line(&tw, METRIC_PREFIX "http_errors_total{path=\"%s\"} %u\n",
+                    route_stats[i].path, route_stats[i].error_num);
+    }
+    put_header(&tw, "http_max_seconds", "gauge", "Slowest request by route");
+    for(int i=0; i<route_num; ++i){
+        if(route_stats[i].request_num == 0) continue;
+        put_line(&tw, METRIC_PREFIX "http_max_seconds{path=\"%s\"} %.6f\n",
+                    route_stats[i].path, route_stats[i].max_us / 1000000.0);
+    }
+    put_header(&tw, "http_unmatched_total", "counter", "Requests to unknown paths");
+    put_line(&tw, METRIC_PREFIX "http_unmatched_total %u\n", server_stats->unmatched_num);
+    put_header(&tw, "http_rejected_total", "counter", "Requests over the route body limit");
+    put_line(&tw, METRIC_PREFIX "http_rejected_total %u\n", server_stats->rejected_num);
+
+    // histogram buckets are cumulative
+    put_header(&tw, "http_request_seconds", "histogram", "Handler latency");
+    for(int i=0; i<SERVER_LATENCY_BUCKET_NUM; ++i){
+        request_num += server_stats->latency_bucket[i];
+        if(i < SERVER_LATENCY_BUCKET_NUM-1){
+            put_line(&tw, METRIC_PREFIX "http_request_seconds_bucket{le=\"%g\"} %u\n",
+                        server_stats->latency_le_us[i] / 1000000.0, request_num);
+        } else {
+            put_line(&tw, METRIC_PREFIX "http_request_seconds_bucket{le=\"+Inf\"} %u\n", request_num);
+        }
+    }
+    put_line(&tw, METRIC_PREFIX "http_request_seconds_sum %.6f\n", total_us / 1000000.0);
+    put_line(&tw, METRIC_PREFIX "http_request_seconds_count %u\n", request_num);
+    flush_text(&tw);
+    return tw.err;
+}
+
+void server_metrics_write_json(const server_metrics_t *metrics, json_writer_t *jw)
+{
+    for(int i=0; i<METRIC_NUM; ++i){
+        json_write_float(jw, metric_desc[i].name, metrics->value[i]);
+    }
+    for(int i=0; i<METRIC_STACK_TASK_NUM; ++i){
+        if(metrics->stack_free[i] < 0) continue;
+        json_write_num(jw, stack_task_names[i], metrics->stack_free[i]);
+    }
+}
+
+
+// a line that does not fit goes after a flush, lines never exceed the buffer
+static void put_line(text_writer_t *tw, const char *format, ...)
+{
+    va_list args;
+    for(int attempt=0; attempt<2 && tw->err == ESP_OK; ++attempt){
+        va_start(args, format);
+        const int res = vsnprintf(tw->buf + tw->len, tw->size - tw->len, format, args);
+        va_end(args);
+        if(res < 0){
+            tw->err = ESP_FAIL;
+        } else if(res < tw->size - tw->len){
+            tw->len += res;
+            return;
+        } else if(tw->len == 0){
+            tw->err = ESP_ERR_INVALID_SIZE;
+        } else {
+            flush_text(tw);
+        }
+    }
+}
+
+static void put_header(text_writer_t *tw, const char *name, const char *type, const char *help)
+{
+    put_line(tw, "# HELP " METRIC_PREFIX "%s %s\n# TYPE " METRIC_PREFIX "%s %s\n", name, help, name, type);
+}
+
+static void flush_text(text_writer_t *tw)
+{
+    if(tw->len && tw->err == ESP_OK){
+        tw->err = tw->cb(tw->ctx, tw->buf, tw->len);
+    }
+    tw->len = 0;
+}
+
+// float sensor values would print their binary noise
+static double round_to(float value, int scale)
+{
+    return lroundf(value * scale) / (double)scale;
+}
@@ -2,11 +2,18 @@
 
 #include <sys/stat.h>
 // #include <dirent.h>
-#include "cJSON.h"
+#include "json_stream.h"
+#include "ota_session.h"
+#include "server_metrics.h"
 #include "stdbool.h"
+#include "stdlib.h"
+#include "stddef.h"
+#include "stdint.h"
+#include "limits.h"
 
 #include "esp_http_server.h"
 #include "esp_chip_info.h"
+#include "esp_system.h"
 #include "string.h"
 #include "portmacro.h"
 #include "clock_module.h"
@@ -15,13 +22,16 @@
 #include "device_macro.h"
 #include "wifi_service.h"
 #include "device_common.h"
+#include "weather_provider.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
-#include "esp_ota_ops.h"
-#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_timer.h"
 
 static httpd_handle_t server;
+static char *server_buf;
+static int64_t last_activity_us;
 
 static const char *MES_DATA_NOT_READ = "Data not read";
 static const char *MES_DATA_TOO_LONG = "Data too long";
@@ -29,178 +39,269 @@ static const char *MES_NO_MEMORY = "No memory";
 static const char *MES_BAD_DATA_FOMAT = "wrong data format";
 static const char *MES_SUCCESSFUL = "Successful";
 
-#define MAX_OTA_SIZE 0x180000 
+#define ARENA_WAIT_MS 1000
+#define NUM_BODY_LEN 24
+#define BODY_CHUNK_LEN 128
+#define RECV_RETRY_NUM 3
+#define PORTAL_URL "http://192.168.4.1/"
+#define ETAG_LEN 11
+#define ASSET_MATCH_LEN 64
+#define LIVE_RETRY_MS "2000"
+#define NOTIF_DIGIT_NUM 3
+#define ROUTE_SLOT_NUM 64
+#define ROUTE_SEED_TRIES 256
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+// notification digits fill at most the staging buffer, the other fields are short
+#define CONFIG_BODY_LEN (NET_BUF_LEN + 1024)
+#define NO_BODY 0
+#define ANY_BODY SIZE_MAX
+
+typedef struct {
+    const char *type;
+    const unsigned char *start;
+    const unsigned char *end;
+    char etag[ETAG_LEN];
+} static_asset_t;
+
+typedef struct {
+    const char *path;
+    httpd_method_t method;
+    esp_err_t (*handler)(httpd_req_t *req);
+    void *ctx;
+    size_t max_body;
+} route_t;
+
+enum ConfigField{
+    CONF_SSID       = (1<<0),
+    CONF_PWD        = (1<<1),
+    CONF_CITY       = (1<<2),
+    CONF_KEY        = (1<<3),
+    CONF_OFFSET     = (1<<4),
+    CONF_LOUD       = (1<<5),
+    CONF_STATUS     = (1<<6),
+    CONF_SCHEMA     = (1<<7),
+    CONF_NOTIF      = (1<<8),
+};
+
+// settings collected from a request body before they are applied
+typedef struct {
+    unsigned fields;
+    char ssid[MAX_STR_LEN+1];
+    char pwd[MAX_STR_LEN+1];
+    char city[MAX_STR_LEN+1];
+    char key[API_LEN+1];
+    char schema[WEEK_DAYS_NUM*2+1];
+    int offset;
+    int loud;
+    int flags;
+    uint16_t *notif;
+    size_t notif_num;
+    size_t notif_max;
+    unsigned digit_val;
+    unsigned digit_num;
+} config_patch_t;
+
+typedef struct {
+    const char *key;
+    unsigned field;
+    size_t offset;
+    size_t max_len;
+} config_str_field_t;
+
+typedef struct {
+    const char *key;
+    unsigned field;
+    size_t offset;
+    int min;
+    int max;
+} config_num_field_t;
+
+
+static int send_body_err(httpd_req_t *req, int err);
+static int read_body_str(httpd_req_t *req, char *buf, size_t buf_size);
+static int recv_part(httpd_req_t *req, char *buf, size_t len);
+static int read_body_num(httpd_req_t *req, long long *num, long long min, long long max);
+static int get_hex_digit(char c);
+static esp_err_t dispatch_handler(httpd_req_t *req);
+static void record_request(size_t route_index, unsigned elapsed_us, esp_err_t err);
+static int init_route_slots();
+static void mark_activity();
 
 
-#define CHECK_AND_RESP(a, req, goto_tag)                                                 \
-        do{     \
-        int r = (a);                                                                            \
-        if (ESP_OK != (r)) {                                                                \
-            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, esp_err_to_name(r));  \
-            goto goto_tag;                                                                  \
-        }                                                                                   \
-    } while(0)
+void server_stop()
+{
+    device_set_state(BIT_SERVER_STOP);
+}
 
-#define SEND_REQ_ERR(_req_, _str_, _fail_) \
-    do{ httpd_resp_send_err((_req_), HTTPD_400_BAD_REQUEST, (_str_)); goto _fail_;}while(0)
+static int ota_read(void *ctx, char *buf, size_t len)
+{
+    return recv_part((httpd_req_t *)ctx, buf, len);
+}
 
-#define SEND_SERVER_ERR(_req_, _str_, _fail_) \
-    do{ httpd_resp_send_err((_req_), HTTPD_500_INTERNAL_SERVER_ERROR, (_str_)); goto _fail_;}while(0)
+static esp_err_t send_ota_state(httpd_req_t *req, const char *status, const char *message)
+{
+    char offset_str[12];
+    snprintf(offset_str, sizeof(offset_str), "%u", (unsigned)ota_session_get_written());
+    httpd_resp_set_status(req, status);
+    httpd_resp_set_hdr(req, "X-OTA-Offset", offset_str);
+    httpd_resp_sendstr(req, message);
+    return ESP_OK;
+}
 
-void server_stop()
+static bool get_hdr_hex(httpd_req_t *req, const char *field, unsigned char *out, size_t out_len)
+{
+    char hex[OTA_DIGEST_LEN*2+1];
+    if(httpd_req_get_hdr_value_str(req, field, hex, sizeof(hex)) != ESP_OK
+            || strlen(hex) != out_len*2){
+        return false;
+    }
+    for(int i=0; i<out_len; ++i){
+        const int hi = get_hex_digit(hex[i*2]), lo = get_hex_digit(hex[i*2+1]);
+        if(hi < 0 || lo < 0) return false;
+        out[i] = hi<<4 | lo;
+    }
+    return true;
+}
+
+static size_t get_hdr_num(httpd_req_t *req, const char *field, size_t default_val)
 {
-    deinit_dns_server();
-    device_clear_state(BIT_SERVER_RUN);
+    char num_buf[NUM_BODY_LEN];
+    if(httpd_req_get_hdr_value_str(req, field, num_buf, sizeof(num_buf)) != ESP_OK){
+        return default_val;
+    }
+    return strtoul(num_buf, NULL, 10);
 }
 
-static 
-esp_err_t handler_update_esp(httpd_req_t *req)
+// the image may come in several requests: X-OTA-Offset tells where the body belongs,
+// X-OTA-Size the whole image size, X-OTA-SHA256 (optional, first request) its digest;
+// an empty body only asks where to continue
+static esp_err_t handler_update_esp(httpd_req_t *req)
 {
-    const esp_partition_t *update_partition = NULL;
-    ESP_LOGI("OTA", "Content-Length: %d", req->content_len);
-    esp_ota_handle_t update_handle = 0;
-    const int total_len = req->content_len;
-    char * const server_buf = (char *)req->user_ctx;
-    int cur_len = 0;
-    int received = 0;
-    update_partition = esp_ota_get_next_update_partition(NULL);
-    if (!update_partition) {
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No OTA partition found");
+    unsigned char digest[OTA_DIGEST_LEN];
+    const size_t offset = get_hdr_num(req, "X-OTA-Offset", 0);
+    const size_t total = get_hdr_num(req, "X-OTA-Size", offset + req->content_len);
+    int err;
+    ESP_LOGI("OTA", "Content-Length: %u, offset %u of %u", req->content_len, offset, total);
+    if(req->content_len == 0){
+        return send_ota_state(req, "202 Accepted", "Send from offset");
+    }
+    if(offset == 0){
+        const bool has_digest = get_hdr_hex(req, "X-OTA-SHA256", digest, OTA_DIGEST_LEN);
+        err = ota_session_begin(total, has_digest ? digest : NULL);
+        if(err == ESP_ERR_INVALID_SIZE){
+            return send_body_err(req, err);
+        } else if(err != ESP_OK){
+            httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "No OTA partition found");
+            return ESP_FAIL;
+        }
+    } else if(!ota_session_is_active() 
+                || offset != ota_session_get_written()
+                || total != ota_session_get_total()){
+        return send_ota_state(req, "409 Conflict", "Wrong offset");
+    }
+    err = ota_session_write(ota_read, req, req->content_len);
+    if(err == ESP_ERR_TIMEOUT){
+        // the session is kept, the client resumes from X-OTA-Offset
+        return send_ota_state(req, "408 Request Timeout", MES_DATA_NOT_READ);
+    } else if(err != ESP_OK){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Fail update");
         return ESP_FAIL;
     }
-    if (total_len > update_partition->size) {
-        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "content too long");
+    if(ota_session_get_written() < total){
+        return send_ota_state(req, "202 Accepted", "Part received");
+    }
+    err = ota_session_finish();
+    if(err == ESP_ERR_INVALID_CRC){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "SHA-256 mismatch");
+        return ESP_FAIL;
+    } else if(err != ESP_OK){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Fail update");
         return ESP_FAIL;
-    };
-    CHECK_AND_RESP(esp_ota_begin(update_partition, OTA_SIZE_UNKNOWN, &update_handle), req, err_1);
-    while (cur_len < total_len) {
-        received = httpd_req_recv(req, server_buf, NET_BUF_LEN-1);
-        if(received <= 0 ){
-            httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST,"Failed to post control value");
-            goto err_2;
-        }
-        cur_len += received;
-        CHECK_AND_RESP(esp_ota_write(update_handle, server_buf, received), req, err_2);
     }
-    CHECK_AND_RESP(esp_ota_end(update_handle), req, err_2);
-    CHECK_AND_RESP(esp_ota_set_boot_partition(update_partition), req, err_2);
     httpd_resp_sendstr(req, MES_SUCCESSFUL);
     vTaskDelay(100);
     esp_restart();
     return ESP_OK;
-err_2:
-    esp_ota_abort(update_handle);
-err_1:
-    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Fail update");
-    return ESP_FAIL;
 }
 
-
-static esp_err_t get_index_handler(httpd_req_t *req)
+static int get_hex_digit(char c)
 {
-    extern const unsigned char index_html_start[] asm( "_binary_index_html_start" );
-    extern const unsigned char index_html_end[] asm( "_binary_index_html_end" );
-    httpd_resp_set_type(req, "text/html");
-    httpd_resp_send(req, (const char *)index_html_start, index_html_end - index_html_start); 
-    return ESP_OK;
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
 }
 
-static esp_err_t get_css_handler(httpd_req_t *req)
+int server_get_ota_progress()
 {
-    extern const unsigned char style_css_start[] asm( "_binary_style_css_start" );
-    extern const unsigned char style_css_end[] asm( "_binary_style_css_end" );
-    httpd_resp_set_type(req, "text/css");
-    httpd_resp_send(req, (const char *)style_css_start, style_css_end - style_css_start ); 
-    return ESP_OK;
+    return ota_session_get_progress();
 }
 
-static esp_err_t get_js_handler(httpd_req_t *req)
+
+// compressed at build time, see gzip_asset.py
+extern const unsigned char index_html_gz_start[] asm( "_binary_index_html_gz_start" );
+extern const unsigned char index_html_gz_end[] asm( "_binary_index_html_gz_end" );
+extern const unsigned char style_css_gz_start[] asm( "_binary_style_css_gz_start" );
+extern const unsigned char style_css_gz_end[] asm( "_binary_style_css_gz_end" );
+extern const unsigned char script_js_gz_start[] asm( "_binary_script_js_gz_start" );
+extern const unsigned char script_js_gz_end[] asm( "_binary_script_js_gz_end" );
+
+static static_asset_t static_assets[] = {
+    { "text/html",        index_html_gz_start,    index_html_gz_end },
+    { "text/css",         style_css_gz_start,     style_css_gz_end },
+    { "text/javascript",  script_js_gz_start,     script_js_gz_end },
+};
+
+static void init_asset_etags()
 {
-    extern const unsigned char script_js_start[] asm( "_binary_script_js_start" );
-    extern const unsigned char script_js_end[] asm( "_binary_script_js_end" );
-    httpd_resp_set_type(req, "text/javascript");
-    httpd_resp_send(req, (const char *)script_js_start, script_js_end - script_js_start ); 
-    return ESP_OK;
+    for(int i=0; i<sizeof(static_assets)/sizeof(static_assets[0]); ++i){
+        static_asset_t *asset = &static_assets[i];
+        if(asset->etag[0]) continue;
+        const uint32_t crc = esp_rom_crc32_le(0, asset->start, asset->end - asset->start);
+        snprintf(asset->etag, sizeof(asset->etag), "\"%08lx\"", (unsigned long)crc);
+    }
 }
 
-
-static esp_err_t handler_close(httpd_req_t *req)
+static esp_err_t get_static_handler(httpd_req_t *req)
 {
-    httpd_resp_sendstr(req, "Goodbay!");
-    vTaskDelay(500/portTICK_PERIOD_MS);
-    device_clear_state(BIT_SERVER_RUN);
+    const static_asset_t *asset = (const static_asset_t *)req->user_ctx;
+    char if_none_match[ASSET_MATCH_LEN];
+    httpd_resp_set_hdr(req, "Cache-Control", "no-cache");
+    httpd_resp_set_hdr(req, "ETag", asset->etag);
+    if(httpd_req_get_hdr_value_str(req, "If-None-Match", 
+                        if_none_match, ASSET_MATCH_LEN) == ESP_OK
+            && strstr(if_none_match, asset->etag)){
+        httpd_resp_set_status(req, "304 Not Modified");
+        httpd_resp_send(req, NULL, 0);
+        return ESP_OK;
+    }
+    httpd_resp_set_type(req, asset->type);
+    httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+    httpd_resp_send(req, (const char *)asset->start, asset->end - asset->start);
     return ESP_OK;
 }
 
-
-static esp_err_t handler_set_network(httpd_req_t *req)
+// captive portal probes and unknown pages are sent to the setting page
+static esp_err_t redirect_handler(httpd_req_t *req)
 {
-    cJSON *root, *ssid_name_j, *pwd_wifi_j;
-    int received;
-    const size_t total_len = req->content_len;
-    char * server_buf = (char *)req->user_ctx;
-    if(total_len >= NET_BUF_LEN){
-        SEND_REQ_ERR(req, MES_DATA_TOO_LONG, fail_1);
-    }
-    received = httpd_req_recv(req, server_buf, total_len);
-    if (received != total_len) {
-        SEND_SERVER_ERR(req, MES_DATA_NOT_READ, fail_1);
-    }
-    server_buf[received] = 0;
-    root = cJSON_Parse(server_buf);
-    if(!root){
-        SEND_SERVER_ERR(req, MES_NO_MEMORY, fail_1);
-    }
-    ssid_name_j = cJSON_GetObjectItemCaseSensitive(root, "SSID");
-    pwd_wifi_j = cJSON_GetObjectItemCaseSensitive(root, "PWD");  
-    if(cJSON_IsString(ssid_name_j) && (ssid_name_j->valuestring != NULL)){
-        device_set_ssid(ssid_name_j->valuestring);
-    }
-    if(cJSON_IsString(pwd_wifi_j) && (pwd_wifi_j->valuestring != NULL)){
-        device_set_pwd(pwd_wifi_j->valuestring);
-    }
-    cJSON_Delete(root);
-    httpd_resp_sendstr(req, MES_SUCCESSFUL);
+    httpd_resp_set_status(req, "302 Found");
+    httpd_resp_set_hdr(req, "Location", PORTAL_URL);
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    httpd_resp_send(req, NULL, 0);
     return ESP_OK;
-
-fail_1:
-    return ESP_FAIL;
 }
 
-static esp_err_t handler_set_openweather_data(httpd_req_t *req)
+
+static esp_err_t handler_close(httpd_req_t *req)
 {
-    cJSON *root, *city_j, *key_j;
-    int received;
-    const int total_len = req->content_len;
-    char * server_buf = (char *)req->user_ctx;
-    if(total_len >= NET_BUF_LEN){
-        SEND_REQ_ERR(req, MES_DATA_TOO_LONG, fail_1);
-    }
-    received = httpd_req_recv(req, server_buf, total_len);
-    if (received != total_len) {
-        SEND_SERVER_ERR(req, MES_DATA_NOT_READ, fail_1);
-    }
-    server_buf[received] = 0;
-    root = cJSON_Parse(server_buf);
-    if(!root){
-        SEND_SERVER_ERR(req, MES_NO_MEMORY, fail_1);
-    }
-    city_j = cJSON_GetObjectItemCaseSensitive(root, "City");
-    key_j = cJSON_GetObjectItemCaseSensitive(root, "Key");
-    if(cJSON_IsString(city_j) && (city_j->valuestring != NULL)){
-        device_set_city(city_j->valuestring);
-    }
-    if(cJSON_IsString(key_j) && (key_j->valuestring != NULL)){
-        device_set_key(key_j->valuestring);
-    }
-    cJSON_Delete(root);
-    httpd_resp_sendstr(req, MES_SUCCESSFUL);
+    // the reply is already in the socket, httpd_stop() closes it gracefully
+    httpd_resp_sendstr(req, "Goodbay!");
+    device_set_state(BIT_SERVER_STOP);
     return ESP_OK;
-
-fail_1:
-    return ESP_FAIL;
 }
 
+
 const char *get_chip(int model_id)
 {
     switch(model_id){
@@ -230,360 +331,537 @@ static esp_err_t handler_get_info(httpd_req_t *req)
 
 static esp_err_t handler_set_time(httpd_req_t *req)
 {
-    long long time_sec;
-    int received;
-    const int total_len = req->content_len;
-    char * server_buf = (char *)req->user_ctx;
-    if(total_len >= NET_BUF_LEN){
-        SEND_REQ_ERR(req, MES_DATA_TOO_LONG, fail);
+    long long time_ms;
+    const int err = read_body_num(req, &time_ms, 0, LLONG_MAX);
+    if(err != ESP_OK){
+        return send_body_err(req, err);
     }
-    received = httpd_req_recv(req, server_buf, total_len);
-    if (received != total_len){
-        SEND_REQ_ERR(req, MES_DATA_NOT_READ, fail);
-    }
-    server_buf[total_len] = 0;
-    time_sec = (atoll(server_buf) / 1000) + device_get_offset() * 3600;
-    set_time_sec(time_sec);
+    set_time_sec(time_ms / 1000 + device_get_offset() * 3600);
     httpd_resp_sendstr(req, MES_SUCCESSFUL);
     return ESP_OK;
-fail:
-    return ESP_FAIL;
 }
 
 
 
 
+static int send_chunk(void *ctx, const char *data, size_t len)
+{
+    return httpd_resp_send_chunk((httpd_req_t *)ctx, data, len);
+}
+
 static esp_err_t handler_give_data(httpd_req_t *req)
 {
-    char *data_to_send;
-    cJSON *root;
-    char *notif_data_str = (char *)req->user_ctx;
-    char schema_data_str[WEEK_DAYS_NUM*2+1];
-    unsigned *schema = device_get_schema();
-    unsigned *notify = device_get_notif();
-    size_t notif_data_str_size = get_notif_size(schema);
-    if(notif_data_str_size < NET_BUF_LEN){
-        num_arr_to_str(notif_data_str,  notify, 4, notif_data_str_size);
-    } else {
-        notif_data_str_size = 0;
-    }
-    notif_data_str[notif_data_str_size] = 0;
-    num_arr_to_str(schema_data_str, schema, 2, WEEK_DAYS_NUM);
+    json_writer_t jw;
+    char num_buf[5];
+    const unsigned *schema = device_get_schema();
+    const uint16_t *notify = device_get_notif();
+    const unsigned notif_num = get_notif_num((unsigned *)schema);
     httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
 
-    root = cJSON_CreateObject();
-    if(!root){
-        SEND_REQ_ERR(req, MES_NO_MEMORY, fail_1);
-    }
     // input id | value
-    cJSON_AddStringToObject(root, "SSID", device_get_ssid());
-    cJSON_AddStringToObject(root, "PWD", device_get_pwd());
-    cJSON_AddStringToObject(root, "Key", device_get_api_key());
-    cJSON_AddStringToObject(root, "City", device_get_city_name());
-    cJSON_AddNumberToObject(root, "Status", device_get_state());
-    cJSON_AddStringToObject(root, "schema", schema_data_str);
-    cJSON_AddStringToObject(root, "notif", notif_data_str);
-    cJSON_AddNumberToObject(root, "Hour", device_get_offset());
-    cJSON_AddNumberToObject(root, "%", device_get_loud());
-    data_to_send = cJSON_Print(root);
-
-    if(!data_to_send){
-        SEND_REQ_ERR(req, MES_NO_MEMORY, fail_2);
-    }
-    httpd_resp_sendstr(req, data_to_send);
-    free(data_to_send);
-    data_to_send = NULL;
-    cJSON_Delete(root);
-
-    return ESP_OK;
-
-fail_2:
-    cJSON_Delete(root);
+    json_write_begin(&jw, send_chunk, req);
+    json_write_str(&jw, "SSID", device_get_ssid());
+    json_write_str(&jw, "PWD", device_get_pwd());
+    json_write_str(&jw, "Key", device_get_api_key());
+    json_write_str(&jw, "City", device_get_city_name());
+    json_write_num(&jw, "Status", device_get_state());
+    json_write_str_begin(&jw, "schema");
+    for(int i=0; i<WEEK_DAYS_NUM; ++i){
+        json_write_raw(&jw, num_buf, snprintf(num_buf, sizeof(num_buf), "%02u", schema[i]%100));
+    }
+    json_write_str_end(&jw);
+    json_write_str_begin(&jw, "notif");
+    for(int i=0; i<notif_num; ++i){
+        json_write_raw(&jw, num_buf, snprintf(num_buf, sizeof(num_buf), "%03x", notify[i]%DAY_MIN_NUM));
+    }
+    json_write_str_end(&jw);
+    json_write_num(&jw, "Hour", device_get_offset());
+    json_write_num(&jw, "%", device_get_loud());
+    if(json_write_end(&jw) != ESP_OK){
+        return ESP_FAIL;
+    }
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
 
-fail_1:
+static esp_err_t handler_get_metrics(httpd_req_t *req)
+{
+    char * server_buf = (char *)req->user_ctx;
+    server_metrics_t metrics;
+    server_metrics_collect(&metrics);
+    httpd_resp_set_type(req, "text/plain; version=0.0.4");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    CHECK_AND_RET_ERR(server_metrics_write_text(&metrics, server_buf, NET_BUF_LEN, send_chunk, req));
+    return httpd_resp_send_chunk(req, NULL, 0);
+}
 
-    return ESP_FAIL;
+// one server-sent event per request, the browser reconnects after the retry delay,
+// holding the stream open would block the only httpd task
+static esp_err_t handler_live(httpd_req_t *req)
+{
+    json_writer_t jw;
+    server_metrics_t metrics;
+    server_metrics_collect(&metrics);
+    httpd_resp_set_type(req, "text/event-stream");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    CHECK_AND_RET_ERR(httpd_resp_send_chunk(req, "retry: " LIVE_RETRY_MS "\ndata: ", HTTPD_RESP_USE_STRLEN));
+    json_write_begin(&jw, send_chunk, req);
+    server_metrics_write_json(&metrics, &jw);
+    CHECK_AND_RET_ERR(json_write_end(&jw));
+    CHECK_AND_RET_ERR(httpd_resp_send_chunk(req, "\n\n", 2));
+    return httpd_resp_send_chunk(req, NULL, 0);
 }
 
 	
 
 static esp_err_t handler_set_flag(httpd_req_t *req)
 {
-    unsigned flags;
-    int received,
-        total_len = req->content_len;
-    char * server_buf = (char *)req->user_ctx;
-    if(total_len >= NET_BUF_LEN){
-        SEND_REQ_ERR(req, "Content too long", fail);
-    }
-    received = httpd_req_recv(req, server_buf, total_len);
-    if (received != total_len) {
-        SEND_REQ_ERR(req, "Data not read", fail);
+    long long flags;
+    const int err = read_body_num(req, &flags, 0, BIT_MASK);
+    if(err != ESP_OK){
+        return send_body_err(req, err);
     }
-    server_buf[total_len] = 0;
-    flags = atol(server_buf) & STORED_FLAGS;
-    device_set_state(flags);
+    device_set_state(flags & STORED_FLAGS);
     httpd_resp_sendstr(req, "Set flags successfully");
     return ESP_OK;
-fail:
-    return ESP_FAIL;
 }
 
 
 static esp_err_t set_offset_handler(httpd_req_t *req)
 {
-    int received;
-    const int total_len = req->content_len;
-    char * server_buf = (char *)req->user_ctx;
-    if(total_len >= NET_BUF_LEN){
-        SEND_REQ_ERR(req, MES_DATA_TOO_LONG, fail_1);
-    }
-    received = httpd_req_recv(req, server_buf, total_len);
-    if (received != total_len) {
-        SEND_SERVER_ERR(req, MES_DATA_NOT_READ, fail_1);
+    long long offset;
+    const int err = read_body_num(req, &offset, -23, 23);
+    if(err != ESP_OK){
+        return send_body_err(req, err);
     }
-    server_buf[received] = 0;
+    device_set_offset(offset);
     httpd_resp_sendstr(req, MES_SUCCESSFUL);
-    int offset = atoi(server_buf);
-    if(offset > 23 || offset < -23){
-        SEND_REQ_ERR(req, MES_BAD_DATA_FOMAT, fail_1);
+    return ESP_OK;
+}
+
+static esp_err_t set_loud_handler(httpd_req_t *req)
+{
+    long long loud;
+    const int err = read_body_num(req, &loud, 0, 99);
+    if(err != ESP_OK){
+        return send_body_err(req, err);
     }
-    device_set_offset(offset);
+    device_set_loud(loud);
+    httpd_resp_sendstr(req, MES_SUCCESSFUL);
     return ESP_OK;
-    
-fail_1:
+}
+
+
+static int send_body_err(httpd_req_t *req, int err)
+{
+    if(err == ESP_ERR_TIMEOUT){
+        httpd_resp_send_err(req, HTTPD_408_REQ_TIMEOUT, MES_DATA_NOT_READ);
+    } else if(err == ESP_ERR_INVALID_SIZE){
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, MES_DATA_TOO_LONG);
+    } else if(err == ESP_ERR_NO_MEM){
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, MES_NO_MEMORY);
+    } else {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, MES_BAD_DATA_FOMAT);
+    }
     return ESP_FAIL;
 }
 
-static esp_err_t set_loud_handler(httpd_req_t *req)
+static int recv_part(httpd_req_t *req, char *buf, size_t len)
 {
-    unsigned loud = 0;
     int received;
-    const int total_len = req->content_len;
-    char * server_buf = (char *)req->user_ctx;
-    if(total_len >= NET_BUF_LEN){
-        SEND_REQ_ERR(req, MES_DATA_TOO_LONG, fail_1);
+    mark_activity();
+    for(int retry=0; retry<RECV_RETRY_NUM; ++retry){
+        received = httpd_req_recv(req, buf, len);
+        if(received != HTTPD_SOCK_ERR_TIMEOUT) break;
     }
-    received = httpd_req_recv(req, server_buf, total_len);
-    if (received != total_len) {
-        SEND_SERVER_ERR(req, MES_DATA_NOT_READ, fail_1);
+    return received;
+}
+
+// short plain bodies (numbers), read across as many segments as they come in
+static int read_body_str(httpd_req_t *req, char *buf, size_t buf_size)
+{
+    size_t len = 0;
+    if(req->content_len >= buf_size){
+        return ESP_ERR_INVALID_SIZE;
     }
-    server_buf[received] = 0;
-    httpd_resp_sendstr(req, MES_SUCCESSFUL);
-    loud = atol(server_buf);
-    if(loud > 99){
-        SEND_REQ_ERR(req, MES_BAD_DATA_FOMAT, fail_1);
+    while(len < req->content_len){
+        const int received = recv_part(req, buf + len, req->content_len - len);
+        if(received <= 0) return ESP_ERR_TIMEOUT;
+        len += received;
     }
-    device_set_loud(loud);
+    buf[len] = 0;
     return ESP_OK;
-    
-fail_1:
-    return ESP_FAIL;
 }
 
-static esp_err_t set_notif_handler(httpd_req_t *req)
+// the number bodies of the single value forms
+static int read_body_num(httpd_req_t *req, long long *num, long long min, long long max)
 {
-    unsigned schema_data[WEEK_DAYS_NUM],
-        *notif_data, *ptr;
-    size_t notif_size, schema_size;
-    cJSON *root, *notif_data_j, *notif_schema_j;
-    char *notif_str, *schema_str;
-    int received, notification_num;
-    const int total_len = req->content_len;
-    char * server_buf = (char *)req->user_ctx;
-    if(total_len >= NET_BUF_LEN){
-        SEND_REQ_ERR(req, MES_DATA_TOO_LONG, fail_1);
-    }
-    received = httpd_req_recv(req, server_buf, total_len);
-    if (received != total_len) {
-        SEND_SERVER_ERR(req, MES_DATA_NOT_READ, fail_1);
+    char num_buf[NUM_BODY_LEN], *num_end;
+    CHECK_AND_RET_ERR(read_body_str(req, num_buf, sizeof(num_buf)));
+    *num = strtoll(num_buf, &num_end, 10);
+    if(num_end == num_buf || *num_end || *num < min || *num > max){
+        return ESP_ERR_INVALID_ARG;
     }
-    server_buf[received] = 0;
-    root = cJSON_Parse(server_buf);
-    if(!root){
-        SEND_REQ_ERR(req, MES_NO_MEMORY, fail_1);
+    return ESP_OK;
+}
+
+// feeds the body to the parser piece by piece, nothing is buffered whole
+static int read_json_body(httpd_req_t *req, json_stream_t *js)
+{
+    char chunk[BODY_CHUNK_LEN];
+    size_t remaining = req->content_len;
+    while(remaining > 0){
+        const int received = recv_part(req, chunk, MIN(remaining, sizeof(chunk)));
+        if(received <= 0) return ESP_ERR_TIMEOUT;
+        remaining -= received;
+        CHECK_AND_RET_ERR(json_stream_feed(js, chunk, received));
+    }
+    return json_stream_done(js) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+static const config_str_field_t config_str_fields[] = {
+    { "SSID",   CONF_SSID,      offsetof(config_patch_t, ssid),     MAX_STR_LEN },
+    { "PWD",    CONF_PWD,       offsetof(config_patch_t, pwd),      MAX_STR_LEN },
+    { "City",   CONF_CITY,      offsetof(config_patch_t, city),     MAX_STR_LEN },
+    { "Key",    CONF_KEY,       offsetof(config_patch_t, key),      API_LEN },
+    { "schema", CONF_SCHEMA,    offsetof(config_patch_t, schema),   WEEK_DAYS_NUM*2 },
+};
+
+static const config_num_field_t config_num_fields[] = {
+    { "Hour",   CONF_OFFSET,    offsetof(config_patch_t, offset),   -23,    23 },
+    { "%",      CONF_LOUD,      offsetof(config_patch_t, loud),     0,      99 },
+    { "Status", CONF_STATUS,    offsetof(config_patch_t, flags),    0,      BIT_MASK },
+};
+
+// notification times are three hex digits (minute of the day) each and may come split over pieces
+static int put_notif_digits(config_patch_t *patch, const char *value, size_t len)
+{
+    for(const char *end = value + len; value < end; ++value){
+        const int digit = get_hex_digit(*value);
+        if(digit < 0) return ESP_ERR_INVALID_ARG;
+        patch->digit_val = patch->digit_val*16 + digit;
+        if(++patch->digit_num < NOTIF_DIGIT_NUM) continue;
+        if(patch->digit_val >= DAY_MIN_NUM) return ESP_ERR_INVALID_ARG;
+        if(patch->notif_num == patch->notif_max) return ESP_ERR_INVALID_SIZE;
+        patch->notif[patch->notif_num++] = patch->digit_val;
+        patch->digit_val = patch->digit_num = 0;
     }
+    return ESP_OK;
+}
 
-    notif_data_j = cJSON_GetObjectItemCaseSensitive(root, "notif");
-    notif_schema_j = cJSON_GetObjectItemCaseSensitive(root, "schema");
+static int config_field_cb(void *ctx, const char *key, json_type_t type,
+                                const char *value, size_t len, bool is_last)
+{
+    config_patch_t *patch = (config_patch_t *)ctx;
+    if(strcmp(key, "notif") == 0){
+        if(type != JSON_TYPE_STRING) return ESP_ERR_INVALID_ARG;
+        patch->fields |= CONF_NOTIF;
+        return put_notif_digits(patch, value, len);
+    }
+    for(int i=0; i<sizeof(config_str_fields)/sizeof(config_str_fields[0]); ++i){
+        const config_str_field_t *field = &config_str_fields[i];
+        if(strcmp(key, field->key) != 0) continue;
+        if(type != JSON_TYPE_STRING || !is_last || len > field->max_len) return ESP_ERR_INVALID_ARG;
+        memcpy((char *)patch + field->offset, value, len+1);
+        patch->fields |= field->field;
+        return ESP_OK;
+    }
+    for(int i=0; i<sizeof(config_num_fields)/sizeof(config_num_fields[0]); ++i){
+        const config_num_field_t *field = &config_num_fields[i];
+        if(strcmp(key, field->key) != 0) continue;
+        char *num_end;
+        const long num = strtol(value, &num_end, 10);
+        if(type != JSON_TYPE_NUMBER || *num_end || num < field->min || num > field->max) return ESP_ERR_INVALID_ARG;
+        *(int *)((char *)patch + field->offset) = num;
+        patch->fields |= field->field;
+        return ESP_OK;
+    }
+    // unknown fields are skipped
+    return ESP_OK;
+}
 
-    if(!cJSON_IsString(notif_data_j) || notif_data_j->valuestring == NULL
-            || !cJSON_IsString(notif_schema_j) || notif_schema_j->valuestring == NULL){
-        SEND_REQ_ERR(req, MES_BAD_DATA_FOMAT, fail_2);
+// every field is optional, nothing is applied unless all present fields are valid
+static int apply_config_patch(config_patch_t *patch, bool commit)
+{
+    unsigned schema_data[WEEK_DAYS_NUM];
+    uint16_t *notif_data = NULL;
+    const bool has_schema = patch->fields&CONF_SCHEMA;
+    if(has_schema != ((patch->fields&CONF_NOTIF) != 0) || patch->digit_num){
+        return ESP_ERR_INVALID_ARG;
+    }
+    // device_set_key() would drop a key of another length without a word
+    if(patch->fields&CONF_KEY && strlen(patch->key) != API_LEN){
+        return ESP_ERR_INVALID_ARG;
+    }
+    // Open-Meteo takes "latitude,longitude" in place of a city name
+    if(patch->fields&CONF_CITY && !weather_provider_check_city(patch->city)){
+        return ESP_ERR_INVALID_ARG;
+    }
+    if(has_schema){
+        if(strlen(patch->schema) != WEEK_DAYS_NUM*2) return ESP_ERR_INVALID_ARG;
+        for(int i=0; i<WEEK_DAYS_NUM; ++i){
+            char *digits = patch->schema + i*2;
+            // get_num() stops at the first non-digit, "1x" would pass as 1
+            if(digits[0] < '0' || digits[0] > '9' || digits[1] < '0' || digits[1] > '9'){
+                return ESP_ERR_INVALID_ARG;
+            }
+            schema_data[i] = get_num(digits, 2);
+        }
+        if(get_notif_num(schema_data) != patch->notif_num) return ESP_ERR_INVALID_ARG;
+        // one slot at least, malloc(0) may give NULL for an empty schedule
+        notif_data = (uint16_t *)malloc((patch->notif_num ? patch->notif_num : 1)*sizeof(uint16_t));
+        if(notif_data == NULL) return ESP_ERR_NO_MEM;
+        // times come grouped by day as the schema counts them
+        for(unsigned day=0, i=0; day<WEEK_DAYS_NUM; ++day){
+            for(unsigned n=0; n<schema_data[day]; ++n, ++i){
+                notif_data[i] = day*DAY_MIN_NUM + patch->notif[i];
+            }
+        }
     }
-    schema_str = notif_schema_j->valuestring;
-    notif_str = notif_data_j->valuestring;
+    if(patch->fields&CONF_SSID) device_set_ssid(patch->ssid);
+    if(patch->fields&CONF_PWD) device_set_pwd(patch->pwd);
+    if(patch->fields&CONF_CITY) device_set_city(patch->city);
+    if(patch->fields&CONF_KEY) device_set_key(patch->key);
+    if(patch->fields&CONF_OFFSET) device_set_offset(patch->offset);
+    if(patch->fields&CONF_LOUD) device_set_loud(patch->loud);
+    if(patch->fields&CONF_STATUS){
+        device_set_state(patch->flags & STORED_FLAGS);
+        device_clear_state(~patch->flags & STORED_FLAGS);
+    }
+    if(has_schema) device_set_notify_data(notif_data, patch->notif_num);
+    return commit ? device_commit_changes() : ESP_OK;
+}
 
-    notif_size = strlen(notif_str);
-    schema_size = strlen(schema_str);
-    if(schema_size != 14 || notif_size%4 != 0 ){
-        SEND_REQ_ERR(req, MES_BAD_DATA_FOMAT, fail_2);
+static esp_err_t handle_config_body(httpd_req_t *req, bool commit)
+{
+    config_patch_t patch = { 0 };
+    json_stream_t js;
+    // notifications are staged in the server buffer until the schema is checked
+    patch.notif = (uint16_t *)req->user_ctx;
+    patch.notif_max = NET_BUF_LEN/sizeof(uint16_t);
+    json_stream_init(&js, config_field_cb, &patch);
+    int err = read_json_body(req, &js);
+    if(err == ESP_OK){
+        err = apply_config_patch(&patch, commit);
+    }
+    if(err != ESP_OK){
+        return send_body_err(req, err);
     }
+    httpd_resp_sendstr(req, MES_SUCCESSFUL);
+    return ESP_OK;
+}
 
-    for(int i=0; i<WEEK_DAYS_NUM; ++i, schema_str += 2){
-        schema_data[i] = get_num(schema_str, 2);
+// single form pages, stored when the server closes
+static esp_err_t handler_set_fields(httpd_req_t *req)
+{
+    return handle_config_body(req, false);
+}
+
+// whole settings form in one request, stored right away
+static esp_err_t handler_set_config(httpd_req_t *req)
+{
+    return handle_config_body(req, true);
+}
+
+
+// looked up by method and path (query stripped), body limits are checked before the handler
+static const route_t routes[] = {
+    { "/Status",        HTTP_POST,  handler_set_flag,       NULL,               NUM_BODY_LEN-1 },
+    { "/info",          HTTP_POST,  handler_get_info,       NULL,               NO_BODY },
+    { "/data",          HTTP_POST,  handler_give_data,      NULL,               NO_BODY },
+    { "/close",         HTTP_POST,  handler_close,          NULL,               NO_BODY },
+    { "/Network",       HTTP_POST,  handler_set_fields,     NULL,               CONFIG_BODY_LEN },
+    { "/Openweather",   HTTP_POST,  handler_set_fields,     NULL,               CONFIG_BODY_LEN },
+    { "/time",          HTTP_POST,  handler_set_time,       NULL,               NUM_BODY_LEN-1 },
+    { "/Notification",  HTTP_POST,  handler_set_fields,     NULL,               CONFIG_BODY_LEN },
+    { "/Offset",        HTTP_POST,  set_offset_handler,     NULL,               NUM_BODY_LEN-1 },
+    { "/config",        HTTP_POST,  handler_set_config,     NULL,               CONFIG_BODY_LEN },
+    { "/Loud",          HTTP_POST,  set_loud_handler,       NULL,               NUM_BODY_LEN-1 },
+    { "/OTA",           HTTP_POST,  handler_update_esp,     NULL,               ANY_BODY },
+    { "/",              HTTP_GET,   get_static_handler,     &static_assets[0],  NO_BODY },
+    { "/style.css",     HTTP_GET,   get_static_handler,     &static_assets[1],  NO_BODY },
+    { "/script.js",     HTTP_GET,   get_static_handler,     &static_assets[2],  NO_BODY },
+    { "/metrics",       HTTP_GET,   handler_get_metrics,    NULL,               NO_BODY },
+    { "/live",          HTTP_GET,   handler_live,           NULL,               NO_BODY },
+};
+
+#define ROUTE_NUM (sizeof(routes)/sizeof(routes[0]))
+
+static server_route_stats_t route_stats[ROUTE_NUM];
+static server_stats_t server_stats = {
+    .latency_le_us = { 1000, 5000, 20000, 100000, 500000, 2000000, 10000000 },
+};
+
+// route index + 1 by hash slot, 0 is an empty slot
+static uint8_t route_slots[ROUTE_SLOT_NUM];
+static uint32_t route_seed;
+
+static uint32_t route_hash(uint32_t seed, int method, const char *path, size_t len)
+{
+    uint32_t hash = (FNV_OFFSET ^ seed) * FNV_PRIME;
+    hash = (hash ^ (uint8_t)method) * FNV_PRIME;
+    for(size_t i=0; i<len; ++i){
+        hash = (hash ^ (uint8_t)path[i]) * FNV_PRIME;
     }
-    notification_num = get_notif_num(schema_data);
-    if(notification_num != notif_size/4){
-        SEND_REQ_ERR(req, MES_BAD_DATA_FOMAT, fail_2);
+    return hash;
+}
+
+// the table is constant, so is the first seed without collisions
+static int init_route_slots()
+{
+    for(uint32_t seed=0; seed<ROUTE_SEED_TRIES; ++seed){
+        bool collision = false;
+        memset(route_slots, 0, sizeof(route_slots));
+        for(size_t i=0; i<ROUTE_NUM && !collision; ++i){
+            const uint32_t slot = route_hash(seed, routes[i].method, routes[i].path, 
+                                        strlen(routes[i].path)) % ROUTE_SLOT_NUM;
+            collision = route_slots[slot] != 0;
+            route_slots[slot] = i + 1;
+        }
+        if(!collision){
+            route_seed = seed;
+            return ESP_OK;
+        }
     }
-    notif_data = ptr = (unsigned *)malloc(notification_num*sizeof(int));
-    if (notif_data == NULL) {
-        SEND_SERVER_ERR(req, MES_DATA_NOT_READ, fail_2);
+    ESP_LOGE("server", "No perfect hash for %u routes", (unsigned)ROUTE_NUM);
+    return ESP_FAIL;
+}
+
+static const route_t *find_route(httpd_req_t *req)
+{
+    const size_t len = strcspn(req->uri, "?");
+    const unsigned index = route_slots[route_hash(route_seed, req->method, req->uri, len) % ROUTE_SLOT_NUM];
+    if(index == 0) return NULL;
+    const route_t *route = &routes[index - 1];
+    if(route->method != req->method 
+            || strncmp(route->path, req->uri, len) != 0 
+            || route->path[len] != 0){
+        return NULL;
+    }
+    return route;
+}
+
+// every request passes here, handlers get their own context or the server buffer
+static esp_err_t dispatch_handler(httpd_req_t *req)
+{
+    const route_t *route = find_route(req);
+    mark_activity();
+    if(route == NULL){
+        server_stats.unmatched_num += 1;
+        if(req->method == HTTP_GET){
+            return redirect_handler(req);
+        }
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, NULL);
+        return ESP_FAIL;
     }
-    for(int i=0; i<notification_num; ++i, notif_str += 4){
-        notif_data[i] = get_num(notif_str, 4);
+    if(req->content_len > route->max_body){
+        server_stats.rejected_num += 1;
+        return send_body_err(req, ESP_ERR_INVALID_SIZE);
     }
-    device_set_notify_data(schema_data, notif_data);
-    cJSON_Delete(root);
-    httpd_resp_sendstr(req, MES_SUCCESSFUL);
-    return ESP_OK;
+    req->user_ctx = route->ctx ? route->ctx : server_buf;
+    const int64_t start_us = esp_timer_get_time();
+    const esp_err_t err = route->handler(req);
+    record_request(route - routes, esp_timer_get_time() - start_us, err);
+    return err;
+}
 
-fail_2:
-    cJSON_Delete(root);
-fail_1:
-    return ESP_FAIL;
+static void record_request(size_t route_index, unsigned elapsed_us, esp_err_t err)
+{
+    server_route_stats_t *stats = &route_stats[route_index];
+    int bucket = 0;
+    stats->path = routes[route_index].path;
+    stats->request_num += 1;
+    stats->total_us += elapsed_us;
+    if(err != ESP_OK) stats->error_num += 1;
+    if(elapsed_us > stats->max_us) stats->max_us = elapsed_us;
+    while(bucket < SERVER_LATENCY_BUCKET_NUM-1 && elapsed_us > server_stats.latency_le_us[bucket]){
+        ++bucket;
+    }
+    server_stats.latency_bucket[bucket] += 1;
 }
 
+const server_stats_t *server_get_stats()
+{
+    return &server_stats;
+}
 
+// routes never requested have no path yet
+const server_route_stats_t *server_get_route_stats(size_t *route_num)
+{
+    *route_num = ROUTE_NUM;
+    return route_stats;
+}
 
+// the dispatcher does the routing, httpd only separates the methods
+static bool match_any_uri(const char *reference_uri, const char *uri_to_match, size_t match_upto)
+{
+    return true;
+}
+
+static void mark_activity()
+{
+    last_activity_us = esp_timer_get_time();
+}
+
+unsigned server_get_idle_ms()
+{
+    return (esp_timer_get_time() - last_activity_us) / 1000;
+}
 
 
 int deinit_server()
 {
     esp_err_t err = ESP_FAIL;
     if(server != NULL){
+        deinit_dns_server();
+        // returns once the server task is gone, nothing to wait for
         err = httpd_stop(server);
-        vTaskDelay(1000/portTICK_PERIOD_MS);
         server = NULL;
+        ota_session_deinit();
+        net_arena_release(NET_OWNER_SERVER);
     }
     return err;
 }
 
 
-int init_server(char *server_buf)
+int init_server()
 {
     if(server != NULL) return ESP_FAIL;
     httpd_config_t config = HTTPD_DEFAULT_CONFIG();
-    config.max_uri_handlers = 14;
-    config.uri_match_fn = httpd_uri_match_wildcard;
-
+    config.max_uri_handlers = 2;
+    config.uri_match_fn = match_any_uri;
+    CHECK_AND_RET_ERR(init_route_slots());
+
+    // handlers share one body buffer, it stays ours until deinit_server()
+    if(net_arena_acquire(NET_OWNER_SERVER, ARENA_WAIT_MS) == NULL){
+        return ESP_ERR_NO_MEM;
+    }
+    server_buf = (char *)net_arena_alloc(NET_OWNER_SERVER, NET_BUF_LEN);
+    // OTA flashes one buffer while the next one is received into the other
+    char *ota_buf = (char *)net_arena_alloc(NET_OWNER_SERVER, NET_BUF_LEN);
+    if(server_buf == NULL || ota_buf == NULL 
+            || ota_session_init(server_buf, ota_buf, NET_BUF_LEN) != ESP_OK){
+        net_arena_release(NET_OWNER_SERVER);
+        return ESP_ERR_NO_MEM;
+    }
     if(httpd_start(&server, &config) != ESP_OK){
+        server = NULL;
+        ota_session_deinit();
+        net_arena_release(NET_OWNER_SERVER);
         return ESP_FAIL;
     }
+    mark_activity();
     
-    httpd_uri_t set_flags = {
-        .uri      = "/Status",
-        .method   = HTTP_POST,
-        .handler  = handler_set_flag,
-        .user_ctx = server_buf
-    };
-    httpd_register_uri_handler(server, &set_flags);
-
-    httpd_uri_t get_info = {
-        .uri      = "/info?",
-        .method   = HTTP_POST,
-        .handler  = handler_get_info,
-        .user_ctx = server_buf
-    };
-    httpd_register_uri_handler(server, &get_info);
-
-    httpd_uri_t get_setting = {
-        .uri      = "/data?",
-        .method   = HTTP_POST,
-        .handler  = handler_give_data,
-        .user_ctx = server_buf
-    };
-    httpd_register_uri_handler(server, &get_setting);
-    
-     httpd_uri_t close_uri = {
-        .uri      = "/close",
-        .method   = HTTP_POST,
-        .handler  = handler_close,
-        .user_ctx = server_buf
-    };
-    httpd_register_uri_handler(server, &close_uri);
-
-     httpd_uri_t net_uri = {
-        .uri      = "/Network",
-        .method   = HTTP_POST,
-        .handler  = handler_set_network,
-        .user_ctx = server_buf
-    };
-    httpd_register_uri_handler(server, &net_uri);
-
-    httpd_uri_t api_uri = {
-        .uri      = "/Openweather",
-        .method   = HTTP_POST,
-        .handler  = handler_set_openweather_data,
-        .user_ctx = server_buf
-    };
-    httpd_register_uri_handler(server, &api_uri);
-
-     httpd_uri_t time_uri = {
-        .uri      = "/time",
-        .method   = HTTP_POST,
-        .handler  = handler_set_time,
-        .user_ctx = server_buf
-    };
-    httpd_register_uri_handler(server, &time_uri);
-
-
-     httpd_uri_t get_style = {
-        .uri      = "/style.css",
-        .method   = HTTP_GET,
-        .handler  = get_css_handler,
-        .user_ctx = server_buf
-    };
-    httpd_register_uri_handler(server, &get_style);
-
-     httpd_uri_t get_script = {
-        .uri      = "/script.js",
-        .method   = HTTP_GET,
-        .handler  = get_js_handler,
-        .user_ctx = server_buf
-    };
-    httpd_register_uri_handler(server, &get_script);
-
-     httpd_uri_t notif_uri = {
-        .uri      = "/Notification",
-        .method   = HTTP_POST,
-        .handler  = set_notif_handler,
-        .user_ctx = server_buf
-    };
-    httpd_register_uri_handler(server, &notif_uri);
-
-    httpd_uri_t set_offset_uri = {
-        .uri      = "/Offset",
-        .method   = HTTP_POST,
-        .handler  = set_offset_handler,
-        .user_ctx = server_buf
-    };
-    httpd_register_uri_handler(server, &set_offset_uri);
-
-    httpd_uri_t set_loud_uri = {
-        .uri      = "/Loud",
-        .method   = HTTP_POST,
-        .handler  = set_loud_handler,
-        .user_ctx = server_buf
-    };
-    httpd_register_uri_handler(server, &set_loud_uri);
-
-    httpd_uri_t update_uri = {
-        .uri      = "/OTA",
-        .method   = HTTP_POST,
-        .handler  = handler_update_esp,
-        .user_ctx = server_buf
-    };
-    httpd_register_uri_handler(server, &update_uri);
-
-    httpd_uri_t redir_uri = {
-        .uri      = "/*",
-        .method   = HTTP_GET,
-        .handler  = get_index_handler,
-        .user_ctx = server_buf
-    };
-    httpd_register_uri_handler(server, &redir_uri);
+    init_asset_etags();
+    const httpd_method_t methods[] = { HTTP_GET, HTTP_POST };
+    for(int i=0; i<sizeof(methods)/sizeof(methods[0]); ++i){
+        const httpd_uri_t uri = {
+            .uri      = "/*",
+            .method   = methods[i],
+            .handler  = dispatch_handler,
+        };
+        httpd_register_uri_handler(server, &uri);
+    }
     init_dns_server_task();
     return ESP_OK;
 }
@@ -0,0 +1,22 @@
+#ifndef TIME_SYNC_H_
+#define TIME_SYNC_H_
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+
+int time_sync_update();
+void time_sync_discipline();
+unsigned time_sync_get_interval_ms();
+float time_sync_get_drift_ppm();
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
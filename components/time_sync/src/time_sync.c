@@ -0,0 +1,249 @@
+#include "time_sync.h"
+
+#include "device_common.h"
+#include "device_macro.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <unistd.h>
+#include "esp_log.h"
+
+
+#define NTP_PORT                "123"
+#define NTP_PACKET_SIZE         48
+#define NTP_UNIX_OFFSET         2208988800ULL
+#define NTP_RECV_TIMEOUT_MS     1000
+
+// above this the clock is stepped instead of slewed
+#define STEP_THRESHOLD_US       500000LL
+// what the clock may drift away between two syncs
+#define ERROR_BUDGET_US         2000000.0F
+#define MAX_DRIFT_PPM           1000.0F
+#define STABLE_RESIDUAL_PPM     5.0F
+#define MIN_RESIDUAL_PPM        0.5F
+#define STABLE_SYNC_NUM         2
+
+enum SyncInterval{
+    SYNC_INTERVAL_MIN_MS    = 8*60*60*1000,
+    SYNC_INTERVAL_MAX_MS    = 4*24*60*60*1000,
+};
+
+enum NtpPacket{
+    NTP_MODE_CLIENT     = 3,
+    NTP_MODE_SERVER     = 4,
+    NTP_VERSION         = 4,
+    NTP_LI_ALARM        = 3,
+    NTP_RECV_TS_POS     = 32,
+    NTP_TRANSMIT_TS_POS = 40,
+    NTP_ORIGIN_TS_POS   = 24,
+};
+
+static const char *TAG = "time_sync";
+
+static const char *server_list[] = {
+    "0.ua.pool.ntp.org",
+    "1.ua.pool.ntp.org",
+    "pool.ntp.org",
+};
+
+// clock model: the local clock runs drift_ppm fast (positive) or slow
+static struct {
+    int64_t last_sync_us;
+    int64_t last_discipline_us;
+    float drift_ppm;
+    float residual_ppm;
+    unsigned stable_num;
+    bool is_sync;
+} clock_model;
+
+
+static int query_server(const char *host, int64_t *offset_us, int64_t *delay_us);
+static void apply_offset(int64_t offset_us, int64_t now_us);
+static void update_drift(int64_t offset_us, int64_t now_us);
+static int64_t get_time_us();
+static int64_t ntp_to_us(const unsigned char *ts);
+static void us_to_ntp(int64_t time_us, unsigned char *ts);
+
+
+
+int time_sync_update()
+{
+    int64_t offset_us, delay_us;
+    for(int i=0; i<sizeof(server_list)/sizeof(server_list[0]); ++i){
+        if(query_server(server_list[i], &offset_us, &delay_us) == ESP_OK){
+            const int64_t now_us = get_time_us();
+            ESP_LOGI(TAG, "%s offset %lld us, delay %lld us", server_list[i], offset_us, delay_us);
+            update_drift(offset_us, now_us);
+            apply_offset(offset_us, now_us);
+            device_set_state(BIT_IS_TIME|BIT_EVENT_NEW_MIN);
+            return ESP_OK;
+        }
+    }
+    return ESP_FAIL;
+}
+
+// called between syncs, slews the clock by the drift accumulated since the last call
+void time_sync_discipline()
+{
+    if(!clock_model.is_sync || clock_model.drift_ppm == 0) return;
+    struct timeval delta, pending = { 0 };
+    const int64_t now_us = get_time_us();
+    const int64_t correction_us = -(now_us - clock_model.last_discipline_us) * clock_model.drift_ppm / 1000000.0F;
+    if(correction_us == 0) return;
+    clock_model.last_discipline_us = now_us;
+    adjtime(NULL, &pending);
+    const int64_t total_us = correction_us + pending.tv_sec * 1000000LL + pending.tv_usec;
+    delta.tv_sec = total_us / 1000000;
+    delta.tv_usec = total_us % 1000000;
+    adjtime(&delta, NULL);
+}
+
+unsigned time_sync_get_interval_ms()
+{
+    if(clock_model.stable_num < STABLE_SYNC_NUM){
+        return SYNC_INTERVAL_MIN_MS;
+    }
+    float residual_ppm = clock_model.residual_ppm < 0 ? -clock_model.residual_ppm : clock_model.residual_ppm;
+    if(residual_ppm < MIN_RESIDUAL_PPM){
+        residual_ppm = MIN_RESIDUAL_PPM;
+    }
+    // ppm is microseconds per second
+    const float interval_ms = ERROR_BUDGET_US / residual_ppm * 1000.0F;
+    if(interval_ms > SYNC_INTERVAL_MAX_MS) return SYNC_INTERVAL_MAX_MS;
+    if(interval_ms < SYNC_INTERVAL_MIN_MS) return SYNC_INTERVAL_MIN_MS;
+    return interval_ms;
+}
+
+float time_sync_get_drift_ppm()
+{
+    return clock_model.drift_ppm;
+}
+
+
+static int query_server(const char *host, int64_t *offset_us, int64_t *delay_us)
+{
+    unsigned char packet[NTP_PACKET_SIZE] = { 0 };
+    unsigned char origin[8];
+    struct addrinfo hints = {0}, *addr = NULL;
+    // tv_usec must stay below a second
+    const struct timeval recv_timeout = { 
+        .tv_sec = NTP_RECV_TIMEOUT_MS / 1000, 
+        .tv_usec = (NTP_RECV_TIMEOUT_MS % 1000) * 1000,
+    };
+    int res = ESP_FAIL;
+    int sock = -1;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+
+    if(getaddrinfo(host, NTP_PORT, &hints, &addr) != 0 || addr == NULL){
+        ESP_LOGE(TAG, "DNS resolution failed");
+        return ESP_FAIL;
+    }
+    sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if(sock < 0){
+        goto fail;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout, sizeof(recv_timeout));
+
+    packet[0] = NTP_VERSION<<3 | NTP_MODE_CLIENT;
+    const int64_t t1 = get_time_us();
+    // the server echoes our transmit time as origin, it ties the answer to this query
+    us_to_ntp(t1, &packet[NTP_TRANSMIT_TS_POS]);
+    memcpy(origin, &packet[NTP_TRANSMIT_TS_POS], sizeof(origin));
+    if(sendto(sock, packet, sizeof(packet), 0, addr->ai_addr, addr->ai_addrlen) != sizeof(packet)){
+        goto fail;
+    }
+    if(recv(sock, packet, sizeof(packet), 0) != sizeof(packet)){
+        ESP_LOGE(TAG, "No answer from %s", host);
+        goto fail;
+    }
+    const int64_t t4 = get_time_us();
+    const unsigned stratum = packet[1];
+    if((packet[0] & 0x07) != NTP_MODE_SERVER
+            || (packet[0] >> 6) == NTP_LI_ALARM
+            || stratum == 0 || stratum > 15
+            || memcmp(origin, &packet[NTP_ORIGIN_TS_POS], sizeof(origin)) != 0){
+        ESP_LOGE(TAG, "Bad answer from %s", host);
+        goto fail;
+    }
+    const int64_t t2 = ntp_to_us(&packet[NTP_RECV_TS_POS]);
+    const int64_t t3 = ntp_to_us(&packet[NTP_TRANSMIT_TS_POS]);
+    *offset_us = ((t2 - t1) + (t3 - t4)) / 2;
+    *delay_us = (t4 - t1) - (t3 - t2);
+    res = ESP_OK;
+
+fail:
+    if(sock >= 0) close(sock);
+    freeaddrinfo(addr);
+    return res;
+}
+
+static void apply_offset(int64_t offset_us, int64_t now_us)
+{
+    if(!clock_model.is_sync || offset_us > STEP_THRESHOLD_US || offset_us < -STEP_THRESHOLD_US){
+        now_us += offset_us;
+        const struct timeval tv = {
+            .tv_sec = now_us / 1000000,
+            .tv_usec = now_us % 1000000
+        };
+        settimeofday(&tv, NULL);
+    } else {
+        const struct timeval delta = {
+            .tv_sec = offset_us / 1000000,
+            .tv_usec = offset_us % 1000000
+        };
+        adjtime(&delta, NULL);
+        now_us += offset_us;
+    }
+    clock_model.last_sync_us = clock_model.last_discipline_us = now_us;
+    clock_model.is_sync = true;
+}
+
+// the offset found at a sync is what the drift model missed since the previous one
+static void update_drift(int64_t offset_us, int64_t now_us)
+{
+    if(!clock_model.is_sync) return;
+    const float elapsed_sec = (now_us - clock_model.last_sync_us) / 1000000.0F;
+    if(elapsed_sec < 60.0F) return;
+    const float residual_ppm = -offset_us / elapsed_sec;
+    float drift_ppm = clock_model.drift_ppm + residual_ppm / (clock_model.stable_num ? 2.0F : 1.0F);
+    if(drift_ppm > MAX_DRIFT_PPM) drift_ppm = MAX_DRIFT_PPM;
+    if(drift_ppm < -MAX_DRIFT_PPM) drift_ppm = -MAX_DRIFT_PPM;
+    clock_model.drift_ppm = drift_ppm;
+    clock_model.residual_ppm = residual_ppm;
+    if(residual_ppm < STABLE_RESIDUAL_PPM && residual_ppm > -STABLE_RESIDUAL_PPM){
+        clock_model.stable_num += 1;
+    } else {
+        clock_model.stable_num = 0;
+    }
+    ESP_LOGI(TAG, "drift %.2f ppm, residual %.2f ppm", drift_ppm, residual_ppm);
+}
+
+static int64_t get_time_us()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static int64_t ntp_to_us(const unsigned char *ts)
+{
+    const uint32_t sec = (uint32_t)ts[0]<<24 | ts[1]<<16 | ts[2]<<8 | ts[3];
+    const uint32_t frac = (uint32_t)ts[4]<<24 | ts[5]<<16 | ts[6]<<8 | ts[7];
+    return ((int64_t)sec - NTP_UNIX_OFFSET) * 1000000LL + (((uint64_t)frac * 1000000ULL) >> 32);
+}
+
+static void us_to_ntp(int64_t time_us, unsigned char *ts)
+{
+    const uint32_t sec = time_us / 1000000 + NTP_UNIX_OFFSET;
+    const uint32_t frac = ((uint64_t)(time_us % 1000000) << 32) / 1000000;
+    for(int i=0; i<4; ++i){
+        ts[i] = sec >> (24 - 8*i);
+        ts[4+i] = frac >> (24 - 8*i);
+    }
+}
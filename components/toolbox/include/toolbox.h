@@ -7,6 +7,7 @@
 extern "C" {
 #endif
 
+#include "stdint.h"
 #include "time.h"
 
 uint8_t battery_voltage_to_percentage(float voltage);
@@ -6,12 +6,17 @@
 extern "C" {
 #endif
 
+#include "wifi_sm.h"
 
 
 int connect_sta(const char *ssid, const char *pwd);
 int start_ap();
 int wifi_init(void) ;
 void wifi_stop();
+// reconnect attempts after a failed association, 5 by default
+void wifi_set_retry_num(unsigned retry_num);
+// connect times and radio-on time counted by the connection state machine
+void wifi_get_stats(wifi_sm_stats_t *stats);
 
 
 
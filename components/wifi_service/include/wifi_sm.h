@@ -0,0 +1,88 @@
+#ifndef WIFI_SM_H
+#define WIFI_SM_H
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "stdint.h"
+#include "stdbool.h"
+
+
+// connection logic of wifi_service, free of ESP-IDF calls: events come in 
+// with their time, the returned actions are carried out by the caller
+
+typedef enum {
+    WIFI_SM_IDLE,
+    WIFI_SM_CONNECTING,
+    WIFI_SM_CONNECTED,
+    WIFI_SM_FAILED,
+    WIFI_SM_AP,
+} wifi_sm_state_t;
+
+typedef enum {
+    WIFI_SM_EV_START_STA,
+    WIFI_SM_EV_START_AP,
+    WIFI_SM_EV_STOP,
+    WIFI_SM_EV_STA_START,
+    WIFI_SM_EV_ASSOCIATED,
+    WIFI_SM_EV_DISCONNECTED,
+    WIFI_SM_EV_GOT_IP,
+    WIFI_SM_EV_TIMEOUT,
+    WIFI_SM_EV_AP_CLIENT_JOIN,
+    WIFI_SM_EV_AP_CLIENT_LEAVE,
+} wifi_sm_event_id_t;
+
+typedef struct {
+    wifi_sm_event_id_t id;
+    uint32_t time_ms;
+    // WIFI_SM_EV_START_STA: association goes to the cached AP first
+    bool use_cached_ap;
+    // WIFI_SM_EV_DISCONNECTED: the AP was not found or did not answer the handshake
+    bool ap_missing;
+} wifi_sm_event_t;
+
+enum WifiSmAction{
+    WIFI_SM_ACT_CONNECT         = (1<<0),
+    WIFI_SM_ACT_DROP_CACHED_AP  = (1<<1),
+    WIFI_SM_ACT_STORE_AP        = (1<<2),
+    WIFI_SM_ACT_ONLINE          = (1<<3),
+    WIFI_SM_ACT_OFFLINE         = (1<<4),
+    WIFI_SM_ACT_AP_MISSING      = (1<<5),
+    WIFI_SM_ACT_AP_CLIENT       = (1<<6),
+    WIFI_SM_ACT_AP_NO_CLIENT    = (1<<7),
+};
+
+typedef struct {
+    unsigned connect_num;
+    unsigned fail_num;
+    uint32_t last_connect_ms;
+    uint32_t max_connect_ms;
+    unsigned long long radio_on_ms;
+} wifi_sm_stats_t;
+
+typedef struct {
+    wifi_sm_state_t state;
+    unsigned retry_num;
+    unsigned retry_max;
+    bool use_cached_ap;
+    unsigned ap_clients;
+    uint32_t start_ms;
+    uint32_t connect_start_ms;
+    wifi_sm_stats_t stats;
+} wifi_sm_t;
+
+
+void wifi_sm_init(wifi_sm_t *sm, unsigned retry_max);
+unsigned wifi_sm_handle(wifi_sm_t *sm, const wifi_sm_event_t *event);
+
+
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -12,22 +12,46 @@
 #include "esp_sntp.h"
 #include "sdkconfig.h"
 #include "esp_mac.h"
+#include "esp_netif.h"
+#include "esp_timer.h"
 #include "toolbox.h"
 #include "device_common.h"
 #include "setting_server.h"
 #include "device_macro.h"
+#include "wifi_sm.h"
 
 #include "string.h"
 
 
 #define MIN_WIFI_PWD_LEN  8
 #define MIN_WIFI_SSID_LEN 1 
+#define STA_CONNECT_TIMEOUT_MS 10000
+#define STA_RETRY_NUM 5
+// routers lease for a day or more, reusing the address for two hours stays well inside it
+#define STATIC_IP_VALID_US (2*60*60*1000000LL)
 
 
 wifi_mode_t wifi_mode;
 
-static esp_netif_t *netif;
+// created once and kept, only the radio is started and stopped per session
+static esp_netif_t *sta_netif;
+static esp_netif_t *ap_netif;
 static wifi_config_t wifi_sta_config;
+// the decisions live in wifi_sm, the handlers only translate events and carry out actions
+static wifi_sm_t sm;
+static portMUX_TYPE sm_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// last good association, RAM is kept through light sleep
+static struct {
+    char ssid[sizeof(((wifi_sta_config_t *)0)->ssid)];
+    uint8_t bssid[6];
+    uint8_t channel;
+    bool has_ap;
+    esp_netif_ip_info_t ip_info;
+    esp_netif_dns_info_t dns_info;
+    int64_t lease_time_us;
+    bool has_lease;
+} sta_cache;
 
 static wifi_config_t wifi_ap_config = {
         .ap.password = CONFIG_WIFI_AP_PASSWORD,
@@ -39,28 +63,38 @@ static wifi_config_t wifi_ap_config = {
 };
 
 
+static void sta_cache_reset();
+static bool sta_cache_has_lease();
+static unsigned sm_dispatch(wifi_sm_event_id_t id, bool flag);
+static void run_actions(unsigned actions);
+
 
 static void sta_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) 
 {
-    static int retry_num;
     if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_START) {
-        retry_num = 0;
-        esp_wifi_connect();
-    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
-        if(retry_num < 5){
-            esp_wifi_connect();
-            ++retry_num;
-        } else {
-            wifi_event_sta_disconnected_t *event_sta_disconnected = (wifi_event_sta_disconnected_t *) event_data;
-            if(event_sta_disconnected->reason == WIFI_REASON_NO_AP_FOUND
-                        || event_sta_disconnected->reason == WIFI_REASON_HANDSHAKE_TIMEOUT){
-                device_set_state(BIT_ERR_SSID_NOT_FOUND);
-            }
+        run_actions(sm_dispatch(WIFI_SM_EV_STA_START, false));
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_CONNECTED) {
+        const wifi_event_sta_connected_t *event = (wifi_event_sta_connected_t *) event_data;
+        if(sm_dispatch(WIFI_SM_EV_ASSOCIATED, false)&WIFI_SM_ACT_STORE_AP){
+            memcpy(sta_cache.bssid, event->bssid, sizeof(sta_cache.bssid));
+            sta_cache.channel = event->channel;
+            sta_cache.has_ap = true;
         }
+    } else if (event_base == WIFI_EVENT && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+        const wifi_event_sta_disconnected_t *event = (wifi_event_sta_disconnected_t *) event_data;
+        const bool ap_missing = event->reason == WIFI_REASON_NO_AP_FOUND
+                                || event->reason == WIFI_REASON_HANDSHAKE_TIMEOUT;
+        run_actions(sm_dispatch(WIFI_SM_EV_DISCONNECTED, ap_missing));
     } else if (event_base == IP_EVENT && event_id == IP_EVENT_STA_GOT_IP) {
-        retry_num = 0;
-        device_set_state(BIT_IS_STA_CONNECTION);
-        device_clear_state(BIT_ERR_SSID_NOT_FOUND);
+        const ip_event_got_ip_t *event = (ip_event_got_ip_t *) event_data;
+        const unsigned actions = sm_dispatch(WIFI_SM_EV_GOT_IP, false);
+        if(actions&WIFI_SM_ACT_ONLINE && !sta_cache.has_lease){
+            sta_cache.ip_info = event->ip_info;
+            esp_netif_get_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &sta_cache.dns_info);
+            sta_cache.lease_time_us = esp_timer_get_time();
+            sta_cache.has_lease = true;
+        }
+        run_actions(actions);
     }
 }
 
@@ -69,9 +103,9 @@ static void ap_handler(void* main_data, esp_event_base_t event_base,
                             int32_t event_id, void* event_data)
 {
     if(event_id == WIFI_EVENT_AP_STACONNECTED){
-        device_set_state(BIT_IS_AP_CLIENT);
+        run_actions(sm_dispatch(WIFI_SM_EV_AP_CLIENT_JOIN, false));
     } else if(event_id == WIFI_EVENT_AP_STADISCONNECTED){
-        device_clear_state(BIT_IS_AP_CLIENT);
+        run_actions(sm_dispatch(WIFI_SM_EV_AP_CLIENT_LEAVE, false));
     }
 }
 
@@ -79,10 +113,17 @@ int wifi_init(void)
 {
     wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
     wifi_mode = WIFI_MODE_NULL;
+    wifi_sm_init(&sm, STA_RETRY_NUM);
     CHECK_AND_RET_ERR(esp_event_loop_create_default());
     CHECK_AND_RET_ERR(esp_netif_init());
     CHECK_AND_RET_ERR(esp_wifi_init(&cfg));
     CHECK_AND_RET_ERR(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+    CHECK_AND_RET_ERR(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_START, &sta_handler, NULL));
+    CHECK_AND_RET_ERR(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_CONNECTED, &sta_handler, NULL));
+    CHECK_AND_RET_ERR(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &sta_handler, NULL));
+    CHECK_AND_RET_ERR(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &sta_handler, NULL));
+    CHECK_AND_RET_ERR(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_AP_STACONNECTED, &ap_handler, NULL));
+    CHECK_AND_RET_ERR(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_AP_STADISCONNECTED, &ap_handler, NULL));
     return ESP_OK;
 }
 
@@ -103,22 +144,26 @@ int connect_sta(const char *ssid, const char *pwd)
     strncpy((char *)wifi_sta_config.sta.ssid, ssid, sizeof(wifi_sta_config.sta.ssid)-1);
     strncpy((char *)wifi_sta_config.sta.password, pwd, sizeof(wifi_sta_config.sta.password)-1);
     wifi_sta_config.sta.threshold.authmode = WIFI_AUTH_WPA2_PSK;
+    if(strncmp(sta_cache.ssid, (char *)wifi_sta_config.sta.ssid, sizeof(sta_cache.ssid)) != 0){
+        sta_cache_reset();
+        memcpy(sta_cache.ssid, wifi_sta_config.sta.ssid, sizeof(sta_cache.ssid));
+    }
+    if(sta_cache.has_ap){
+        // straight to the known AP, the scan covers a single channel
+        memcpy(wifi_sta_config.sta.bssid, sta_cache.bssid, sizeof(sta_cache.bssid));
+        wifi_sta_config.sta.bssid_set = true;
+        wifi_sta_config.sta.channel = sta_cache.channel;
+    }
 
-    if (wifi_mode == WIFI_MODE_AP){
+    if (wifi_mode != WIFI_MODE_NULL){
         wifi_stop(); 
     }
+    if(sta_netif == NULL){
+        sta_netif = esp_netif_create_default_wifi_sta();
+        if(sta_netif == NULL) return ESP_FAIL;
+    }
 
     wifi_mode = WIFI_MODE_STA;
-    
-    if(netif == NULL){
-        netif = esp_netif_create_default_wifi_sta();
-        if(netif == NULL) return ESP_FAIL;
-        CHECK_AND_RET_ERR(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_START, &sta_handler, NULL));
-        CHECK_AND_RET_ERR(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &sta_handler, NULL));
-        CHECK_AND_RET_ERR(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &sta_handler, NULL));
-        CHECK_AND_RET_ERR(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_STOP, &sta_handler, NULL));
-    }
-    
     CHECK_AND_RET_ERR(esp_wifi_set_mode(WIFI_MODE_STA));
 #if CONFIG_ESPNOW_ENABLE_LONG_RANGE
         CHECK_AND_RET_ERR(esp_wifi_set_protocol(ESP_IF_WIFI_STA,
@@ -128,68 +173,132 @@ int connect_sta(const char *ssid, const char *pwd)
                                                 |WIFI_PROTOCOL_LR));
 #endif
 
+    if(sta_cache_has_lease() && wifi_sta_config.sta.bssid_set){
+        // the address is still ours, GOT_IP comes right after association without DHCP
+        esp_netif_dhcpc_stop(sta_netif);
+        CHECK_AND_RET_ERR(esp_netif_set_ip_info(sta_netif, &sta_cache.ip_info));
+        esp_netif_set_dns_info(sta_netif, ESP_NETIF_DNS_MAIN, &sta_cache.dns_info);
+    } else {
+        // the netif is kept, a static address from an earlier session may still be set
+        sta_cache.has_lease = false;
+        esp_netif_dhcpc_start(sta_netif);
+    }
+
     CHECK_AND_RET_ERR(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_sta_config));
+    device_clear_state(BIT_IS_STA_CONNECTION|BIT_ERR_SSID_NOT_FOUND);
+    sm_dispatch(WIFI_SM_EV_START_STA, wifi_sta_config.sta.bssid_set);
     CHECK_AND_RET_ERR(esp_wifi_start());
-    device_clear_state(BIT_IS_STA_CONNECTION);
-    vTaskDelay(1000/portTICK_PERIOD_MS);
-    unsigned bits = device_wait_bits(BIT_IS_STA_CONNECTION);
+    // the radio naps between beacons while the session is idle
+    esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+    unsigned bits = device_wait_bits_untile(BIT_IS_STA_CONNECTION|BIT_ERR_SSID_NOT_FOUND, 
+                                    STA_CONNECT_TIMEOUT_MS/portTICK_PERIOD_MS);
     if(bits&BIT_IS_STA_CONNECTION){
-        vTaskDelay(1000/portTICK_PERIOD_MS);
         return ESP_OK;
     }
+    sm_dispatch(WIFI_SM_EV_TIMEOUT, false);
     ESP_LOGE("", "err timeout sta");
     return ESP_ERR_TIMEOUT;
 }
 
+void wifi_set_retry_num(unsigned retry_num)
+{
+    portENTER_CRITICAL(&sm_mux);
+    sm.retry_max = retry_num;
+    portEXIT_CRITICAL(&sm_mux);
+}
+
+void wifi_get_stats(wifi_sm_stats_t *stats)
+{
+    portENTER_CRITICAL(&sm_mux);
+    *stats = sm.stats;
+    portEXIT_CRITICAL(&sm_mux);
+}
+
 
 int start_ap()
 {
-    if (wifi_mode != WIFI_MODE_AP && wifi_mode != WIFI_MODE_NULL) {
+    if (wifi_mode != WIFI_MODE_NULL) {
         wifi_stop(); 
     }
-
-    if(netif == NULL){
-        netif = esp_netif_create_default_wifi_ap();
-        if(netif == NULL) return ESP_FAIL;
-        CHECK_AND_RET_ERR(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_AP_STACONNECTED, &ap_handler, NULL));
-        CHECK_AND_RET_ERR(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_AP_STADISCONNECTED, &ap_handler, NULL));       
-        CHECK_AND_RET_ERR(esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_AP_START, &ap_handler, NULL));
+    if(ap_netif == NULL){
+        ap_netif = esp_netif_create_default_wifi_ap();
+        if(ap_netif == NULL) return ESP_FAIL;
     }
 
     wifi_mode = WIFI_MODE_AP;
+    sm_dispatch(WIFI_SM_EV_START_AP, false);
     CHECK_AND_RET_ERR(esp_wifi_set_mode(WIFI_MODE_AP));
     CHECK_AND_RET_ERR(esp_wifi_set_config(ESP_IF_WIFI_AP, &wifi_ap_config));
-
-    int res = esp_wifi_start();
-    if(res == ESP_OK){
-        vTaskDelay(500/portTICK_PERIOD_MS);
-    }
-    return res;
+    // sockets bind to any address, the server may start before AP_START is handled
+    return esp_wifi_start();
 }
 
 
+// only the radio goes down, netifs and handlers stay for the next session
 void wifi_stop()
 {
+    run_actions(sm_dispatch(WIFI_SM_EV_STOP, false));
     device_clear_state(BIT_IS_AP_CLIENT|BIT_IS_STA_CONNECTION);
-    if (wifi_mode == WIFI_MODE_AP){
-        esp_wifi_stop();
-        vTaskDelay(100/portTICK_PERIOD_MS);
-        esp_event_handler_unregister(WIFI_EVENT, WIFI_EVENT_AP_STADISCONNECTED, &ap_handler);
-        esp_event_handler_unregister(WIFI_EVENT, WIFI_EVENT_AP_STACONNECTED, &ap_handler);
-        esp_event_handler_unregister(WIFI_EVENT, WIFI_EVENT_AP_START, &ap_handler);
-        esp_event_handler_unregister(WIFI_EVENT, WIFI_EVENT_AP_STOP, &ap_handler);
-    } else if (wifi_mode == WIFI_MODE_STA) {
+    if (wifi_mode != WIFI_MODE_NULL){
+        wifi_mode = WIFI_MODE_NULL;
         esp_wifi_stop();
-        vTaskDelay(100/portTICK_PERIOD_MS);
-        esp_event_handler_unregister(WIFI_EVENT, WIFI_EVENT_STA_START, &sta_handler);
-        esp_event_handler_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP, &sta_handler);
-        esp_event_handler_unregister(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &sta_handler);
-        esp_event_handler_unregister(WIFI_EVENT, WIFI_EVENT_STA_STOP, &sta_handler);
-    }
-    wifi_mode = WIFI_MODE_NULL;
-    if(netif){
-        esp_netif_destroy_default_wifi(netif);
-        netif = NULL;
     }
 }
 
+
+static void sta_cache_reset()
+{
+    sta_cache.has_ap = false;
+    sta_cache.has_lease = false;
+}
+
+static bool sta_cache_has_lease()
+{
+    return sta_cache.has_lease 
+            && esp_timer_get_time() - sta_cache.lease_time_us < STATIC_IP_VALID_US;
+}
+
+// the flag is use_cached_ap for WIFI_SM_EV_START_STA and ap_missing for WIFI_SM_EV_DISCONNECTED
+static unsigned sm_dispatch(wifi_sm_event_id_t id, bool flag)
+{
+    const wifi_sm_event_t event = {
+        .id = id,
+        .time_ms = esp_timer_get_time()/1000,
+        .use_cached_ap = flag,
+        .ap_missing = flag,
+    };
+    portENTER_CRITICAL(&sm_mux);
+    const unsigned actions = wifi_sm_handle(&sm, &event);
+    portEXIT_CRITICAL(&sm_mux);
+    return actions;
+}
+
+static void run_actions(unsigned actions)
+{
+    if(actions&WIFI_SM_ACT_OFFLINE){
+        device_clear_state(BIT_IS_STA_CONNECTION);
+    }
+    if(actions&WIFI_SM_ACT_DROP_CACHED_AP){
+        sta_cache_reset();
+        wifi_sta_config.sta.bssid_set = false;
+        wifi_sta_config.sta.channel = 0;
+        esp_wifi_set_config(WIFI_IF_STA, &wifi_sta_config);
+        esp_netif_dhcpc_start(sta_netif);
+    }
+    if(actions&WIFI_SM_ACT_CONNECT){
+        esp_wifi_connect();
+    }
+    if(actions&WIFI_SM_ACT_ONLINE){
+        device_set_state(BIT_IS_STA_CONNECTION);
+        device_clear_state(BIT_ERR_SSID_NOT_FOUND);
+    }
+    if(actions&WIFI_SM_ACT_AP_MISSING){
+        device_set_state(BIT_ERR_SSID_NOT_FOUND);
+    }
+    if(actions&WIFI_SM_ACT_AP_CLIENT){
+        device_set_state(BIT_IS_AP_CLIENT);
+    }
+    if(actions&WIFI_SM_ACT_AP_NO_CLIENT){
+        device_clear_state(BIT_IS_AP_CLIENT);
+    }
+}
@@ -0,0 +1,123 @@
+#include "wifi_sm.h"
+
+#include "string.h"
+
+
+static unsigned handle_disconnected(wifi_sm_t *sm, const wifi_sm_event_t *event);
+static unsigned stop(wifi_sm_t *sm, uint32_t time_ms);
+
+
+
+void wifi_sm_init(wifi_sm_t *sm, unsigned retry_max)
+{
+    memset(sm, 0, sizeof(wifi_sm_t));
+    sm->state = WIFI_SM_IDLE;
+    sm->retry_max = retry_max;
+}
+
+unsigned wifi_sm_handle(wifi_sm_t *sm, const wifi_sm_event_t *event)
+{
+    unsigned actions = 0;
+    switch(event->id){
+    case WIFI_SM_EV_START_STA:
+    case WIFI_SM_EV_START_AP:
+        if(sm->state != WIFI_SM_IDLE){
+            actions |= stop(sm, event->time_ms);
+        }
+        sm->state = event->id == WIFI_SM_EV_START_STA ? WIFI_SM_CONNECTING : WIFI_SM_AP;
+        sm->use_cached_ap = event->use_cached_ap;
+        sm->retry_num = 0;
+        sm->start_ms = sm->connect_start_ms = event->time_ms;
+        break;
+    case WIFI_SM_EV_STOP:
+        if(sm->state != WIFI_SM_IDLE){
+            actions |= stop(sm, event->time_ms);
+        }
+        break;
+    case WIFI_SM_EV_STA_START:
+        if(sm->state == WIFI_SM_CONNECTING){
+            actions |= WIFI_SM_ACT_CONNECT;
+        }
+        break;
+    case WIFI_SM_EV_ASSOCIATED:
+        if(sm->state == WIFI_SM_CONNECTING){
+            actions |= WIFI_SM_ACT_STORE_AP;
+        }
+        break;
+    case WIFI_SM_EV_DISCONNECTED:
+        actions |= handle_disconnected(sm, event);
+        break;
+    case WIFI_SM_EV_GOT_IP:
+        if(sm->state == WIFI_SM_CONNECTING){
+            const uint32_t connect_ms = event->time_ms - sm->connect_start_ms;
+            sm->stats.connect_num += 1;
+            sm->stats.last_connect_ms = connect_ms;
+            if(connect_ms > sm->stats.max_connect_ms){
+                sm->stats.max_connect_ms = connect_ms;
+            }
+        }
+        if(sm->state == WIFI_SM_CONNECTING || sm->state == WIFI_SM_CONNECTED){
+            sm->state = WIFI_SM_CONNECTED;
+            sm->retry_num = 0;
+            actions |= WIFI_SM_ACT_ONLINE;
+        }
+        break;
+    case WIFI_SM_EV_TIMEOUT:
+        if(sm->state == WIFI_SM_CONNECTING){
+            sm->state = WIFI_SM_FAILED;
+            sm->stats.fail_num += 1;
+        }
+        break;
+    case WIFI_SM_EV_AP_CLIENT_JOIN:
+        if(sm->state == WIFI_SM_AP){
+            sm->ap_clients += 1;
+            actions |= WIFI_SM_ACT_AP_CLIENT;
+        }
+        break;
+    case WIFI_SM_EV_AP_CLIENT_LEAVE:
+        // a client that drops and rejoins must not hide the others
+        if(sm->state == WIFI_SM_AP && sm->ap_clients > 0 && --sm->ap_clients == 0){
+            actions |= WIFI_SM_ACT_AP_NO_CLIENT;
+        }
+        break;
+    }
+    return actions;
+}
+
+
+static unsigned handle_disconnected(wifi_sm_t *sm, const wifi_sm_event_t *event)
+{
+    if(sm->state != WIFI_SM_CONNECTING && sm->state != WIFI_SM_CONNECTED){
+        return 0;
+    }
+    if(sm->state == WIFI_SM_CONNECTED){
+        sm->state = WIFI_SM_CONNECTING;
+        sm->retry_num = 0;
+        sm->connect_start_ms = event->time_ms;
+        return WIFI_SM_ACT_OFFLINE|WIFI_SM_ACT_CONNECT;
+    }
+    if(sm->use_cached_ap){
+        // the AP moved or is gone, the next attempts scan all channels and ask DHCP
+        sm->use_cached_ap = false;
+        return WIFI_SM_ACT_DROP_CACHED_AP|WIFI_SM_ACT_CONNECT;
+    }
+    if(sm->retry_num < sm->retry_max){
+        sm->retry_num += 1;
+        return WIFI_SM_ACT_CONNECT;
+    }
+    sm->state = WIFI_SM_FAILED;
+    sm->stats.fail_num += 1;
+    return event->ap_missing ? WIFI_SM_ACT_AP_MISSING : 0;
+}
+
+static unsigned stop(wifi_sm_t *sm, uint32_t time_ms)
+{
+    unsigned actions = WIFI_SM_ACT_OFFLINE;
+    if(sm->ap_clients){
+        actions |= WIFI_SM_ACT_AP_NO_CLIENT;
+    }
+    sm->stats.radio_on_ms += time_ms - sm->start_ms;
+    sm->state = WIFI_SM_IDLE;
+    sm->ap_clients = 0;
+    return actions;
+}
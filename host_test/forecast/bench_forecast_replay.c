@@ -0,0 +1,163 @@
+// replays recorded Openweather responses through the forecast client's
+// receive path and parser, plain and gzip, in several segmentations;
+// prints the cost of each run and checks what reaches service_data
+
+#include "forecast_http_client.h"
+#include "device_common.h"
+#include "http_standin.h"
+#include "host_test.h"
+#include "corpus_expect.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CITY    "London"
+#define API_KEY "0123456789abcdef0123456789abcdef"
+
+#define HEAD_JSON(status_) \
+    "HTTP/1.1 " status_ "\r\n" \
+    "Content-Type: application/json; charset=utf-8\r\n"
+
+typedef struct {
+    const char *name;
+    const char *head;
+    // the forecast is expected in service_data, otherwise it stays untouched
+    bool ok;
+    // a failure that makes the client retry, replayed in one segmentation only
+    bool retried;
+} replay_case_t;
+
+static const replay_case_t case_list[] = {
+    { "openweather_forecast.json",  HEAD_JSON("200 OK"),            true,   false },
+    { "openweather_full.json",      HEAD_JSON("200 OK"),            false,  true },
+    { "openweather_error.json",     HEAD_JSON("401 Unauthorized"),  false,  false },
+    { "openweather_not_found.json", HEAD_JSON("404 Not Found"),     false,  false },
+    { "proxy_bad_gateway.html",     "HTTP/1.1 502 Bad Gateway\r\nContent-Type: text/html\r\n", false, false },
+};
+
+// TCP segment sizes the body arrives in, 0 is a single write
+static const size_t segment_list[] = { 0, 1460, 536, 64, 7, 1 };
+
+// the client's memory, counted on the thread that runs the update
+static __thread bool counting;
+static size_t alloc_num, arena_used, heap_used, peak_used;
+
+
+void *__real_malloc(size_t size);
+void *__wrap_malloc(size_t size)
+{
+    if(counting) alloc_num += 1;
+    return __real_malloc(size);
+}
+
+void *__real_calloc(size_t num, size_t size);
+void *__wrap_calloc(size_t num, size_t size)
+{
+    if(counting) alloc_num += 1;
+    return __real_calloc(num, size);
+}
+
+void *__real_realloc(void *ptr, size_t size);
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    if(counting) alloc_num += 1;
+    return __real_realloc(ptr, size);
+}
+
+static void add_used(size_t *used, size_t size)
+{
+    *used += size;
+    if(arena_used + heap_used > peak_used){
+        peak_used = arena_used + heap_used;
+    }
+}
+
+void *__real_net_arena_alloc(net_owner_t owner, size_t size);
+void *__wrap_net_arena_alloc(net_owner_t owner, size_t size)
+{
+    void *ptr = __real_net_arena_alloc(owner, size);
+    if(ptr) add_used(&arena_used, size);
+    return ptr;
+}
+
+void *__real_net_arena_alloc_heap(net_owner_t owner, size_t size);
+void *__wrap_net_arena_alloc_heap(net_owner_t owner, size_t size)
+{
+    void *ptr = __real_net_arena_alloc_heap(owner, size);
+    if(ptr) add_used(&heap_used, size);
+    return ptr;
+}
+
+void __real_net_arena_release(net_owner_t owner);
+void __wrap_net_arena_release(net_owner_t owner)
+{
+    __real_net_arena_release(owner);
+    arena_used = heap_used = 0;
+}
+
+
+static void replay(const replay_case_t *replay_case, const char *body, size_t body_len,
+                    bool gzip, size_t segment)
+{
+    static const service_data_t held = {
+        .update_data_time = 7,
+        .temp_list = { 11, 12, 13, 14, 15 },
+        .desciption = { "held" },
+    };
+    service_data_t data;
+    const standin_reply_t reply = {
+        .head = replay_case->head, .body = body, .body_len = body_len,
+        .gzip = gzip, .segment = segment,
+    };
+    const forecast_stats_t *stats = get_forecast_stats();
+
+    device_publish_service_data(&held);
+    alloc_num = peak_used = 0;
+    standin_start(&reply, 1);
+    counting = true;
+    const bool res = update_forecast_data(CITY, API_KEY);
+    counting = false;
+    standin_stop();
+
+    printf("%-28s %-5s %5zu %-4s %8u %6u %6u %9u %8zu %6zu\n",
+            replay_case->name, gzip ? "gzip" : "plain", segment, res ? "ok" : "fail",
+            stats->last_attempt_num, stats->last_received, stats->last_body_len,
+            stats->last_parse_us, peak_used, alloc_num);
+
+    TEST_CHECK(res == replay_case->ok);
+    if(replay_case->ok){
+        check_openweather_forecast();
+        TEST_CHECK(stats->last_attempt_num == 1);
+        TEST_CHECK(stats->last_received == standin_sent());
+        TEST_CHECK(stats->last_body_len == body_len);
+        // the inflater state is the only allocation on the fetch path
+        TEST_CHECK(alloc_num == (gzip ? 1 : 0));
+    } else {
+        device_get_service_data(&data);
+        TEST_CHECK(memcmp(&data, &held, sizeof(data)) == 0);
+    }
+    // a client session never outgrows the arena plus the inflater block
+    TEST_CHECK(arena_used == 0 && heap_used == 0);
+}
+
+
+int main(void)
+{
+    net_arena_init();
+    // peak_mem adds up the arena and heap blocks at their host sizes, the
+    // zlib backed inflater state is far smaller here than tinfl's on the device
+    printf("%-28s %-5s %5s %-4s %8s %6s %6s %9s %8s %6s\n",
+            "response", "enc", "seg", "res", "attempts", "recv", "body", "parse_us", "peak_mem", "allocs");
+    for(int i=0; i<sizeof(case_list)/sizeof(case_list[0]); ++i){
+        size_t body_len;
+        char *body = standin_load(case_list[i].name, &body_len);
+        const int segment_num = case_list[i].retried ? 1 : sizeof(segment_list)/sizeof(segment_list[0]);
+        for(int gzip=0; gzip<2; ++gzip){
+            for(int j=0; j<segment_num; ++j){
+                replay(&case_list[i], body, body_len, gzip, segment_list[j]);
+            }
+        }
+        free(body);
+    }
+    return host_test_fail_num;
+}
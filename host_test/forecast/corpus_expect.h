@@ -0,0 +1,28 @@
+#ifndef CORPUS_EXPECT_H
+#define CORPUS_EXPECT_H
+
+// what the parser must make of corpus/openweather_forecast.json
+
+#include "device_common.h"
+#include "host_test.h"
+
+#include <string.h>
+
+static inline void check_openweather_forecast(void)
+{
+    static const char *description[FORECAST_LIST_SIZE] = {
+        "light rain", "light rain", "broken clouds", "moderate rain", "light snow",
+    };
+    static const int temp[FORECAST_LIST_SIZE] = { 2, 3, 6, 7, 0 };
+    static const int pop[FORECAST_LIST_SIZE] = { 20, 40, 0, 100, 50 };
+    service_data_t data;
+    device_get_service_data(&data);
+    TEST_CHECK(data.update_data_time != NO_DATA);
+    for(int i=0; i<FORECAST_LIST_SIZE; ++i){
+        TEST_CHECK(data.temp_list[i] == temp[i]);
+        TEST_CHECK(data.pop_list[i] == pop[i]);
+        TEST_CHECK(strcmp(data.desciption[i], description[i]) == 0);
+    }
+}
+
+#endif
@@ -0,0 +1,224 @@
+#include "http_standin.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define MAX_CONNECTIONS 16
+#define REQUEST_LEN     1024
+#define RESPONSE_LEN    (64*1024)
+
+
+static int listen_sock = -1;
+static int port;
+static pthread_t thread;
+static volatile bool stopping;
+static const standin_reply_t *replies;
+static int reply_count;
+static int connection_count;
+static size_t sent_len;
+static char requests[MAX_CONNECTIONS][REQUEST_LEN];
+static char resolved_host[256];
+
+static void *serve(void *arg);
+static void read_request(int sock, char *request);
+static size_t build_response(const standin_reply_t *reply, unsigned char *out);
+static void send_response(int sock, const standin_reply_t *reply, const unsigned char *data, size_t len);
+
+
+int standin_start(const standin_reply_t *reply_list, int reply_num)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addr_len = sizeof(addr);
+    const int on = 1;
+
+    replies = reply_list;
+    reply_count = reply_num;
+    connection_count = 0;
+    sent_len = 0;
+    stopping = false;
+    memset(requests, 0, sizeof(requests));
+    resolved_host[0] = 0;
+    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if(bind(listen_sock, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || listen(listen_sock, 4) != 0
+            || getsockname(listen_sock, (struct sockaddr *)&addr, &addr_len) != 0){
+        perror("standin");
+        close(listen_sock);
+        return -1;
+    }
+    port = ntohs(addr.sin_port);
+    pthread_create(&thread, NULL, serve, NULL);
+    return port;
+}
+
+void standin_stop(void)
+{
+    stopping = true;
+    shutdown(listen_sock, SHUT_RDWR);
+    pthread_join(thread, NULL);
+    close(listen_sock);
+    listen_sock = -1;
+}
+
+int standin_connection_num(void)
+{
+    return connection_count;
+}
+
+const char *standin_request(int index)
+{
+    return index < MAX_CONNECTIONS ? requests[index] : "";
+}
+
+const char *standin_host(void)
+{
+    return resolved_host;
+}
+
+size_t standin_sent(void)
+{
+    return sent_len;
+}
+
+char *standin_load(const char *name, size_t *len)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", CORPUS_DIR, name);
+    FILE *file = fopen(path, "rb");
+    if(file == NULL){
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(file, 0, SEEK_END);
+    *len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *data = malloc(*len + 1);
+    if(fread(data, 1, *len, file) != *len){
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    data[*len] = 0;
+    fclose(file);
+    return data;
+}
+
+size_t standin_gzip(const char *data, size_t len, unsigned char *out, size_t out_size)
+{
+    z_stream stream = { 0 };
+    // 16 added to the window bits asks zlib for the gzip wrapper
+    deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15+16, 8, Z_DEFAULT_STRATEGY);
+    stream.next_in = (unsigned char *)data;
+    stream.avail_in = len;
+    stream.next_out = out;
+    stream.avail_out = out_size;
+    deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+    return stream.total_out;
+}
+
+// the forecast client resolves the provider's host, every name leads here
+int __real_getaddrinfo(const char *node, const char *service,
+                        const struct addrinfo *hints, struct addrinfo **res);
+
+int __wrap_getaddrinfo(const char *node, const char *service,
+                        const struct addrinfo *hints, struct addrinfo **res)
+{
+    char port_str[8];
+    (void)service;
+    snprintf(resolved_host, sizeof(resolved_host), "%s", node);
+    snprintf(port_str, sizeof(port_str), "%d", port);
+    return __real_getaddrinfo("127.0.0.1", port_str, hints, res);
+}
+
+
+static void *serve(void *arg)
+{
+    static unsigned char response[RESPONSE_LEN];
+    (void)arg;
+    while(!stopping){
+        const int sock = accept(listen_sock, NULL, NULL);
+        if(sock < 0) break;
+        const int index = connection_count;
+        read_request(sock, index < MAX_CONNECTIONS ? requests[index] : NULL);
+        if(index < reply_count){
+            const size_t len = build_response(&replies[index], response);
+            send_response(sock, &replies[index], response, len);
+        }
+        close(sock);
+        connection_count = index + 1;
+        if(connection_count >= reply_count) break;
+    }
+    // the script is over, further connections are refused
+    shutdown(listen_sock, SHUT_RDWR);
+    return NULL;
+}
+
+static void read_request(int sock, char *request)
+{
+    char buf[REQUEST_LEN];
+    size_t len = 0;
+    ssize_t res;
+    while(len < sizeof(buf)-1 && (res = recv(sock, buf + len, sizeof(buf)-1-len, 0)) > 0){
+        len += res;
+        buf[len] = 0;
+        if(strstr(buf, "\r\n\r\n")) break;
+    }
+    buf[len] = 0;
+    if(request){
+        memcpy(request, buf, len+1);
+    }
+}
+
+static size_t build_response(const standin_reply_t *reply, unsigned char *out)
+{
+    static unsigned char body[RESPONSE_LEN];
+    size_t body_len = reply->body_len;
+    const unsigned char *body_ptr = (const unsigned char *)reply->body;
+    if(reply->gzip){
+        body_len = standin_gzip(reply->body, reply->body_len, body, sizeof(body));
+        if(reply->bad_crc){
+            body[body_len-8] ^= 0xff;
+        }
+        body_ptr = body;
+    }
+    int len = snprintf((char *)out, RESPONSE_LEN, "%s%sContent-Length: %zu\r\n\r\n",
+                    reply->head,
+                    reply->gzip ? "Content-Encoding: gzip\r\n" : "",
+                    body_len);
+    if(body_len){
+        memcpy(out + len, body_ptr, body_len);
+    }
+    return len + body_len;
+}
+
+static void send_response(int sock, const standin_reply_t *reply, const unsigned char *data, size_t len)
+{
+    if(reply->cut && reply->cut < len){
+        len = reply->cut;
+    }
+    const size_t segment = reply->segment ? reply->segment : len;
+    for(size_t pos = 0; pos < len; pos += segment){
+        const size_t part = len - pos < segment ? len - pos : segment;
+        if(send(sock, data + pos, part, MSG_NOSIGNAL) != (ssize_t)part) break;
+        sent_len += part;
+    }
+    if(reply->cut && reply->reset){
+        // let the client read what was sent, then a zero
+        // linger turns close() into a reset
+        usleep(50*1000);
+        const struct linger linger = { .l_onoff = 1, .l_linger = 0 };
+        setsockopt(sock, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+}
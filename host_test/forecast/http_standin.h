@@ -0,0 +1,42 @@
+#ifndef HTTP_STANDIN_H
+#define HTTP_STANDIN_H
+
+// local HTTP server the forecast client is pointed at, it answers each
+// connection with the next scripted reply and records the requests
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct {
+    // status line and headers, each ended with CRLF, without the blank line
+    const char *head;
+    const char *body;
+    size_t body_len;
+    // compress the body and announce Content-Encoding: gzip
+    bool gzip;
+    // corrupt the CRC32 of the gzip trailer
+    bool bad_crc;
+    // stop after this many bytes of the response, 0 sends everything
+    size_t cut;
+    // abort the connection with a reset at the cut instead of closing it
+    bool reset;
+    // send the response in writes of this size, 0 in one write
+    size_t segment;
+} standin_reply_t;
+
+// connections after the last reply are refused
+int standin_start(const standin_reply_t *reply_list, int reply_num);
+void standin_stop(void);
+
+int standin_connection_num(void);
+const char *standin_request(int index);
+// host name the client resolved last
+const char *standin_host(void);
+// total bytes written to the client
+size_t standin_sent(void);
+
+// reads a recorded response from the corpus, the caller frees it
+char *standin_load(const char *name, size_t *len);
+size_t standin_gzip(const char *data, size_t len, unsigned char *out, size_t out_size);
+
+#endif
@@ -0,0 +1,182 @@
+// update_forecast_data() against the local HTTP stand-in: plain and
+// gzip answers, revalidation and the failures a radio link produces
+
+#include "forecast_http_client.h"
+#include "device_common.h"
+#include "http_standin.h"
+#include "host_test.h"
+#include "corpus_expect.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CITY    "London"
+#define CITY_B  "Paris"
+#define API_KEY "0123456789abcdef0123456789abcdef"
+
+#define HEAD_OK \
+    "HTTP/1.1 200 OK\r\n" \
+    "Content-Type: application/json; charset=utf-8\r\n"
+
+#define HEAD_VALIDATED \
+    HEAD_OK \
+    "ETag: \"5f1d-forecast\"\r\n" \
+    "Last-Modified: Sun, 19 Oct 2025 12:00:00 GMT\r\n"
+
+#define HEAD_NOT_MODIFIED \
+    "HTTP/1.1 304 Not Modified\r\n" \
+    "ETag: \"5f1d-forecast\"\r\n"
+
+
+static char *forecast;
+static size_t forecast_len;
+
+static const service_data_t empty_data = {
+    .update_data_time = NO_DATA,
+};
+
+
+static bool fetch_city(const char *city, const standin_reply_t *reply_list, int reply_num)
+{
+    standin_start(reply_list, reply_num);
+    const bool res = update_forecast_data(city, API_KEY);
+    standin_stop();
+    return res;
+}
+
+static bool fetch(const standin_reply_t *reply_list, int reply_num)
+{
+    return fetch_city(CITY, reply_list, reply_num);
+}
+
+static void test_plain(void)
+{
+    const standin_reply_t reply = { .head = HEAD_OK, .body = forecast, .body_len = forecast_len };
+    device_publish_service_data(&empty_data);
+    TEST_CHECK(fetch(&reply, 1));
+    TEST_CHECK(strcmp(standin_host(), "api.openweathermap.org") == 0);
+    TEST_CHECK(strncmp(standin_request(0), "GET /data/2.5/forecast?q=" CITY "&units=metric&cnt=5&appid=" API_KEY " HTTP/1.0\r\n", 90) == 0);
+    TEST_CHECK(strstr(standin_request(0), "\r\nAccept-Encoding: gzip\r\n") != NULL);
+    // nothing held, nothing to revalidate
+    TEST_CHECK(strstr(standin_request(0), "If-None-Match") == NULL);
+    check_openweather_forecast();
+}
+
+static void test_gzip_segmented(void)
+{
+    const standin_reply_t reply = { 
+        .head = HEAD_VALIDATED, .body = forecast, .body_len = forecast_len, 
+        .gzip = true, .segment = 7,
+    };
+    device_publish_service_data(&empty_data);
+    TEST_CHECK(fetch(&reply, 1));
+    TEST_CHECK(standin_connection_num() == 1);
+    TEST_CHECK(get_forecast_stats()->last_body_len == forecast_len);
+    check_openweather_forecast();
+}
+
+static void test_not_modified(void)
+{
+    const standin_reply_t reply = { .head = HEAD_NOT_MODIFIED };
+    const unsigned not_modified_num = get_forecast_stats()->not_modified_num;
+    TEST_CHECK(fetch(&reply, 1));
+    TEST_CHECK(strstr(standin_request(0), "\r\nIf-None-Match: \"5f1d-forecast\"\r\n") != NULL);
+    TEST_CHECK(strstr(standin_request(0), "\r\nIf-Modified-Since: Sun, 19 Oct 2025 12:00:00 GMT\r\n") != NULL);
+    TEST_CHECK(get_forecast_stats()->not_modified_num == not_modified_num + 1);
+    check_openweather_forecast();
+}
+
+static void test_retry_after_reset(void)
+{
+    const standin_reply_t reply_list[] = {
+        { .head = HEAD_OK, .body = forecast, .body_len = forecast_len, .gzip = true, .cut = 300, .reset = true },
+        { .head = HEAD_OK, .body = forecast, .body_len = forecast_len, .gzip = true },
+    };
+    device_publish_service_data(&empty_data);
+    TEST_CHECK(fetch(reply_list, 2));
+    TEST_CHECK(standin_connection_num() == 2);
+    check_openweather_forecast();
+}
+
+static void test_bad_crc(void)
+{
+    const standin_reply_t reply = { 
+        .head = HEAD_OK, .body = forecast, .body_len = forecast_len, 
+        .gzip = true, .bad_crc = true,
+    };
+    device_publish_service_data(&empty_data);
+    TEST_CHECK(!fetch(&reply, 1));
+    service_data_t data;
+    device_get_service_data(&data);
+    TEST_CHECK(data.update_data_time == NO_DATA);
+}
+
+static void test_truncated_gzip(void)
+{
+    const standin_reply_t reply = { 
+        .head = HEAD_OK, .body = forecast, .body_len = forecast_len, 
+        .gzip = true, .cut = 400,
+    };
+    device_publish_service_data(&empty_data);
+    TEST_CHECK(!fetch(&reply, 1));
+}
+
+// the validators of one city are not sent for another, a 304 it gets
+// anyway does not keep the old city's forecast
+static void test_city_change(void)
+{
+    const standin_reply_t reply = { .head = HEAD_VALIDATED, .body = forecast, .body_len = forecast_len };
+    const standin_reply_t not_modified = { .head = HEAD_NOT_MODIFIED };
+    service_data_t data;
+    device_publish_service_data(&empty_data);
+    TEST_CHECK(fetch(&reply, 1));
+    TEST_CHECK(!fetch_city(CITY_B, &not_modified, 1));
+    TEST_CHECK(strstr(standin_request(0), "q=" CITY_B "&") != NULL);
+    TEST_CHECK(strstr(standin_request(0), "If-Modified-Since") == NULL);
+    TEST_CHECK(strstr(standin_request(0), "If-None-Match") == NULL);
+    device_get_service_data(&data);
+    TEST_CHECK(data.update_data_time == NO_DATA);
+    // and once the new city is held, its own validators go back
+    TEST_CHECK(fetch_city(CITY_B, &reply, 1));
+    TEST_CHECK(fetch_city(CITY_B, &not_modified, 1));
+    TEST_CHECK(strstr(standin_request(0), "\r\nIf-Modified-Since: Sun, 19 Oct 2025 12:00:00 GMT\r\n") != NULL);
+}
+
+// a 304 status line read before a failed attempt is not an answer
+static void test_stale_not_modified(void)
+{
+    const standin_reply_t reset_reply = { .head = HEAD_NOT_MODIFIED, .cut = 30, .reset = true };
+    const standin_reply_t closed_reply = { .head = HEAD_NOT_MODIFIED, .cut = 30 };
+    const unsigned not_modified_num = get_forecast_stats()->not_modified_num;
+    TEST_CHECK(!fetch(&reset_reply, 1));
+    TEST_CHECK(!fetch(&closed_reply, 1));
+    TEST_CHECK(get_forecast_stats()->not_modified_num == not_modified_num);
+}
+
+static void test_error_body(void)
+{
+    size_t len;
+    char *body = standin_load("openweather_error.json", &len);
+    const standin_reply_t reply = { .head = "HTTP/1.1 401 Unauthorized\r\n", .body = body, .body_len = len };
+    TEST_CHECK(!fetch(&reply, 1));
+    TEST_CHECK(standin_connection_num() == 1);
+    free(body);
+}
+
+
+int main(void)
+{
+    forecast = standin_load("openweather_forecast.json", &forecast_len);
+    net_arena_init();
+    TEST_RUN(test_plain);
+    TEST_RUN(test_gzip_segmented);
+    TEST_RUN(test_not_modified);
+    TEST_RUN(test_retry_after_reset);
+    TEST_RUN(test_bad_crc);
+    TEST_RUN(test_truncated_gzip);
+    TEST_RUN(test_stale_not_modified);
+    TEST_RUN(test_city_change);
+    TEST_RUN(test_error_body);
+    free(forecast);
+    return host_test_fail_num;
+}
@@ -0,0 +1,121 @@
+// the Open-Meteo provider end to end: the client built with
+// CONFIG_WEATHER_PROVIDER_OPENMETEO against the local stand-in
+
+#include "forecast_http_client.h"
+#include "weather_provider.h"
+#include "device_common.h"
+#include "http_standin.h"
+#include "host_test.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define CITY "51.5085,-0.1257"
+
+#define HEAD_OK \
+    "HTTP/1.1 200 OK\r\n" \
+    "Content-Type: application/json; charset=utf-8\r\n"
+
+
+static char *forecast;
+static size_t forecast_len;
+
+static const service_data_t empty_data = {
+    .update_data_time = NO_DATA,
+};
+
+
+static bool fetch(const char *city, const standin_reply_t *reply_list, int reply_num)
+{
+    standin_start(reply_list, reply_num);
+    const bool res = update_forecast_data(city, "");
+    standin_stop();
+    return res;
+}
+
+static void check_forecast(void)
+{
+    static const char *description[FORECAST_LIST_SIZE] = {
+        "light rain", "light rain", "overcast clouds", "moderate rain", "light snow",
+    };
+    static const int temp[FORECAST_LIST_SIZE] = { 2, 3, 6, 7, 0 };
+    static const int pop[FORECAST_LIST_SIZE] = { 20, 40, 0, 100, 50 };
+    service_data_t data;
+    device_get_service_data(&data);
+    TEST_CHECK(data.update_data_time != NO_DATA);
+    for(int i=0; i<FORECAST_LIST_SIZE; ++i){
+        TEST_CHECK(data.temp_list[i] == temp[i]);
+        TEST_CHECK(data.pop_list[i] == pop[i]);
+        TEST_CHECK(strcmp(data.desciption[i], description[i]) == 0);
+    }
+}
+
+
+static void test_request(void)
+{
+    const standin_reply_t reply = { .head = HEAD_OK, .body = forecast, .body_len = forecast_len };
+    device_publish_service_data(&empty_data);
+    TEST_CHECK(fetch(CITY, &reply, 1));
+    TEST_CHECK(strcmp(get_weather_provider()->name, "Open-Meteo") == 0);
+    TEST_CHECK(strcmp(standin_host(), "api.open-meteo.com") == 0);
+    TEST_CHECK(strstr(standin_request(0), "GET /v1/forecast?latitude=51.5085&longitude=-0.1257&hourly=") == standin_request(0));
+    TEST_CHECK(strstr(standin_request(0), "&forecast_hours=13&") != NULL);
+    check_forecast();
+}
+
+static void test_gzip(void)
+{
+    const standin_reply_t reply = { 
+        .head = HEAD_OK, .body = forecast, .body_len = forecast_len, 
+        .gzip = true, .segment = 64,
+    };
+    device_publish_service_data(&empty_data);
+    TEST_CHECK(fetch(CITY, &reply, 1));
+    check_forecast();
+}
+
+static void test_missing_series(void)
+{
+    static const char body[] = "{\"error\":true,\"reason\":\"Latitude must be in range of -90 to 90\"}";
+    const standin_reply_t reply = { .head = HEAD_OK, .body = body, .body_len = sizeof(body)-1 };
+    device_publish_service_data(&empty_data);
+    TEST_CHECK(!fetch(CITY, &reply, 1));
+}
+
+// a City without coordinates never reaches the network
+static void test_city_name(void)
+{
+    TEST_CHECK(!fetch("London", NULL, 0));
+    TEST_CHECK(standin_connection_num() == 0);
+}
+
+static void test_check_city(void)
+{
+    TEST_CHECK(weather_provider_check_city(CITY));
+    TEST_CHECK(weather_provider_check_city("-33.8688,151.2093"));
+    TEST_CHECK(weather_provider_check_city("90,-180"));
+    TEST_CHECK(weather_provider_check_city(""));
+    TEST_CHECK(!weather_provider_check_city("London"));
+    TEST_CHECK(!weather_provider_check_city("51.5085"));
+    TEST_CHECK(!weather_provider_check_city("51.5085,"));
+    TEST_CHECK(!weather_provider_check_city(",-0.1257"));
+    TEST_CHECK(!weather_provider_check_city("51.5085, -0.1257"));
+    TEST_CHECK(!weather_provider_check_city("91,0"));
+    TEST_CHECK(!weather_provider_check_city("0,180.5"));
+    TEST_CHECK(!weather_provider_check_city("1,2,3"));
+    TEST_CHECK(!weather_provider_check_city("51.5085,-0.1257&x=1"));
+}
+
+
+int main(void)
+{
+    forecast = standin_load("openmeteo_forecast.json", &forecast_len);
+    net_arena_init();
+    TEST_RUN(test_request);
+    TEST_RUN(test_gzip);
+    TEST_RUN(test_missing_series);
+    TEST_RUN(test_city_name);
+    TEST_RUN(test_check_city);
+    free(forecast);
+    return host_test_fail_num;
+}
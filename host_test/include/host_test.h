@@ -0,0 +1,26 @@
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+// minimal checks for the host tests, a test program returns
+// the number of failed checks
+
+#include <stdio.h>
+
+extern int host_test_fail_num;
+
+#define TEST_CHECK(cond_) \
+    do{ \
+        if(!(cond_)){ \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond_); \
+            host_test_fail_num += 1; \
+        } \
+    }while(0)
+
+#define TEST_RUN(test_) \
+    do{ \
+        const int fail_num_ = host_test_fail_num; \
+        test_(); \
+        printf("%-40s %s\n", #test_, fail_num_ == host_test_fail_num ? "ok" : "FAILED"); \
+    }while(0)
+
+#endif
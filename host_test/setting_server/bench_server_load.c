@@ -0,0 +1,430 @@
+// load on the settings server as a phone or laptop in the portal produces it:
+// browser config sessions, captive portal probes and malformed bodies run at
+// once against the real handlers behind the esp_http_server shim; prints the
+// client latency percentiles per scenario, the server's own route table,
+// the peak heap and the handler errors
+
+#define _GNU_SOURCE
+#include "setting_server.h"
+#include "device_common.h"
+#include "esp_http_server.h"
+#include "server_fakes.h"
+#include "host_test.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define SESSION_CLIENT_NUM  2
+#define SESSION_NUM         15
+#define SESSION_REQUEST_NUM 13
+#define PROBE_CLIENT_NUM    3
+#define PROBE_NUM           60
+#define MALFORMED_NUM       10
+// malformed requests per round that reach a handler and fail there
+#define HANDLER_ERROR_NUM   8
+#define SAMPLE_MAX          1024
+#define RESP_LEN            (32*1024)
+#define REQ_LEN             (8*1024)
+#define API_KEY             "0123456789abcdef0123456789abcdef"
+
+typedef struct {
+    const char *name;
+    pthread_mutex_t lock;
+    unsigned latency_us[SAMPLE_MAX];
+    unsigned sample_num;
+    unsigned unexpected_num;
+} scenario_t;
+
+typedef struct {
+    int status;
+    char head[1024];
+    char body[RESP_LEN + 1];
+    size_t body_len;
+} http_resp_t;
+
+typedef struct {
+    const char *method;
+    const char *path;
+    const char *headers;
+    const char *body;
+    // declared length when the body is cut short, 0 for the real one
+    size_t content_len;
+    bool keep_alive;
+    bool shut_write;
+} http_req_t;
+
+static uint16_t server_port;
+
+static scenario_t sessions = { .name = "config session", .lock = PTHREAD_MUTEX_INITIALIZER };
+static scenario_t probes = { .name = "portal probe", .lock = PTHREAD_MUTEX_INITIALIZER };
+static scenario_t malformed = { .name = "malformed body", .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+static int64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static int connect_server(void)
+{
+    const struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(server_port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    const struct timeval timeout = { .tv_sec = 10 };
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if(connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) != 0){
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool send_all(int fd, const char *data, size_t len)
+{
+    while(len > 0){
+        const ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if(sent <= 0) return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+static bool read_more(int fd, char *buf, size_t *len, size_t size)
+{
+    if(*len == size) return false;
+    const ssize_t received = recv(fd, buf + *len, size - *len, 0);
+    if(received <= 0) return false;
+    *len += received;
+    return true;
+}
+
+// the body after the head, de-chunked in place; false until all of it is there
+static bool take_body(char *data, size_t len, bool chunked, long content_len, http_resp_t *resp)
+{
+    if(!chunked){
+        if(content_len < 0 || len < content_len) return false;
+        memcpy(resp->body, data, content_len);
+        resp->body_len = content_len;
+        return true;
+    }
+    resp->body_len = 0;
+    for(size_t pos = 0;;){
+        char *line_end = memmem(data + pos, len - pos, "\r\n", 2);
+        if(line_end == NULL) return false;
+        const size_t chunk_len = strtoul(data + pos, NULL, 16);
+        const size_t chunk_start = line_end + 2 - data;
+        if(len < chunk_start + chunk_len + 2) return false;
+        if(chunk_len == 0) return true;
+        memcpy(resp->body + resp->body_len, data + chunk_start, chunk_len);
+        resp->body_len += chunk_len;
+        pos = chunk_start + chunk_len + 2;
+    }
+}
+
+static bool get_header(const http_resp_t *resp, const char *field, char *value, size_t size)
+{
+    const size_t field_len = strlen(field);
+    for(const char *line = strstr(resp->head, "\r\n"); line && line[2]; line = strstr(line + 2, "\r\n")){
+        if(strncasecmp(line + 2, field, field_len) != 0 || line[2 + field_len] != ':') continue;
+        const char *start = line + 3 + field_len;
+        while(*start == ' ') ++start;
+        const size_t len = strcspn(start, "\r");
+        if(len >= size) return false;
+        memcpy(value, start, len);
+        value[len] = 0;
+        return true;
+    }
+    return false;
+}
+
+// one exchange on *fd, connecting first when it is closed; the status or -1
+static int http_exchange(int *fd, const http_req_t *req, http_resp_t *resp)
+{
+    static __thread char buf[RESP_LEN + 1024];
+    char request[REQ_LEN];
+    const size_t body_len = req->body ? strlen(req->body) : 0;
+    size_t len = 0;
+    char *head_end, value[32];
+
+    resp->status = -1;
+    resp->body_len = 0;
+    if(*fd < 0 && (*fd = connect_server()) < 0) return -1;
+    int request_len = snprintf(request, sizeof(request),
+                    "%s %s HTTP/1.1\r\nHost: 192.168.4.1\r\n%sContent-Length: %zu\r\n%s\r\n",
+                    req->method, req->path, req->headers ? req->headers : "",
+                    req->content_len ? req->content_len : body_len,
+                    req->keep_alive ? "" : "Connection: close\r\n");
+    if(body_len) request_len += snprintf(request + request_len, sizeof(request) - request_len, "%s", req->body);
+    if(!send_all(*fd, request, request_len)) goto closed;
+    if(req->shut_write) shutdown(*fd, SHUT_WR);
+
+    while((head_end = memmem(buf, len, "\r\n\r\n", 4)) == NULL){
+        if(!read_more(*fd, buf, &len, sizeof(buf))) goto closed;
+    }
+    const size_t head_len = head_end + 4 - buf;
+    const size_t head_copy_len = head_len < sizeof(resp->head) ? head_len : sizeof(resp->head) - 1;
+    memcpy(resp->head, buf, head_copy_len);
+    resp->head[head_copy_len] = 0;
+    resp->status = atoi(resp->head + strlen("HTTP/1.1 "));
+    const bool chunked = get_header(resp, "Transfer-Encoding", value, sizeof(value));
+    const long content_len = get_header(resp, "Content-Length", value, sizeof(value)) ? atol(value) : -1;
+    while(!take_body(buf + head_len, len - head_len, chunked, content_len, resp)){
+        if(!read_more(*fd, buf, &len, sizeof(buf))){
+            resp->status = -1;
+            goto closed;
+        }
+    }
+    if(!req->keep_alive || (get_header(resp, "Connection", value, sizeof(value))
+                                && strcasecmp(value, "close") == 0)){
+        close(*fd);
+        *fd = -1;
+    }
+    return resp->status;
+
+closed:
+    close(*fd);
+    *fd = -1;
+    return resp->status;
+}
+
+static void record(scenario_t *scenario, int64_t start_us, bool expected)
+{
+    const unsigned elapsed_us = now_us() - start_us;
+    pthread_mutex_lock(&scenario->lock);
+    if(scenario->sample_num < SAMPLE_MAX){
+        scenario->latency_us[scenario->sample_num++] = elapsed_us;
+    }
+    if(!expected) scenario->unexpected_num += 1;
+    pthread_mutex_unlock(&scenario->lock);
+}
+
+// one request against its expected status, timed from send to the last byte
+static bool run(scenario_t *scenario, int *fd, const http_req_t *req, int expect_status, http_resp_t *resp)
+{
+    const int64_t start_us = now_us();
+    const int status = http_exchange(fd, req, resp);
+    const bool expected = status == expect_status;
+    if(!expected){
+        fprintf(stderr, "%s: %s %s gave %d, expected %d\n", scenario->name,
+                    req->method, req->path, status, expect_status);
+    }
+    record(scenario, start_us, expected);
+    return expected;
+}
+
+
+// a browser on the settings page, one keep-alive connection per visit
+static void *session_client(void *arg)
+{
+    const int client = (int)(intptr_t)arg;
+    // on the stack, the heap counts only what the server takes
+    http_resp_t resp_buf, *resp = &resp_buf;
+    char etag[32] = "", if_none_match[64], network[96], loud[8];
+    for(int i=0; i<SESSION_NUM; ++i){
+        int fd = -1;
+        const http_req_t page = { "GET", "/", .keep_alive = true };
+        if(run(&sessions, &fd, &page, 200, resp)){
+            TEST_CHECK(resp->body_len > 2 && (uint8_t)resp->body[0] == 0x1f && (uint8_t)resp->body[1] == 0x8b);
+            get_header(resp, "ETag", etag, sizeof(etag));
+        }
+        run(&sessions, &fd, &(http_req_t){ "GET", "/style.css", .keep_alive = true }, 200, resp);
+        run(&sessions, &fd, &(http_req_t){ "GET", "/script.js", .keep_alive = true }, 200, resp);
+        if(run(&sessions, &fd, &(http_req_t){ "POST", "/data", .keep_alive = true }, 200, resp)){
+            resp->body[resp->body_len] = 0;
+            TEST_CHECK(strstr(resp->body, "\"SSID\"") != NULL);
+        }
+        snprintf(if_none_match, sizeof(if_none_match), "If-None-Match: %s\r\n", etag);
+        run(&sessions, &fd, &(http_req_t){ "GET", "/", if_none_match, .keep_alive = true }, 304, resp);
+
+        snprintf(network, sizeof(network), "{\"SSID\":\"net%d-%d\",\"PWD\":\"secret%d\"}", client, i, i);
+        run(&sessions, &fd, &(http_req_t){ "POST", "/Network", .body = network, .keep_alive = true }, 200, resp);
+        run(&sessions, &fd, &(http_req_t){ "POST", "/Notification",
+                    .body = "{\"schema\":\"01000000000000\",\"notif\":\"1e0\"}", .keep_alive = true }, 200, resp);
+        run(&sessions, &fd, &(http_req_t){ "POST", "/Offset", .body = "3", .keep_alive = true }, 200, resp);
+        snprintf(loud, sizeof(loud), "%d", 30 + i);
+        run(&sessions, &fd, &(http_req_t){ "POST", "/Loud", .body = loud, .keep_alive = true }, 200, resp);
+        run(&sessions, &fd, &(http_req_t){ "POST", "/time", .body = "1760000000000", .keep_alive = true }, 200, resp);
+        run(&sessions, &fd, &(http_req_t){ "POST", "/config", .keep_alive = true,
+                    .body = "{\"SSID\":\"home\",\"PWD\":\"password\",\"City\":\"London\","
+                            "\"Key\":\"" API_KEY "\",\"Hour\":2,\"%\":50,\"Status\":1,"
+                            "\"schema\":\"02010000000000\",\"notif\":\"1e04b0258\"}" }, 200, resp);
+        if(run(&sessions, &fd, &(http_req_t){ "GET", "/metrics", .keep_alive = true }, 200, resp)){
+            resp->body[resp->body_len] = 0;
+            TEST_CHECK(strstr(resp->body, "device_http_requests_total{path=\"/config\"}") != NULL);
+            TEST_CHECK(strstr(resp->body, "device_wifi_connect_seconds 2.21\n") != NULL);
+        }
+        if(run(&sessions, &fd, &(http_req_t){ "GET", "/live", .keep_alive = true }, 200, resp)){
+            TEST_CHECK(strncmp(resp->body, "retry: ", 7) == 0);
+        }
+        if(fd >= 0) close(fd);
+    }
+    return NULL;
+}
+
+// connectivity checks of phones and laptops, a new connection each
+static void *probe_client(void *arg)
+{
+    static const char *probe_paths[] = {
+        "/generate_204", "/gen_204", "/hotspot-detect.html",
+        "/connecttest.txt", "/ncsi.txt", "/success.txt?ipv4",
+    };
+    const int client = (int)(intptr_t)arg;
+    http_resp_t resp_buf, *resp = &resp_buf;
+    char location[64];
+    for(int i=0; i<PROBE_NUM; ++i){
+        int fd = -1;
+        const char *path = probe_paths[(client + i) % (sizeof(probe_paths)/sizeof(probe_paths[0]))];
+        if(run(&probes, &fd, &(http_req_t){ "GET", path }, 302, resp)){
+            TEST_CHECK(get_header(resp, "Location", location, sizeof(location))
+                        && strcmp(location, "http://192.168.4.1/") == 0);
+        }
+    }
+    return NULL;
+}
+
+// bodies and headers the handlers must turn down without touching the settings
+static void *malformed_client(void *arg)
+{
+    http_resp_t resp_buf, *resp = &resp_buf;
+    char pad[700];
+    memset(pad, 'a', sizeof(pad));
+    memcpy(pad, "X-Pad: ", 7);
+    memcpy(pad + sizeof(pad) - 3, "\r\n", 3);
+    for(int i=0; i<MALFORMED_NUM; ++i){
+        const http_req_t cases[] = {
+            { "POST", "/config", .body = "{\"SSID\":\"home\",\"PWD\":" },
+            { "POST", "/config", .body = "{\"Hour\":\"x\"}" },
+            { "POST", "/config", .body = "{\"schema\":\"01000000000000\",\"notif\":\"\"}" },
+            { "POST", "/config", .body = "{\"Key\":\"short\"}" },
+            { "POST", "/Notification", .body = "{\"schema\":\"1x000000000000\",\"notif\":\"1e0\"}" },
+            { "POST", "/Offset", .body = "abc" },
+            { "POST", "/Loud", .body = "100" },
+            // the client goes away after the first bytes
+            { "POST", "/config", .body = "{\"SSID\":\"abcdefghij", .content_len = 200, .shut_write = true },
+        };
+        for(int c=0; c<sizeof(cases)/sizeof(cases[0]); ++c){
+            int fd = -1;
+            run(&malformed, &fd, &cases[c], cases[c].shut_write ? 408 : 400, resp);
+        }
+        int fd = -1;
+        // refused by its length before the handler runs
+        run(&malformed, &fd, &(http_req_t){ "POST", "/config", .content_len = 100000 }, 400, resp);
+        run(&malformed, &fd, &(http_req_t){ "POST", "/nope" }, 404, resp);
+        run(&malformed, &fd, &(http_req_t){ "GET", "/", pad }, 431, resp);
+    }
+    return NULL;
+}
+
+
+static int compare_unsigned(const void *a, const void *b)
+{
+    const unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_scenario(scenario_t *scenario)
+{
+    const unsigned n = scenario->sample_num;
+    unsigned *s = scenario->latency_us;
+    qsort(s, n, sizeof(unsigned), compare_unsigned);
+    printf("%-16s %8u %10u %9.2f %9.2f %9.2f %9.2f\n", scenario->name, n, scenario->unexpected_num,
+                n ? s[(n-1)*50/100]/1000.0 : 0, n ? s[(n-1)*90/100]/1000.0 : 0,
+                n ? s[(n-1)*99/100]/1000.0 : 0, n ? s[n-1]/1000.0 : 0);
+}
+
+static void print_server_stats(unsigned *request_num, unsigned *error_num)
+{
+    size_t route_num;
+    const server_route_stats_t *routes = server_get_route_stats(&route_num);
+    const server_stats_t *stats = server_get_stats();
+    *request_num = *error_num = 0;
+    printf("\n%-16s %8s %10s %9s %9s\n", "route", "requests", "errors", "avg ms", "max ms");
+    for(size_t i=0; i<route_num; ++i){
+        if(routes[i].request_num == 0) continue;
+        printf("%-16s %8u %10u %9.2f %9.2f\n", routes[i].path, routes[i].request_num, routes[i].error_num,
+                    routes[i].total_us/1000.0/routes[i].request_num, routes[i].max_us/1000.0);
+        *request_num += routes[i].request_num;
+        *error_num += routes[i].error_num;
+    }
+    printf("unmatched %u, rejected by length %u\nhandler time buckets:",
+                stats->unmatched_num, stats->rejected_num);
+    for(int i=0; i<SERVER_LATENCY_BUCKET_NUM; ++i){
+        if(i < SERVER_LATENCY_BUCKET_NUM-1) printf(" <=%ums:%u", stats->latency_le_us[i]/1000, stats->latency_bucket[i]);
+        else printf(" more:%u", stats->latency_bucket[i]);
+    }
+    printf("\n");
+}
+
+int main(void)
+{
+    pthread_t threads[SESSION_CLIENT_NUM + PROBE_CLIENT_NUM + 1];
+    size_t thread_num = 0;
+
+    device_fake_reset();
+    net_arena_init();
+    const size_t heap_base = host_heap_get_used();
+    TEST_CHECK(init_server() == ESP_OK);
+    server_port = httpd_shim_get_port();
+    host_heap_reset_peak();
+
+    const int64_t start_us = now_us();
+    for(int i=0; i<SESSION_CLIENT_NUM; ++i){
+        pthread_create(&threads[thread_num++], NULL, session_client, (void *)(intptr_t)i);
+    }
+    for(int i=0; i<PROBE_CLIENT_NUM; ++i){
+        pthread_create(&threads[thread_num++], NULL, probe_client, (void *)(intptr_t)i);
+    }
+    pthread_create(&threads[thread_num++], NULL, malformed_client, NULL);
+    for(size_t i=0; i<thread_num; ++i){
+        pthread_join(threads[i], NULL);
+    }
+    const double elapsed_s = (now_us() - start_us) / 1000000.0;
+
+    int fd = -1;
+    http_resp_t resp_buf, *resp = &resp_buf;
+    TEST_CHECK(http_exchange(&fd, &(http_req_t){ "POST", "/close" }, resp) == 200);
+    TEST_CHECK(device_get_state() & BIT_SERVER_STOP);
+
+    printf("%-16s %8s %10s %9s %9s %9s %9s\n", "scenario", "requests", "unexpected", "p50 ms", "p90 ms", "p99 ms", "max ms");
+    print_scenario(&sessions);
+    print_scenario(&probes);
+    print_scenario(&malformed);
+    unsigned request_num, error_num;
+    print_server_stats(&request_num, &error_num);
+    const size_t heap_peak = host_heap_get_peak() - heap_base;
+    printf("%.2f s, peak heap %zu B above start, handler errors %u\n", elapsed_s, heap_peak, error_num);
+
+    const server_stats_t *stats = server_get_stats();
+    TEST_CHECK(sessions.unexpected_num == 0);
+    TEST_CHECK(probes.unexpected_num == 0);
+    TEST_CHECK(malformed.unexpected_num == 0);
+    TEST_CHECK(error_num == MALFORMED_NUM*HANDLER_ERROR_NUM);
+    TEST_CHECK(request_num == SESSION_CLIENT_NUM*SESSION_NUM*SESSION_REQUEST_NUM
+                                + MALFORMED_NUM*HANDLER_ERROR_NUM + 1);
+    TEST_CHECK(stats->rejected_num == MALFORMED_NUM);
+    TEST_CHECK(stats->unmatched_num == PROBE_CLIENT_NUM*PROBE_NUM + MALFORMED_NUM);
+    TEST_CHECK(device_fake_get_commit_num() == SESSION_CLIENT_NUM*SESSION_NUM);
+    // only the whole form sets these, a malformed body leaves nothing behind
+    TEST_CHECK(strcmp(device_get_api_key(), API_KEY) == 0);
+    TEST_CHECK(strcmp(device_get_city_name(), "London") == 0);
+
+    TEST_CHECK(deinit_server() == ESP_OK);
+    device_fake_reset();
+    TEST_CHECK(host_heap_get_used() == heap_base);
+    return host_test_fail_num;
+}
@@ -0,0 +1,469 @@
+#include "esp_http_server.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "esp_log.h"
+
+#define SHIM_MAX_SOCKETS 16
+#define SHIM_MAX_HANDLERS 16
+#define SHIM_MAX_RESP_HDRS 8
+#define SHIM_RESP_HDR_LEN 1024
+
+static const char *TAG = "httpd_shim";
+static volatile uint16_t last_port;
+
+typedef struct {
+    int fd;
+    // bytes read past the request header, the start of the body
+    char pending[HTTPD_MAX_REQ_HDR_LEN];
+    size_t pending_len;
+} shim_conn_t;
+
+typedef struct {
+    const char *field;
+    const char *value;
+} shim_hdr_t;
+
+typedef struct {
+    shim_conn_t *conn;
+    size_t remaining;
+    char hdr[HTTPD_MAX_REQ_HDR_LEN + 1];
+    const char *status;
+    const char *type;
+    shim_hdr_t resp_hdr[SHIM_MAX_RESP_HDRS];
+    size_t resp_hdr_num;
+    bool chunked;
+    bool keep_alive;
+} shim_aux_t;
+
+typedef struct {
+    httpd_config_t config;
+    httpd_uri_t handlers[SHIM_MAX_HANDLERS];
+    size_t handler_num;
+    int listen_fd;
+    int stop_pipe[2];
+    uint16_t port;
+    pthread_t thread;
+    shim_conn_t conns[SHIM_MAX_SOCKETS];
+} shim_server_t;
+
+
+static void *server_thread(void *arg);
+static void serve_request(shim_server_t *srv, shim_conn_t *conn);
+static void close_conn(shim_conn_t *conn);
+static int send_all(int fd, const char *data, size_t len);
+static int send_head(httpd_req_t *r, const char *length_line);
+static void send_raw_err(int fd, const char *status);
+
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    socklen_t addr_len = sizeof(addr);
+    const int one = 1;
+    shim_server_t *srv = calloc(1, sizeof(shim_server_t));
+    if(srv == NULL) return ESP_ERR_NO_MEM;
+    srv->config = *config;
+    if(srv->config.max_open_sockets > SHIM_MAX_SOCKETS){
+        srv->config.max_open_sockets = SHIM_MAX_SOCKETS;
+    }
+    for(int i=0; i<SHIM_MAX_SOCKETS; ++i){
+        srv->conns[i].fd = -1;
+    }
+    srv->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(srv->listen_fd < 0
+            || setsockopt(srv->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0
+            || bind(srv->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || listen(srv->listen_fd, SHIM_MAX_SOCKETS) != 0
+            || getsockname(srv->listen_fd, (struct sockaddr *)&addr, &addr_len) != 0
+            || pipe(srv->stop_pipe) != 0){
+        ESP_LOGE(TAG, "listen: %s", strerror(errno));
+        if(srv->listen_fd >= 0) close(srv->listen_fd);
+        free(srv);
+        return ESP_FAIL;
+    }
+    srv->port = ntohs(addr.sin_port);
+    if(pthread_create(&srv->thread, NULL, server_thread, srv) != 0){
+        close(srv->listen_fd);
+        close(srv->stop_pipe[0]);
+        close(srv->stop_pipe[1]);
+        free(srv);
+        return ESP_FAIL;
+    }
+    *handle = srv;
+    last_port = srv->port;
+    return ESP_OK;
+}
+
+// like the device, returns once the server thread is gone
+esp_err_t httpd_stop(httpd_handle_t handle)
+{
+    shim_server_t *srv = (shim_server_t *)handle;
+    if(srv == NULL) return ESP_ERR_INVALID_ARG;
+    if(write(srv->stop_pipe[1], "", 1) != 1) return ESP_FAIL;
+    pthread_join(srv->thread, NULL);
+    if(last_port == srv->port) last_port = 0;
+    for(int i=0; i<SHIM_MAX_SOCKETS; ++i){
+        close_conn(&srv->conns[i]);
+    }
+    close(srv->listen_fd);
+    close(srv->stop_pipe[0]);
+    close(srv->stop_pipe[1]);
+    free(srv);
+    return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle, const httpd_uri_t *uri_handler)
+{
+    shim_server_t *srv = (shim_server_t *)handle;
+    if(srv->handler_num == srv->config.max_uri_handlers || srv->handler_num == SHIM_MAX_HANDLERS){
+        return ESP_ERR_NO_MEM;
+    }
+    srv->handlers[srv->handler_num++] = *uri_handler;
+    return ESP_OK;
+}
+
+uint16_t httpd_shim_get_port(void)
+{
+    return last_port;
+}
+
+
+static void *server_thread(void *arg)
+{
+    shim_server_t *srv = (shim_server_t *)arg;
+    for(;;){
+        fd_set read_set;
+        int max_fd = srv->stop_pipe[0] > srv->listen_fd ? srv->stop_pipe[0] : srv->listen_fd;
+        FD_ZERO(&read_set);
+        FD_SET(srv->stop_pipe[0], &read_set);
+        FD_SET(srv->listen_fd, &read_set);
+        for(int i=0; i<srv->config.max_open_sockets; ++i){
+            if(srv->conns[i].fd < 0) continue;
+            FD_SET(srv->conns[i].fd, &read_set);
+            if(srv->conns[i].fd > max_fd) max_fd = srv->conns[i].fd;
+        }
+        if(select(max_fd + 1, &read_set, NULL, NULL, NULL) < 0){
+            if(errno == EINTR) continue;
+            break;
+        }
+        if(FD_ISSET(srv->stop_pipe[0], &read_set)) break;
+        // open sessions first, a closed one frees its slot for the next accept
+        for(int i=0; i<srv->config.max_open_sockets; ++i){
+            if(srv->conns[i].fd >= 0 && FD_ISSET(srv->conns[i].fd, &read_set)){
+                serve_request(srv, &srv->conns[i]);
+            }
+        }
+        if(FD_ISSET(srv->listen_fd, &read_set)){
+            const int fd = accept(srv->listen_fd, NULL, NULL);
+            if(fd < 0) continue;
+            shim_conn_t *conn = NULL;
+            for(int i=0; i<srv->config.max_open_sockets && conn == NULL; ++i){
+                if(srv->conns[i].fd < 0) conn = &srv->conns[i];
+            }
+            if(conn == NULL){
+                // no LRU purge, as with the default config
+                ESP_LOGW(TAG, "no free session, closing %d", fd);
+                close(fd);
+                continue;
+            }
+            const struct timeval recv_timeout = { .tv_sec = srv->config.recv_wait_timeout };
+            const struct timeval send_timeout = { .tv_sec = srv->config.send_wait_timeout };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout, sizeof(recv_timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+            conn->fd = fd;
+            conn->pending_len = 0;
+        }
+    }
+    return NULL;
+}
+
+// what the client already sent is read first, closing over unread data
+// would reset the connection before the client sees the reply
+static void close_conn(shim_conn_t *conn)
+{
+    char drop[256];
+    if(conn->fd < 0) return;
+    while(recv(conn->fd, drop, sizeof(drop), MSG_DONTWAIT) > 0){
+    }
+    close(conn->fd);
+    conn->fd = -1;
+    conn->pending_len = 0;
+}
+
+static int parse_method(const char *name)
+{
+    static const struct { const char *name; httpd_method_t method; } methods[] = {
+        { "DELETE", HTTP_DELETE }, { "GET", HTTP_GET }, { "HEAD", HTTP_HEAD },
+        { "POST", HTTP_POST }, { "PUT", HTTP_PUT },
+    };
+    for(int i=0; i<sizeof(methods)/sizeof(methods[0]); ++i){
+        if(strcmp(name, methods[i].name) == 0) return methods[i].method;
+    }
+    return -1;
+}
+
+// reads one request header, then runs the handler registered for it
+static void serve_request(shim_server_t *srv, shim_conn_t *conn)
+{
+    httpd_req_t req = { .handle = srv };
+    shim_aux_t aux = { .conn = conn, .keep_alive = true };
+    char method_name[8], *uri = (char *)req.uri;
+    size_t hdr_len = conn->pending_len;
+    char *hdr_end;
+
+    memcpy(aux.hdr, conn->pending, hdr_len);
+    aux.hdr[hdr_len] = 0;
+    while((hdr_end = strstr(aux.hdr, "\r\n\r\n")) == NULL){
+        if(hdr_len == HTTPD_MAX_REQ_HDR_LEN){
+            send_raw_err(conn->fd, "431 Request Header Fields Too Large");
+            close_conn(conn);
+            return;
+        }
+        const ssize_t received = recv(conn->fd, aux.hdr + hdr_len, HTTPD_MAX_REQ_HDR_LEN - hdr_len, 0);
+        if(received <= 0){
+            if(received < 0 && hdr_len) send_raw_err(conn->fd, "408 Request Timeout");
+            close_conn(conn);
+            return;
+        }
+        hdr_len += received;
+        aux.hdr[hdr_len] = 0;
+    }
+    hdr_end += 4;
+    conn->pending_len = aux.hdr + hdr_len - hdr_end;
+    memcpy(conn->pending, hdr_end, conn->pending_len);
+    *hdr_end = 0;
+
+    const char *line_end = strstr(aux.hdr, "\r\n");
+    const char *uri_start = memchr(aux.hdr, ' ', line_end - aux.hdr);
+    const char *uri_end = uri_start ? memchr(uri_start + 1, ' ', line_end - uri_start - 1) : NULL;
+    if(uri_end == NULL || uri_start - aux.hdr >= sizeof(method_name)){
+        send_raw_err(conn->fd, "400 Bad Request");
+        close_conn(conn);
+        return;
+    }
+    if(uri_end - uri_start - 1 > HTTPD_MAX_URI_LEN){
+        send_raw_err(conn->fd, "414 URI Too Long");
+        close_conn(conn);
+        return;
+    }
+    memcpy(method_name, aux.hdr, uri_start - aux.hdr);
+    method_name[uri_start - aux.hdr] = 0;
+    memcpy(uri, uri_start + 1, uri_end - uri_start - 1);
+    uri[uri_end - uri_start - 1] = 0;
+    req.method = parse_method(method_name);
+    req.aux = &aux;
+
+    char value[32];
+    if(httpd_req_get_hdr_value_str(&req, "Content-Length", value, sizeof(value)) == ESP_OK){
+        req.content_len = strtoul(value, NULL, 10);
+    }
+    if(httpd_req_get_hdr_value_str(&req, "Connection", value, sizeof(value)) == ESP_OK
+            && strcasecmp(value, "close") == 0){
+        aux.keep_alive = false;
+    }
+    aux.remaining = req.content_len;
+
+    const httpd_uri_t *handler = NULL;
+    bool uri_found = false;
+    for(size_t i=0; i<srv->handler_num && handler == NULL; ++i){
+        const httpd_uri_t *h = &srv->handlers[i];
+        const bool match = srv->config.uri_match_fn
+                        ? srv->config.uri_match_fn(h->uri, uri, strlen(uri))
+                        : strcmp(h->uri, uri) == 0;
+        uri_found |= match;
+        if(match && h->method == req.method) handler = h;
+    }
+    if(handler == NULL){
+        aux.keep_alive = false;
+        httpd_resp_send_err(&req, uri_found ? HTTPD_400_BAD_REQUEST : HTTPD_404_NOT_FOUND,
+                    uri_found ? "Method not allowed" : NULL);
+        close_conn(conn);
+        return;
+    }
+    req.user_ctx = handler->user_ctx;
+    // a failed handler loses its session, as on the device
+    if(handler->handler(&req) != ESP_OK){
+        close_conn(conn);
+        return;
+    }
+    // what the handler left of the body is dropped
+    while(aux.remaining > 0){
+        char drop[128];
+        const int received = httpd_req_recv(&req, drop, sizeof(drop));
+        if(received <= 0){
+            close_conn(conn);
+            return;
+        }
+    }
+    if(!aux.keep_alive) close_conn(conn);
+}
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t buf_len)
+{
+    shim_aux_t *aux = (shim_aux_t *)r->aux;
+    shim_conn_t *conn = aux->conn;
+    size_t len = buf_len < aux->remaining ? buf_len : aux->remaining;
+    if(len == 0) return 0;
+    if(conn->pending_len){
+        if(len > conn->pending_len) len = conn->pending_len;
+        memcpy(buf, conn->pending, len);
+        conn->pending_len -= len;
+        memmove(conn->pending, conn->pending + len, conn->pending_len);
+        aux->remaining -= len;
+        return len;
+    }
+    const ssize_t received = recv(conn->fd, buf, len, 0);
+    if(received < 0){
+        return errno == EAGAIN || errno == EWOULDBLOCK ? HTTPD_SOCK_ERR_TIMEOUT : HTTPD_SOCK_ERR_FAIL;
+    }
+    aux->remaining -= received;
+    return received;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field, char *val, size_t val_size)
+{
+    const shim_aux_t *aux = (const shim_aux_t *)r->aux;
+    const size_t field_len = strlen(field);
+    // the request line comes first, header lines follow it
+    for(const char *line = strstr(aux->hdr, "\r\n"); line && line[2]; line = strstr(line + 2, "\r\n")){
+        const char *name = line + 2;
+        if(strncasecmp(name, field, field_len) != 0 || name[field_len] != ':') continue;
+        const char *value = name + field_len + 1;
+        while(*value == ' ') ++value;
+        const size_t len = strstr(value, "\r\n") - value;
+        if(len >= val_size){
+            if(val_size){
+                memcpy(val, value, val_size - 1);
+                val[val_size - 1] = 0;
+            }
+            return ESP_ERR_HTTPD_RESULT_TRUNC;
+        }
+        memcpy(val, value, len);
+        val[len] = 0;
+        return ESP_OK;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status)
+{
+    ((shim_aux_t *)r->aux)->status = status;
+    return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type)
+{
+    ((shim_aux_t *)r->aux)->type = type;
+    return ESP_OK;
+}
+
+// the strings are kept by pointer until the response goes out, like on the device
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field, const char *value)
+{
+    shim_aux_t *aux = (shim_aux_t *)r->aux;
+    if(aux->resp_hdr_num == SHIM_MAX_RESP_HDRS) return ESP_ERR_NO_MEM;
+    aux->resp_hdr[aux->resp_hdr_num++] = (shim_hdr_t){ field, value };
+    return ESP_OK;
+}
+
+static int send_all(int fd, const char *data, size_t len)
+{
+    while(len > 0){
+        const ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if(sent <= 0) return ESP_FAIL;
+        data += sent;
+        len -= sent;
+    }
+    return ESP_OK;
+}
+
+// status line and headers, length_line tells how the body is framed; the body
+// follows in its own send as with httpd, so with Nagle a keep-alive client
+// waits out its delayed ACK in between, as the session latency shows
+static int send_head(httpd_req_t *r, const char *length_line)
+{
+    const shim_aux_t *aux = (const shim_aux_t *)r->aux;
+    char head[SHIM_RESP_HDR_LEN];
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 %s\r\nContent-Type: %s\r\n",
+                    aux->status ? aux->status : "200 OK", aux->type ? aux->type : "text/html");
+    len += snprintf(head + len, sizeof(head) - len, "%s", length_line);
+    for(size_t i=0; i<aux->resp_hdr_num && len < sizeof(head); ++i){
+        len += snprintf(head + len, sizeof(head) - len, "%s: %s\r\n",
+                    aux->resp_hdr[i].field, aux->resp_hdr[i].value);
+    }
+    if(!aux->keep_alive && len < sizeof(head)){
+        len += snprintf(head + len, sizeof(head) - len, "Connection: close\r\n");
+    }
+    if(len + 2 >= sizeof(head)) return ESP_ERR_INVALID_SIZE;
+    memcpy(head + len, "\r\n", 2);
+    return send_all(aux->conn->fd, head, len + 2);
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    const shim_aux_t *aux = (const shim_aux_t *)r->aux;
+    char length_line[40];
+    if(buf_len == HTTPD_RESP_USE_STRLEN) buf_len = buf ? strlen(buf) : 0;
+    snprintf(length_line, sizeof(length_line), "Content-Length: %zd\r\n", buf_len);
+    if(send_head(r, length_line) != ESP_OK) return ESP_FAIL;
+    return buf_len ? send_all(aux->conn->fd, buf, buf_len) : ESP_OK;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf, ssize_t buf_len)
+{
+    shim_aux_t *aux = (shim_aux_t *)r->aux;
+    char size_line[20];
+    if(buf_len == HTTPD_RESP_USE_STRLEN) buf_len = buf ? strlen(buf) : 0;
+    if(!aux->chunked){
+        if(send_head(r, "Transfer-Encoding: chunked\r\n") != ESP_OK) return ESP_FAIL;
+        aux->chunked = true;
+    }
+    const int line_len = snprintf(size_line, sizeof(size_line), "%zx\r\n", (size_t)buf_len);
+    if(send_all(aux->conn->fd, size_line, line_len) != ESP_OK
+            || (buf_len && send_all(aux->conn->fd, buf, buf_len) != ESP_OK)){
+        return ESP_FAIL;
+    }
+    return send_all(aux->conn->fd, "\r\n", 2);
+}
+
+esp_err_t httpd_resp_sendstr(httpd_req_t *r, const char *str)
+{
+    return httpd_resp_send(r, str, str ? strlen(str) : 0);
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *r, httpd_err_code_t error, const char *message)
+{
+    static const struct { const char *status; const char *message; } errors[] = {
+        [HTTPD_400_BAD_REQUEST]                 = { "400 Bad Request", "Bad request syntax" },
+        [HTTPD_404_NOT_FOUND]                   = { "404 Not Found", "This URI does not exist" },
+        [HTTPD_408_REQ_TIMEOUT]                 = { "408 Request Timeout", "Server closed this connection" },
+        [HTTPD_431_REQ_HDR_FIELDS_TOO_LARGE]    = { "431 Request Header Fields Too Large", "Header fields are too long" },
+        [HTTPD_500_INTERNAL_SERVER_ERROR]       = { "500 Internal Server Error", "Server has encountered an unexpected error" },
+    };
+    shim_aux_t *aux = (shim_aux_t *)r->aux;
+    aux->status = errors[error].status;
+    aux->type = "text/html";
+    aux->resp_hdr_num = 0;
+    return httpd_resp_sendstr(r, message ? message : errors[error].message);
+}
+
+static void send_raw_err(int fd, const char *status)
+{
+    char reply[128];
+    const int len = snprintf(reply, sizeof(reply),
+                    "HTTP/1.1 %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status);
+    send_all(fd, reply, len);
+}
@@ -0,0 +1,276 @@
+#include "server_fakes.h"
+
+#include <malloc.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "device_common.h"
+#include "setting_server.h"
+#include "ota_session.h"
+#include "adc_reader.h"
+#include "time_sync.h"
+#include "clock_module.h"
+#include "wifi_service.h"
+#include "esp_chip_info.h"
+#include "esp_system.h"
+#include "esp_heap_caps.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+// about what the firmware has free with WiFi and the server up
+#define HOST_HEAP_LEN (120*1024)
+
+
+device_metrics_t device_metrics;
+
+static settings_data_t settings;
+static unsigned state_bits;
+static unsigned commit_num;
+static long long time_sec;
+static dns_server_stats_t dns_stats;
+
+static size_t heap_used;
+static size_t heap_peak;
+
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t num, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+static void heap_add(void *ptr)
+{
+    if(ptr == NULL) return;
+    const size_t used = __atomic_add_fetch(&heap_used, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+    while(used > peak && !__atomic_compare_exchange_n(&heap_peak, &peak, used, true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+    }
+}
+
+static void heap_sub(void *ptr)
+{
+    if(ptr == NULL) return;
+    __atomic_sub_fetch(&heap_used, malloc_usable_size(ptr), __ATOMIC_RELAXED);
+}
+
+void *__wrap_malloc(size_t size)
+{
+    void *ptr = __real_malloc(size);
+    heap_add(ptr);
+    return ptr;
+}
+
+void *__wrap_calloc(size_t num, size_t size)
+{
+    void *ptr = __real_calloc(num, size);
+    heap_add(ptr);
+    return ptr;
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    heap_sub(ptr);
+    void *res = __real_realloc(ptr, size);
+    heap_add(res ? res : ptr);
+    return res;
+}
+
+void __wrap_free(void *ptr)
+{
+    heap_sub(ptr);
+    __real_free(ptr);
+}
+
+size_t host_heap_get_used(void)
+{
+    return __atomic_load_n(&heap_used, __ATOMIC_RELAXED);
+}
+
+size_t host_heap_get_peak(void)
+{
+    return __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+}
+
+void host_heap_reset_peak(void)
+{
+    __atomic_store_n(&heap_peak, host_heap_get_used(), __ATOMIC_RELAXED);
+}
+
+uint32_t esp_get_free_heap_size(void)
+{
+    return HOST_HEAP_LEN - host_heap_get_used();
+}
+
+uint32_t esp_get_minimum_free_heap_size(void)
+{
+    return HOST_HEAP_LEN - host_heap_get_peak();
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+    return esp_get_free_heap_size();
+}
+
+
+// --------------------------------------- settings
+unsigned device_fake_get_commit_num(void)
+{
+    return commit_num;
+}
+
+long long device_fake_get_time_sec(void)
+{
+    return time_sec;
+}
+
+void device_fake_reset(void)
+{
+    free(settings.notification);
+    memset(&settings, 0, sizeof(settings));
+    strcpy(settings.ssid, "home");
+    strcpy(settings.pwd, "password");
+    strcpy(settings.city_name, "Kyiv");
+    settings.loud = 50;
+    settings.time_offset = 2;
+    state_bits = BIT_NOTIF_ENABLE;
+    commit_num = 0;
+}
+
+char *device_get_ssid()         { return settings.ssid; }
+char *device_get_pwd()          { return settings.pwd; }
+char *device_get_api_key()      { return settings.api_key; }
+char *device_get_city_name()    { return settings.city_name; }
+unsigned *device_get_schema()   { return settings.schema; }
+uint16_t *device_get_notif()    { return settings.notification; }
+int device_get_offset()         { return settings.time_offset; }
+unsigned device_get_loud()      { return settings.loud; }
+
+void device_set_ssid(const char *str)   { strncpy(settings.ssid, str, MAX_STR_LEN); }
+void device_set_pwd(const char *str)    { strncpy(settings.pwd, str, MAX_STR_LEN); }
+void device_set_city(const char *str)   { strncpy(settings.city_name, str, MAX_STR_LEN); }
+void device_set_offset(int time_offset) { settings.time_offset = time_offset; }
+void device_set_loud(int loud)          { settings.loud = loud; }
+
+void device_set_key(const char *str)
+{
+    if(strnlen(str, API_LEN+1) == API_LEN){
+        strcpy(settings.api_key, str);
+    }
+}
+
+// takes ownership of notif_data like the device does, the schema follows the days
+void device_set_notify_data(uint16_t *notif_data, unsigned notif_num)
+{
+    free(settings.notification);
+    settings.notification = notif_data;
+    memset(settings.schema, 0, sizeof(settings.schema));
+    for(unsigned i=0; i<notif_num; ++i){
+        settings.schema[notif_data[i]/DAY_MIN_NUM] += 1;
+    }
+}
+
+unsigned get_notif_num(unsigned *schema)
+{
+    unsigned res = 0;
+    for(int i=0; i<WEEK_DAYS_NUM; ++i){
+        res += schema[i];
+    }
+    return res;
+}
+
+int device_commit_changes()
+{
+    commit_num += 1;
+    return ESP_OK;
+}
+
+unsigned device_get_state()
+{
+    return __atomic_load_n(&state_bits, __ATOMIC_RELAXED);
+}
+
+unsigned device_set_state(unsigned bits)
+{
+    return __atomic_or_fetch(&state_bits, bits, __ATOMIC_RELAXED);
+}
+
+unsigned device_clear_state(unsigned bits)
+{
+    return __atomic_and_fetch(&state_bits, ~bits, __ATOMIC_RELAXED);
+}
+
+void set_time_sec(long long sec)
+{
+    time_sec = sec;
+}
+
+float device_get_voltage(void)
+{
+    return 3.9f;
+}
+
+// a fresh setup: one connect with a full scan and DHCP
+void wifi_get_stats(wifi_sm_stats_t *stats)
+{
+    *stats = (wifi_sm_stats_t){ .connect_num = 1, .last_connect_ms = 2210, .max_connect_ms = 2210 };
+}
+
+float time_sync_get_drift_ppm()
+{
+    return 0;
+}
+
+
+// --------------------------------------- captive DNS, OTA, system
+void init_dns_server_task()
+{
+}
+
+void deinit_dns_server()
+{
+}
+
+const dns_server_stats_t *dns_server_get_stats()
+{
+    return &dns_stats;
+}
+
+// OTA is not part of the load, the session only answers that nothing runs
+int ota_session_init(char *buf_a, char *buf_b, size_t buf_len)  { return ESP_OK; }
+void ota_session_deinit()                                       { }
+int ota_session_begin(size_t total, const unsigned char *digest){ return ESP_ERR_NOT_SUPPORTED; }
+int ota_session_write(ota_read_cb_t read_cb, void *ctx, size_t len) { return ESP_ERR_NOT_SUPPORTED; }
+int ota_session_finish()                                        { return ESP_ERR_NOT_SUPPORTED; }
+void ota_session_abort()                                        { }
+bool ota_session_is_active()                                    { return false; }
+size_t ota_session_get_written()                                { return 0; }
+size_t ota_session_get_total()                                  { return 0; }
+int ota_session_get_progress()                                  { return 0; }
+
+void esp_chip_info(esp_chip_info_t *out_info)
+{
+    *out_info = (esp_chip_info_t){ .model = CHIP_ESP32, .revision = 3, .cores = 2 };
+}
+
+void esp_restart(void)
+{
+    abort();
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t *buf, uint32_t len)
+{
+    return crc32(crc, buf, len);
+}
+
+TaskHandle_t xTaskGetHandle(const char *name)
+{
+    return NULL;
+}
+
+UBaseType_t uxTaskGetNumberOfTasks(void)
+{
+    return 1;
+}
@@ -0,0 +1,19 @@
+#ifndef SERVER_FAKES_H
+#define SERVER_FAKES_H
+
+// device side of the settings server on the host: an in-memory settings
+// store and the heap as the firmware code sees it
+
+#include <stddef.h>
+
+// bytes held by the code under test, malloc, calloc and realloc are wrapped
+size_t host_heap_get_used(void);
+size_t host_heap_get_peak(void);
+void host_heap_reset_peak(void);
+
+unsigned device_fake_get_commit_num(void);
+long long device_fake_get_time_sec(void);
+// frees the stored schedule, back to the defaults
+void device_fake_reset(void);
+
+#endif
@@ -0,0 +1,143 @@
+// the streaming JSON reader and writer of the settings server,
+// every document is also fed one byte at a time
+
+#include "json_stream.h"
+#include "esp_err.h"
+#include "host_test.h"
+
+#include <string.h>
+
+#define FIELD_MAX 8
+
+typedef struct {
+    int num;
+    char key[FIELD_MAX][JSON_KEY_LEN+1];
+    json_type_t type[FIELD_MAX];
+    char value[FIELD_MAX][256];
+} fields_t;
+
+
+static int collect_cb(void *ctx, const char *key, json_type_t type,
+                        const char *value, size_t len, bool is_last)
+{
+    fields_t *fields = (fields_t *)ctx;
+    if(fields->num == FIELD_MAX) return ESP_ERR_NO_MEM;
+    strcpy(fields->key[fields->num], key);
+    fields->type[fields->num] = type;
+    strncat(fields->value[fields->num], value, len);
+    if(is_last) fields->num += 1;
+    return ESP_OK;
+}
+
+static int parse(const char *text, size_t piece, fields_t *fields)
+{
+    json_stream_t js;
+    memset(fields, 0, sizeof(fields_t));
+    json_stream_init(&js, collect_cb, fields);
+    for(size_t pos = 0, len = strlen(text); pos < len; pos += piece){
+        const int err = json_stream_feed(&js, text + pos, len - pos < piece ? len - pos : piece);
+        if(err != ESP_OK) return err;
+    }
+    return json_stream_done(&js) ? ESP_OK : ESP_ERR_INVALID_ARG;
+}
+
+static int write_cb(void *ctx, const char *data, size_t len)
+{
+    strncat((char *)ctx, data, len);
+    return ESP_OK;
+}
+
+
+static void test_fields(void)
+{
+    static const char text[] = " { \"SSID\" : \"home\\u00e9\\n\", \"Hour\":-3,\"on\":true , \"x\":null } ";
+    fields_t fields;
+    for(size_t piece = 1; piece <= sizeof(text); piece += sizeof(text)-2){
+        TEST_CHECK(parse(text, piece, &fields) == ESP_OK);
+        TEST_CHECK(fields.num == 4);
+        TEST_CHECK(strcmp(fields.key[0], "SSID") == 0 && strcmp(fields.value[0], "home\xc3\xa9\n") == 0);
+        TEST_CHECK(fields.type[1] == JSON_TYPE_NUMBER && strcmp(fields.value[1], "-3") == 0);
+        TEST_CHECK(fields.type[2] == JSON_TYPE_BOOL && strcmp(fields.value[2], "true") == 0);
+        TEST_CHECK(fields.type[3] == JSON_TYPE_NULL);
+    }
+}
+
+// a long string reaches the callback in JSON_VALUE_LEN pieces
+static void test_long_string(void)
+{
+    char text[300], notif[201];
+    fields_t fields;
+    memset(notif, 'a', sizeof(notif)-1);
+    notif[sizeof(notif)-1] = 0;
+    snprintf(text, sizeof(text), "{\"notif\":\"%s\"}", notif);
+    TEST_CHECK(parse(text, 1, &fields) == ESP_OK);
+    TEST_CHECK(fields.num == 1 && strcmp(fields.value[0], notif) == 0);
+}
+
+static void test_long_key_skipped(void)
+{
+    char text[400], long_value[201];
+    fields_t fields;
+    memset(long_value, 'b', sizeof(long_value)-1);
+    long_value[sizeof(long_value)-1] = 0;
+    snprintf(text, sizeof(text), 
+            "{\"a_key_longer_than_sixteen\":\"x\",\"City\":\"Paris\","
+            "\"another_long_key_here\":12.5e3,\"yet_another_long_key\":\"%s\","
+            "\"escaped_\\u00e9_long_key_name\":false,\"%%\":40}", long_value);
+    TEST_CHECK(parse(text, 1, &fields) == ESP_OK);
+    TEST_CHECK(fields.num == 2);
+    TEST_CHECK(strcmp(fields.key[0], "City") == 0 && strcmp(fields.value[0], "Paris") == 0);
+    TEST_CHECK(strcmp(fields.key[1], "%") == 0 && strcmp(fields.value[1], "40") == 0);
+    // a skipped field is still read as JSON
+    TEST_CHECK(parse("{\"a_key_longer_than_sixteen\":tru}", 1, &fields) != ESP_OK);
+    TEST_CHECK(parse("{\"a_key_longer_than_sixteen\":\"\\q\"}", 1, &fields) != ESP_OK);
+}
+
+static void test_malformed(void)
+{
+    static const char *text_list[] = {
+        "", "[]", "{", "{\"a\"}", "{\"a\":}", "{\"a\":1,}", "{\"a\":1}x", 
+        "{\"a\":01x}", "{\"a\":\"\x01\"}", "{\"a\":\"\\ud800\"}", "{a:1}",
+    };
+    fields_t fields;
+    for(int i=0; i<sizeof(text_list)/sizeof(text_list[0]); ++i){
+        TEST_CHECK(parse(text_list[i], 1, &fields) != ESP_OK);
+    }
+    TEST_CHECK(parse("{}", 1, &fields) == ESP_OK && fields.num == 0);
+}
+
+static void test_writer(void)
+{
+    char out[512] = "";
+    json_writer_t jw;
+    json_write_begin(&jw, write_cb, out);
+    json_write_str(&jw, "City", "\"Zürich\"\n");
+    json_write_num(&jw, "Hour", -3);
+    json_write_float(&jw, "volts", 3.75);
+    json_write_str_begin(&jw, "notif");
+    for(int i=0; i<50; ++i){
+        json_write_raw(&jw, "1e0", 3);
+    }
+    json_write_str_end(&jw);
+    TEST_CHECK(json_write_end(&jw) == ESP_OK);
+    char expected[512] = "{\"City\":\"\\\"Zürich\\\"\\u000a\",\"Hour\":-3,\"volts\":3.75,\"notif\":\"";
+    for(int i=0; i<50; ++i){
+        strcat(expected, "1e0");
+    }
+    strcat(expected, "\"}");
+    TEST_CHECK(strcmp(out, expected) == 0);
+    fields_t fields;
+    TEST_CHECK(parse(out, 5, &fields) == ESP_OK && fields.num == 4);
+    TEST_CHECK(strcmp(fields.value[0], "\"Zürich\"\n") == 0);
+}
+
+
+int main(void)
+{
+    TEST_RUN(test_fields);
+    TEST_RUN(test_long_string);
+    TEST_RUN(test_long_key_skipped);
+    TEST_RUN(test_malformed);
+    TEST_RUN(test_writer);
+    return host_test_fail_num;
+}
@@ -0,0 +1,29 @@
+#include "device_common.h"
+#include "clock_module.h"
+
+#include <string.h>
+#include <time.h>
+
+
+// the published forecast, the firmware keeps it in a snapshot
+static service_data_t service_data = {
+    .update_data_time = NO_DATA,
+};
+
+
+void device_get_service_data(service_data_t *data)
+{
+    memcpy(data, &service_data, sizeof(service_data_t));
+}
+
+void device_publish_service_data(const service_data_t *data)
+{
+    memcpy(&service_data, data, sizeof(service_data_t));
+}
+
+struct tm* get_cur_time_tm(void)
+{
+    static struct tm tm_info;
+    const time_t now = time(NULL);
+    return localtime_r(&now, &tm_info);
+}
@@ -0,0 +1,75 @@
+#ifndef HOST_MINIZ_H
+#define HOST_MINIZ_H
+
+// the part of the ROM miniz the components use, backed by the host zlib
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <zlib.h>
+
+typedef unsigned char mz_uint8;
+typedef uint32_t mz_uint32;
+typedef unsigned long mz_ulong;
+
+#define MZ_CRC32_INIT 0
+
+typedef enum {
+    TINFL_STATUS_FAILED             = -1,
+    TINFL_STATUS_DONE               = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT   = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT    = 2,
+} tinfl_status;
+
+enum {
+    TINFL_FLAG_PARSE_ZLIB_HEADER            = 1,
+    TINFL_FLAG_HAS_MORE_INPUT               = 2,
+    TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4,
+};
+
+typedef struct {
+    z_stream stream;
+    int started;
+} tinfl_decompressor;
+
+#define tinfl_init(r) do{ (r)->started = 0; }while(0)
+
+static inline mz_ulong mz_crc32(mz_ulong crc, const unsigned char *ptr, size_t buf_len)
+{
+    return crc32(crc, ptr, buf_len);
+}
+
+// raw deflate only, like tinfl without TINFL_FLAG_PARSE_ZLIB_HEADER
+static inline tinfl_status tinfl_decompress(tinfl_decompressor *r,
+                                            const mz_uint8 *in, size_t *in_size,
+                                            mz_uint8 *out_start, mz_uint8 *out_next,
+                                            size_t *out_size, const mz_uint32 flags)
+{
+    (void)out_start;
+    (void)flags;
+    if(!r->started){
+        memset(&r->stream, 0, sizeof(r->stream));
+        if(inflateInit2(&r->stream, -15) != Z_OK) return TINFL_STATUS_FAILED;
+        r->started = 1;
+    }
+    r->stream.next_in = (unsigned char *)in;
+    r->stream.avail_in = *in_size;
+    r->stream.next_out = out_next;
+    r->stream.avail_out = *out_size;
+    const int res = inflate(&r->stream, Z_NO_FLUSH);
+    *in_size -= r->stream.avail_in;
+    *out_size -= r->stream.avail_out;
+    if(res == Z_STREAM_END){
+        inflateEnd(&r->stream);
+        r->started = 0;
+        return TINFL_STATUS_DONE;
+    }
+    if(res != Z_OK && res != Z_BUF_ERROR){
+        inflateEnd(&r->stream);
+        r->started = 0;
+        return TINFL_STATUS_FAILED;
+    }
+    return r->stream.avail_out == 0 ? TINFL_STATUS_HAS_MORE_OUTPUT : TINFL_STATUS_NEEDS_MORE_INPUT;
+}
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef HOST_ESP_HEAP_CAPS_H
+#define HOST_ESP_HEAP_CAPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT     (1<<2)
+
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef HOST_FREERTOS_H
+#define HOST_FREERTOS_H
+
+// host stand-in for the FreeRTOS types and macros, one tick is a millisecond
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef void *TaskHandle_t;
+
+#define portTICK_PERIOD_MS  1
+#define portMAX_DELAY       0xffffffff
+#define pdMS_TO_TICKS(ms_)  ((TickType_t)(ms_))
+#define pdTRUE              1
+#define pdFALSE             0
+#define pdPASS              pdTRUE
+#define pdFAIL              pdFALSE
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef HOST_PORTMACRO_H
+#define HOST_PORTMACRO_H
+
+#include "freertos/FreeRTOS.h"
+
+#endif
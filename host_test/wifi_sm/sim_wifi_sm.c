@@ -0,0 +1,324 @@
+// wifi_sm against a scripted radio on a virtual clock: the driver side
+// answers every connect the way the ESP32 WiFi driver and a router would,
+// connect_sta()'s timeout and the session stop come from wifi_service;
+// prints time-to-connect and radio-on per scenario
+
+#include "wifi_sm.h"
+#include "host_test.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+// as in wifi_service.c
+#define STA_CONNECT_TIMEOUT_MS  10000
+#define STA_RETRY_NUM           5
+
+// typical ESP32 figures, the scenarios change the ones they are about
+#define RADIO_START_MS          60
+#define SCAN_ALL_MS             1600
+#define SCAN_CACHED_MS          120
+#define ASSOC_MS                150
+#define HANDSHAKE_FAIL_MS       2000
+#define LEASE_REUSE_MS          10
+#define DHCP_MS                 400
+// online time of a forecast update before the radio goes down
+#define SESSION_HOLD_MS         1500
+
+#define QUEUE_LEN               16
+#define SIM_END_MS              120000
+
+typedef struct {
+    bool ap_present;
+    bool password_ok;
+    // the last session left the AP and the lease in the cache
+    bool cached;
+    uint32_t dhcp_ms;
+    // the link drops this long after the first connect, 0 for never
+    uint32_t drop_after_ms;
+} sim_router_t;
+
+typedef struct {
+    wifi_sm_event_t event;
+    bool used;
+} sim_slot_t;
+
+typedef struct {
+    wifi_sm_t sm;
+    sim_router_t router;
+    uint32_t now_ms;
+    sim_slot_t queue[QUEUE_LEN];
+    // connect_sta() is still waiting for a result
+    bool waiting;
+    bool cached_ap;
+    bool lease;
+    bool online;
+    bool ap_missing;
+    bool ap_client;
+    bool dropped;
+    unsigned connect_num;
+    unsigned no_client_num;
+} sim_t;
+
+typedef struct {
+    bool online;
+    bool ap_missing;
+    unsigned connect_num;
+    uint32_t connect_ms;
+    unsigned long long radio_on_ms;
+} sim_result_t;
+
+
+static void post_at(sim_t *sim, uint32_t time_ms, wifi_sm_event_id_t id, bool flag)
+{
+    for(int i=0; i<QUEUE_LEN; ++i){
+        if(sim->queue[i].used) continue;
+        sim->queue[i] = (sim_slot_t){
+            .event = { .id = id, .time_ms = time_ms, .use_cached_ap = flag, .ap_missing = flag },
+            .used = true,
+        };
+        return;
+    }
+    TEST_CHECK(!"event queue full");
+}
+
+static void post(sim_t *sim, uint32_t delay_ms, wifi_sm_event_id_t id, bool flag)
+{
+    post_at(sim, sim->now_ms + delay_ms, id, flag);
+}
+
+static void drop_events(sim_t *sim, wifi_sm_event_id_t id)
+{
+    for(int i=0; i<QUEUE_LEN; ++i){
+        if(sim->queue[i].event.id == id) sim->queue[i].used = false;
+    }
+}
+
+// what the driver and the router make of one esp_wifi_connect()
+static void radio_connect(sim_t *sim)
+{
+    const sim_router_t *router = &sim->router;
+    const uint32_t scan_ms = sim->cached_ap ? SCAN_CACHED_MS : SCAN_ALL_MS;
+    sim->connect_num += 1;
+    if(!router->ap_present){
+        // WIFI_REASON_NO_AP_FOUND
+        post(sim, scan_ms, WIFI_SM_EV_DISCONNECTED, true);
+    } else if(!router->password_ok){
+        // WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT, the AP is there
+        post(sim, scan_ms + HANDSHAKE_FAIL_MS, WIFI_SM_EV_DISCONNECTED, false);
+    } else {
+        post(sim, scan_ms + ASSOC_MS, WIFI_SM_EV_ASSOCIATED, false);
+        post(sim, scan_ms + ASSOC_MS + (sim->lease ? LEASE_REUSE_MS : router->dhcp_ms), WIFI_SM_EV_GOT_IP, false);
+    }
+}
+
+// the part of wifi_service's run_actions() the radio and connect_sta() see
+static void run_actions(sim_t *sim, unsigned actions)
+{
+    if(actions&WIFI_SM_ACT_OFFLINE){
+        sim->online = false;
+    }
+    if(actions&WIFI_SM_ACT_DROP_CACHED_AP){
+        sim->cached_ap = sim->lease = false;
+    }
+    if(actions&WIFI_SM_ACT_CONNECT){
+        radio_connect(sim);
+    }
+    if(actions&WIFI_SM_ACT_ONLINE){
+        sim->online = true;
+        if(sim->router.drop_after_ms && !sim->dropped){
+            sim->dropped = true;
+            post(sim, sim->router.drop_after_ms, WIFI_SM_EV_DISCONNECTED, false);
+        }
+    }
+    if(actions&WIFI_SM_ACT_AP_MISSING){
+        sim->ap_missing = true;
+    }
+    if(actions&WIFI_SM_ACT_AP_CLIENT){
+        sim->ap_client = true;
+    }
+    if(actions&WIFI_SM_ACT_AP_NO_CLIENT){
+        sim->ap_client = false;
+        sim->no_client_num += 1;
+    }
+    if(sim->waiting && (sim->online || sim->ap_missing)){
+        // connect_sta() returns, the radio stays up for the session only
+        sim->waiting = false;
+        drop_events(sim, WIFI_SM_EV_TIMEOUT);
+        post(sim, sim->online ? SESSION_HOLD_MS + sim->router.drop_after_ms : 0, WIFI_SM_EV_STOP, false);
+    }
+}
+
+static void dispatch(sim_t *sim, const wifi_sm_event_t *event)
+{
+    if(event->id == WIFI_SM_EV_TIMEOUT){
+        // connect_sta() gave up, the caller stops the radio
+        sim->waiting = false;
+        run_actions(sim, wifi_sm_handle(&sim->sm, event));
+        post(sim, 0, WIFI_SM_EV_STOP, false);
+        return;
+    }
+    if(event->id == WIFI_SM_EV_STOP){
+        // esp_wifi_stop() drops whatever the driver still had coming
+        memset(sim->queue, 0, sizeof(sim->queue));
+    }
+    run_actions(sim, wifi_sm_handle(&sim->sm, event));
+}
+
+static void run(sim_t *sim, uint32_t until_ms)
+{
+    for(;;){
+        sim_slot_t *next = NULL;
+        for(int i=0; i<QUEUE_LEN; ++i){
+            if(sim->queue[i].used && (next == NULL || sim->queue[i].event.time_ms < next->event.time_ms)){
+                next = &sim->queue[i];
+            }
+        }
+        if(next == NULL || next->event.time_ms > until_ms) break;
+        const wifi_sm_event_t event = next->event;
+        next->used = false;
+        sim->now_ms = event.time_ms;
+        dispatch(sim, &event);
+    }
+    sim->now_ms = until_ms;
+}
+
+// one connect_sta() session from the start of the radio to its stop
+static sim_result_t connect_session(const sim_router_t *router)
+{
+    static sim_t sim;
+    memset(&sim, 0, sizeof(sim));
+    wifi_sm_init(&sim.sm, STA_RETRY_NUM);
+    sim.router = *router;
+    sim.cached_ap = sim.lease = router->cached;
+    sim.waiting = true;
+    sim.now_ms = 1000;
+    run_actions(&sim, wifi_sm_handle(&sim.sm, &(wifi_sm_event_t){
+                    .id = WIFI_SM_EV_START_STA, .time_ms = sim.now_ms, .use_cached_ap = router->cached }));
+    post(&sim, RADIO_START_MS, WIFI_SM_EV_STA_START, false);
+    post(&sim, STA_CONNECT_TIMEOUT_MS, WIFI_SM_EV_TIMEOUT, false);
+    run(&sim, SIM_END_MS);
+    TEST_CHECK(sim.sm.state == WIFI_SM_IDLE);
+    return (sim_result_t){
+        .online = sim.sm.stats.connect_num > 0,
+        .ap_missing = sim.ap_missing,
+        .connect_num = sim.connect_num,
+        .connect_ms = sim.sm.stats.last_connect_ms,
+        .radio_on_ms = sim.sm.stats.radio_on_ms,
+    };
+}
+
+static void print_result(const char *name, const sim_result_t *res)
+{
+    if(res->online){
+        printf("%-26s %-10s %9u %9u %10llu\n", name, "online", res->connect_num, res->connect_ms, res->radio_on_ms);
+    } else {
+        printf("%-26s %-10s %9u %9s %10llu\n", name, res->ap_missing ? "ap missing" : "failed",
+                    res->connect_num, "-", res->radio_on_ms);
+    }
+}
+
+
+static void sim_cached_ap(void)
+{
+    const sim_result_t res = connect_session(&(sim_router_t){
+                    .ap_present = true, .password_ok = true, .cached = true, .dhcp_ms = DHCP_MS });
+    print_result("cached AP and lease", &res);
+    TEST_CHECK(res.online && res.connect_num == 1);
+    TEST_CHECK(res.connect_ms == RADIO_START_MS + SCAN_CACHED_MS + ASSOC_MS + LEASE_REUSE_MS);
+    TEST_CHECK(res.radio_on_ms == res.connect_ms + SESSION_HOLD_MS);
+}
+
+static void sim_first_connect(void)
+{
+    const sim_result_t res = connect_session(&(sim_router_t){
+                    .ap_present = true, .password_ok = true, .dhcp_ms = DHCP_MS });
+    print_result("full scan and DHCP", &res);
+    TEST_CHECK(res.online && res.connect_num == 1);
+    TEST_CHECK(res.connect_ms == RADIO_START_MS + SCAN_ALL_MS + ASSOC_MS + DHCP_MS);
+}
+
+// the router is off: the cached channel is tried once, then the retries scan everything
+static void sim_ap_missing(void)
+{
+    const sim_result_t res = connect_session(&(sim_router_t){ .cached = true });
+    print_result("AP missing", &res);
+    TEST_CHECK(!res.online && res.ap_missing);
+    TEST_CHECK(res.connect_num == STA_RETRY_NUM + 2);
+    TEST_CHECK(res.radio_on_ms == RADIO_START_MS + SCAN_CACHED_MS + (STA_RETRY_NUM + 1)*SCAN_ALL_MS);
+    // the missing AP is reported before connect_sta() would give up
+    TEST_CHECK(res.radio_on_ms < STA_CONNECT_TIMEOUT_MS);
+}
+
+// every handshake times out, only connect_sta()'s timeout ends it
+static void sim_wrong_password(void)
+{
+    const sim_result_t res = connect_session(&(sim_router_t){ .ap_present = true, .cached = true });
+    print_result("wrong password", &res);
+    TEST_CHECK(!res.online && !res.ap_missing);
+    TEST_CHECK(res.radio_on_ms == STA_CONNECT_TIMEOUT_MS);
+}
+
+static void sim_slow_dhcp(void)
+{
+    const sim_result_t slow = connect_session(&(sim_router_t){
+                    .ap_present = true, .password_ok = true, .dhcp_ms = 6000 });
+    print_result("slow DHCP (6 s)", &slow);
+    TEST_CHECK(slow.online && slow.connect_num == 1);
+    TEST_CHECK(slow.connect_ms == RADIO_START_MS + SCAN_ALL_MS + ASSOC_MS + 6000);
+
+    // the lease comes after connect_sta() gave up, the late GOT_IP changes nothing
+    const sim_result_t late = connect_session(&(sim_router_t){
+                    .ap_present = true, .password_ok = true, .dhcp_ms = 12000 });
+    print_result("DHCP past the timeout", &late);
+    TEST_CHECK(!late.online && late.radio_on_ms == STA_CONNECT_TIMEOUT_MS);
+}
+
+// the router reboots while the session is online, the reconnect is timed afresh
+static void sim_link_drop(void)
+{
+    const sim_result_t res = connect_session(&(sim_router_t){
+                    .ap_present = true, .password_ok = true, .cached = true,
+                    .dhcp_ms = DHCP_MS, .drop_after_ms = 500 });
+    print_result("link drop and reconnect", &res);
+    TEST_CHECK(res.online && res.connect_num == 2);
+    TEST_CHECK(res.connect_ms == SCAN_CACHED_MS + ASSOC_MS + LEASE_REUSE_MS);
+}
+
+// the portal with a phone that stays and a laptop that keeps dropping out
+static void sim_client_flapping(void)
+{
+    static sim_t sim;
+    memset(&sim, 0, sizeof(sim));
+    wifi_sm_init(&sim.sm, STA_RETRY_NUM);
+    run_actions(&sim, wifi_sm_handle(&sim.sm, &(wifi_sm_event_t){ .id = WIFI_SM_EV_START_AP }));
+    post_at(&sim, 1000, WIFI_SM_EV_AP_CLIENT_JOIN, false);
+    for(uint32_t t=2000; t<40000; t+=2000){
+        post_at(&sim, t, WIFI_SM_EV_AP_CLIENT_JOIN, false);
+        post_at(&sim, t + 700, WIFI_SM_EV_AP_CLIENT_LEAVE, false);
+        run(&sim, t + 1000);
+        TEST_CHECK(sim.ap_client);
+    }
+    post_at(&sim, 39500, WIFI_SM_EV_AP_CLIENT_LEAVE, false);
+    post_at(&sim, 41000, WIFI_SM_EV_STOP, false);
+    run(&sim, SIM_END_MS);
+    printf("%-26s %-10s %9u %9s %10llu\n", "AP client flapping", "no client", sim.no_client_num, "-",
+                sim.sm.stats.radio_on_ms);
+    TEST_CHECK(!sim.ap_client);
+    TEST_CHECK(sim.no_client_num == 1);
+    TEST_CHECK(sim.sm.stats.radio_on_ms == 41000);
+}
+
+
+int main(void)
+{
+    printf("%-26s %-10s %9s %9s %10s\n", "scenario", "outcome", "connects", "to ip ms", "radio ms");
+    TEST_RUN(sim_cached_ap);
+    TEST_RUN(sim_first_connect);
+    TEST_RUN(sim_ap_missing);
+    TEST_RUN(sim_wrong_password);
+    TEST_RUN(sim_slow_dhcp);
+    TEST_RUN(sim_link_drop);
+    TEST_RUN(sim_client_flapping);
+    return host_test_fail_num;
+}